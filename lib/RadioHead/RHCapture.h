@@ -0,0 +1,64 @@
+// RHCapture.h
+//
+// Interface for capturing the RadioHead packets sent and received by drivers,
+// or passing through a simulated ether.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#ifndef RHCapture_h
+#define RHCapture_h
+
+#include <RadioHead.h>
+
+// Directions of captured packets
+// Received by the capturing node
+#define RH_CAPTURE_RX       0
+// Sent by the capturing node
+#define RH_CAPTURE_TX       1
+// Put on the air by a node, as seen by a simulated ether
+#define RH_CAPTURE_AIR      2
+// Heard by a node, but lost in a collision, as seen by a simulated ether
+#define RH_CAPTURE_COLLIDED 3
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHCapture RHCapture.h <RHCapture.h>
+/// \brief Abstract base class for receivers of captured RadioHead packets
+///
+/// A capture can be given to any driver with RHGenericDriver::setCapture(). The driver then
+/// passes every packet it sends, and every packet it receives that is collected by recv(),
+/// to capture(), with its RadioHead headers, RSSI and SNR.
+/// The simulated ethers (RHSimMedium and tools/etherSimulator.cpp) can also capture every
+/// packet that goes over the air, and every reception of it.
+///
+/// Subclasses decide what to do with the packets. RHPcapFile writes them to a pcap file
+/// that can be read by Wireshark with tools/radiohead.lua.
+/// capture() is called in the same context as send() and recv(), so it should be quick.
+///
+/// Drivers that call capture(): RH_RF95, RH_TCP, RH_Sim.
+class RHCapture
+{
+public:
+    /// A captured packet
+    typedef struct
+    {
+	uint8_t        direction; ///< One of RH_CAPTURE_*
+	uint8_t        node;      ///< Address of the capturing node (the sender for RH_CAPTURE_AIR)
+	uint8_t        to;        ///< TO header
+	uint8_t        from;      ///< FROM header
+	uint8_t        id;        ///< ID header
+	uint8_t        flags;     ///< FLAGS header
+	int16_t        rssi;      ///< RSSI in dBm of received packets, 0 if not known
+	int8_t         snr;       ///< SNR in dB of received packets, 0 if not known
+	uint8_t        len;       ///< Length of payload
+	const uint8_t* payload;   ///< The message after the RadioHead headers
+    } Record;
+
+    /// Destructor
+    virtual ~RHCapture() {}
+
+    /// Called with each captured packet. The record and payload are only valid during the call.
+    /// \param[in] record The packet
+    virtual void capture(const Record& record) = 0;
+};
+
+#endif
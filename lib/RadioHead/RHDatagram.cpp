@@ -5,11 +5,16 @@
 
 #include <RHDatagram.h>
 
-RHDatagram::RHDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHDatagram::RHDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     :
     _driver(driver),
     _thisAddress(thisAddress)
 {
+#if RH_ADDRESS_16
+    _txHeaderFrom = thisAddress;
+    _rxHeaderTo = RH_DATAGRAM_BROADCAST_ADDRESS;
+    _rxHeaderFrom = RH_DATAGRAM_BROADCAST_ADDRESS;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -22,22 +27,57 @@ bool RHDatagram::init()
     return ret;
 }
 
-void RHDatagram::setThisAddress(uint8_t thisAddress)
+void RHDatagram::setThisAddress(RHAddress thisAddress)
 {
-    _driver.setThisAddress(thisAddress);
+    // With 16 bit addresses the driver only knows the least significant octet
+    _driver.setThisAddress(thisAddress & 0xff);
     // Use this address in the transmitted FROM header
     setHeaderFrom(thisAddress);
     _thisAddress = thisAddress;
 }
 
-bool RHDatagram::sendto(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHDatagram::sendto(uint8_t* buf, uint8_t len, RHAddress address)
 {
     setHeaderTo(address);
+#if RH_ADDRESS_16
+    // The most significant octets of the addresses go in front of the payload
+    if ((uint16_t)len + RH_DATAGRAM_HEADER_LEN > RH_MAX_MESSAGE_LEN)
+	return false;
+    _buf[0] = address >> 8;
+    _buf[1] = _txHeaderFrom >> 8;
+    memcpy(_buf + RH_DATAGRAM_HEADER_LEN, buf, len);
+    return _driver.send(_buf, len + RH_DATAGRAM_HEADER_LEN);
+#else
     return _driver.send(buf, len);
-}
-
-bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
-{
+#endif
+}
+
+bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
+{
+#if RH_ADDRESS_16
+    uint8_t rxLen = sizeof(_buf);
+    if (!_driver.recv(_buf, &rxLen) || rxLen < RH_DATAGRAM_HEADER_LEN)
+	return false;
+    _rxHeaderTo = (_buf[0] << 8) | _driver.headerTo();
+    _rxHeaderFrom = (_buf[1] << 8) | _driver.headerFrom();
+    // The driver only checked the least significant octet
+    if (   !_driver.promiscuous() 
+	&& _rxHeaderTo != _thisAddress 
+	&& _rxHeaderTo != RH_DATAGRAM_BROADCAST_ADDRESS)
+	return false;
+    rxLen -= RH_DATAGRAM_HEADER_LEN;
+    if (buf && len)
+    {
+	if (*len > rxLen)
+	    *len = rxLen;
+	memcpy(buf, _buf + RH_DATAGRAM_HEADER_LEN, *len);
+    }
+    if (from)  *from =  _rxHeaderFrom;
+    if (to)    *to =    _rxHeaderTo;
+    if (id)    *id =    headerId();
+    if (flags) *flags = headerFlags();
+    return true;
+#else
     if (_driver.recv(buf, len))
     {
 	if (from)  *from =  headerFrom();
@@ -47,6 +87,7 @@ bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to
 	return true;
     }
     return false;
+#endif
 }
 
 bool RHDatagram::available()
@@ -74,19 +115,22 @@ bool RHDatagram::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
     return _driver.waitAvailableTimeout(timeout, polldelay);
 }
 
-uint8_t RHDatagram::thisAddress()
+RHAddress RHDatagram::thisAddress()
 {
     return _thisAddress;
 }
 
-void RHDatagram::setHeaderTo(uint8_t to)
+void RHDatagram::setHeaderTo(RHAddress to)
 {
-    _driver.setHeaderTo(to);
+    _driver.setHeaderTo(to & 0xff);
 }
 
-void RHDatagram::setHeaderFrom(uint8_t from)
+void RHDatagram::setHeaderFrom(RHAddress from)
 {
-    _driver.setHeaderFrom(from);
+#if RH_ADDRESS_16
+    _txHeaderFrom = from;
+#endif
+    _driver.setHeaderFrom(from & 0xff);
 }
 
 void RHDatagram::setHeaderId(uint8_t id)
@@ -99,14 +143,22 @@ void RHDatagram::setHeaderFlags(uint8_t set, uint8_t clear)
     _driver.setHeaderFlags(set, clear);
 }
 
-uint8_t RHDatagram::headerTo()
+RHAddress RHDatagram::headerTo()
 {
+#if RH_ADDRESS_16
+    return _rxHeaderTo;
+#else
     return _driver.headerTo();
+#endif
 }
 
-uint8_t RHDatagram::headerFrom()
+RHAddress RHDatagram::headerFrom()
 {
+#if RH_ADDRESS_16
+    return _rxHeaderFrom;
+#else
     return _driver.headerFrom();
+#endif
 }
 
 uint8_t RHDatagram::headerId()
@@ -119,5 +171,31 @@ uint8_t RHDatagram::headerFlags()
     return _driver.headerFlags();
 }
 
+#if RH_ADDRESS_16
+////////////////////////////////////////////////////////////////////
+void RHclearAddressValues(RHAddressValue* table, uint8_t size)
+{
+    uint8_t i;
+    for (i = 0; i < size; i++)
+    {
+	table[i].address = RH_DATAGRAM_BROADCAST_ADDRESS;
+	table[i].value = 0;
+    }
+}
 
-
+////////////////////////////////////////////////////////////////////
+RHAddressValue* RHfindAddressValue(RHAddressValue* table, uint8_t size, RHAddress address)
+{
+    uint8_t home = RHhashAddress(address) % size;
+    uint8_t i;
+    for (i = 0; i < RH_ADDRESS_TABLE_PROBES && i < size; i++)
+    {
+	// Entries are never removed, so an address is always before the first unused entry
+	RHAddressValue* v = &table[(home + i) % size];
+	if (v->address == address || v->address == RH_DATAGRAM_BROADCAST_ADDRESS)
+	    return v;
+    }
+    // Not there and no room nearby: reuse the entry it hashes to
+    return &table[home];
+}
+#endif
@@ -12,13 +12,110 @@
 // Not all radios support this length, and many are much smaller
 #define RH_MAX_MESSAGE_LEN 255
 
+// Set RH_ADDRESS_16 to 1 for 16 bit node addresses in RHDatagram and the managers built on it
+// (RHReliableDatagram, RHRouter and RHMesh), so a network can have up to 65534 nodes. 
+// The drivers still carry 8 bit TO and FROM headers: RHDatagram puts the most significant octets
+// of the addresses in front of the payload (see "16 Bit Addresses" in RHDatagram).
+// All the nodes in a network must be built the same way
+#ifndef RH_ADDRESS_16
+ #define RH_ADDRESS_16 0
+#endif
+
+#if RH_ADDRESS_16
+// A node address
+typedef uint16_t RHAddress;
+
+// How a node address is carried in a message: 2 octets, most significant first
+typedef struct
+{
+    uint8_t octets[2];
+} RHAddressField;
+
+// Address that sends a message to all the nodes within range
+ #define RH_DATAGRAM_BROADCAST_ADDRESS 0xffff
+
+// Octets RHDatagram puts in front of the payload of each message
+ #define RH_DATAGRAM_HEADER_LEN 2
+
+// Most entries of a hashed address table examined to find an address (see RHfindAddressValue())
+ #ifndef RH_ADDRESS_TABLE_PROBES
+  #define RH_ADDRESS_TABLE_PROBES 8
+ #endif
+#else
+typedef uint8_t RHAddress;
+typedef uint8_t RHAddressField;
+ #define RH_DATAGRAM_BROADCAST_ADDRESS RH_BROADCAST_ADDRESS
+ #define RH_DATAGRAM_HEADER_LEN 0
+#endif
+
+// Octets taken by a node address in a message
+#define RH_ADDRESS_LEN sizeof(RHAddressField)
+
+/// Reads a node address carried in a message
+/// \param[in] field Where the address is
+/// \return The address
+inline RHAddress RHgetAddress(const RHAddressField& field)
+{
+#if RH_ADDRESS_16
+    return (field.octets[0] << 8) | field.octets[1];
+#else
+    return field;
+#endif
+}
+
+/// Writes a node address into a message
+/// \param[out] field Where the address goes
+/// \param[in] address The address
+inline void RHputAddress(RHAddressField& field, RHAddress address)
+{
+#if RH_ADDRESS_16
+    field.octets[0] = address >> 8;
+    field.octets[1] = address & 0xff;
+#else
+    field = address;
+#endif
+}
+
+#if RH_ADDRESS_16
+/// An entry in a hashed table that keeps an octet for each of a limited number of node addresses,
+/// such as the last ID seen from each node
+typedef struct
+{
+    RHAddress address; ///< The node, RH_DATAGRAM_BROADCAST_ADDRESS if the entry is not used
+    uint8_t   value;   ///< The octet kept for it
+} RHAddressValue;
+
+/// Empties a hashed address table
+/// \param[in] table The table
+/// \param[in] size Number of entries in the table
+void RHclearAddressValues(RHAddressValue* table, uint8_t size);
+
+/// Finds the entry for an address in a hashed address table. Only the RH_ADDRESS_TABLE_PROBES entries 
+/// after the one the address hashes to are examined, so this takes constant time. 
+/// \param[in] table The table
+/// \param[in] size Number of entries in the table
+/// \param[in] address The address to look for
+/// \return The entry for address if there is one. Otherwise the unused entry it can have, 
+/// or if there is none, the entry it hashes to, whose address can be replaced (forgetting the old one)
+RHAddressValue* RHfindAddressValue(RHAddressValue* table, uint8_t size, RHAddress address);
+
+/// Hashes a node address, for keeping addresses in tables smaller than the address space
+/// \param[in] address The address
+/// \return The hash
+inline uint16_t RHhashAddress(RHAddress address)
+{
+    // Sites often share the most significant octet, so mix it into the least significant
+    return (address ^ (address >> 8)) & 0xff;
+}
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHDatagram RHDatagram.h <RHDatagram.h>
 /// \brief Manager class for addressed, unreliable messages
 ///
 /// Every RHDatagram node has an 8 bit address (defaults to 0).
 /// Addresses (DEST and SRC) are 8 bit integers with an address of RH_BROADCAST_ADDRESS (0xff) 
-/// reserved for broadcast.
+/// reserved for broadcast. Addresses can be 16 bits instead (see "16 Bit Addresses" below).
 ///
 /// \par Media Access Strategy
 ///
@@ -42,13 +139,36 @@
 /// \b FLAGS A bitmask of flags. The most significant 4 bits are reserved for use by RadioHead. The least
 /// significant 4 bits are reserved for applications.<br>
 ///
+/// \par 16 Bit Addresses
+///
+/// 8 bit addresses limit a network to 254 nodes, and neighbouring networks that reuse addresses
+/// interfere with each other. When RH_ADDRESS_16 is defined to 1 (for example in platformio.ini, 
+/// or before RHDatagram.h is included everywhere), node addresses are 16 bit RHAddress values, 
+/// and RH_DATAGRAM_BROADCAST_ADDRESS (0xffff) is reserved for broadcast. 
+/// The RHDatagram, RHReliableDatagram, RHRouter and RHMesh functions that take and return node addresses
+/// then use RHAddress, and the end to end addresses in RHRouter and RHMesh messages are 2 octets long,
+/// most significant first. With 8 bit addresses RHAddress is uint8_t, so nothing changes.
+///
+/// The TO and FROM headers of the driver carry the least significant octets of the addresses, 
+/// so the driver still ignores most messages for other nodes. The most significant octets of TO and FROM 
+/// go in the first 2 octets of the payload, so messages can be RH_DATAGRAM_HEADER_LEN octets shorter,
+/// and each message is copied once more on its way to and from the driver. recvfrom() ignores 
+/// messages for other nodes whose addresses have the same least significant octet as this node, 
+/// unless the driver is in promiscuous mode. Avoid addresses whose least significant octet is 0xff: 
+/// the drivers treat messages to them as broadcasts, so every node in range has to look at them.
+/// Note that RH_BROADCAST_ADDRESS (0xff) is then an ordinary node address.
+///
+/// The managers keep some state for each node they hear from. With 8 bit addresses this is in tables 
+/// indexed by address, but with 16 bit addresses it is in small hashed tables (see RHfindAddressValue()), 
+/// so they take about the same RAM as before.
+///
 class RHDatagram
 {
 public:
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialise this instance and the 
     /// driver connected to it.
@@ -59,16 +179,16 @@ public:
     /// In a conventional multinode system, all nodes will have a unique address 
     /// (which you could store in EEPROM).
     /// \param[in] thisAddress The address of this node
-    void setThisAddress(uint8_t thisAddress);
+    void setThisAddress(RHAddress thisAddress);
 
     /// Sends a message to the node(s) with the given address
-    /// RH_BROADCAST_ADDRESS is a valid address which will cause the message
+    /// RH_BROADCAST_ADDRESS (RH_DATAGRAM_BROADCAST_ADDRESS with 16 bit addresses) is a valid address which will cause the message
     /// to be accepted by all RHDatagram nodes within range.
     /// \param[in] buf Pointer to the binary message to send
     /// \param[in] len Number of octets to send (> 0)
     /// \param[in] address The address to send the message to.
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
-    bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendto(uint8_t* buf, uint8_t len, RHAddress address);
 
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
@@ -79,13 +199,13 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the FROM address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the TO address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the FROM address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the TO address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Tests whether a new message is available
     /// from the Driver.
@@ -122,11 +242,11 @@ public:
 
     /// Sets the TO header to be sent in all subsequent messages
     /// \param[in] to The new TO header value
-    void           setHeaderTo(uint8_t to);
+    void           setHeaderTo(RHAddress to);
 
     /// Sets the FROM header to be sent in all subsequent messages
     /// \param[in] from The new FROM header value
-    void           setHeaderFrom(uint8_t from);
+    void           setHeaderFrom(RHAddress from);
 
     /// Sets the ID header to be sent in all subsequent messages
     /// \param[in] id The new ID header value
@@ -139,11 +259,11 @@ public:
 
     /// Returns the TO header of the last received message
     /// \return The TO header of the most recently received message.
-    uint8_t        headerTo();
+    RHAddress      headerTo();
 
     /// Returns the FROM header of the last received message
     /// \return The FROM header of the most recently received message.
-    uint8_t        headerFrom();
+    RHAddress      headerFrom();
 
     /// Returns the ID header of the last received message
     /// \return The ID header of the most recently received message.
@@ -155,14 +275,27 @@ public:
 
     /// Returns the address of this node.
     /// \return The address of this node
-    uint8_t         thisAddress();
+    RHAddress       thisAddress();
 
 protected:
     /// The Driver we are to use
     RHGenericDriver&        _driver;
 
     /// The address of this node
-    uint8_t         _thisAddress;
+    RHAddress       _thisAddress;
+
+#if RH_ADDRESS_16
+    /// FROM address to be sent in subsequent messages
+    RHAddress       _txHeaderFrom;
+
+    /// TO and FROM addresses of the last message received
+    RHAddress       _rxHeaderTo;
+    RHAddress       _rxHeaderFrom;
+
+    /// Messages are assembled here with the most significant octets of their addresses, 
+    /// on their way to and from the driver
+    uint8_t         _buf[RH_MAX_MESSAGE_LEN];
+#endif
 };
 
 #endif
@@ -161,6 +161,10 @@ public:
     /// \param[in] promiscuous true if you wish to receive messages with any TO address
     virtual void           setPromiscuous(bool promiscuous){ _driver.setPromiscuous(promiscuous);};
 
+    /// Tells whether the receiver is in promiscuous mode
+    /// \return true if messages with any TO address are accepted
+    virtual bool           promiscuous() { return _driver.promiscuous();};
+
     /// Returns the TO header of the last received message
     /// \return The TO header
     virtual uint8_t        headerTo() { return _driver.headerTo();};
@@ -16,7 +16,8 @@ RHGenericDriver::RHGenericDriver()
     _rxBad(0),
     _rxGood(0),
     _txGood(0),
-    _cad_timeout(0)
+    _cad_timeout(0),
+    _capture(NULL)
 {
 }
 
@@ -30,9 +31,15 @@ void RHGenericDriver::waitAvailable(uint16_t polldelay)
 {
     while (!available())
       {
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+	// Let simulated time run until the next event that might deliver a message
+	(void)polldelay;
+	simulatorRunUntil(SIMULATOR_FOREVER);
+#else
 	YIELD;
 	if (polldelay)
 	  delay(polldelay);
+#endif
       }
 }
 
@@ -41,6 +48,18 @@ void RHGenericDriver::waitAvailable(uint16_t polldelay)
 // Works correctly even on millis() rollover
 bool RHGenericDriver::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
 {
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    // Jump straight to the next simulated event or the timeout, whichever is earlier
+    (void)polldelay;
+    uint64_t deadline = simulatorMicros() + (uint64_t)timeout * 1000;
+    while (!available())
+    {
+	if (simulatorMicros() >= deadline)
+	    return false;
+	simulatorRunUntil(deadline);
+    }
+    return true;
+#else
     unsigned long starttime = millis();
     while ((millis() - starttime) < timeout)
     {
@@ -53,17 +72,33 @@ bool RHGenericDriver::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
 	  delay(polldelay);
     }
     return false;
+#endif
 }
 
 bool RHGenericDriver::waitPacketSent()
 {
     while (_mode == RHModeTx)
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+	if (!simulatorRunUntil(SIMULATOR_FOREVER) && _mode == RHModeTx)
+	    return false; // Nothing left that could ever end the transmission
+#else
 	YIELD; // Wait for any previous transmit to finish
+#endif
     return true;
 }
 
 bool RHGenericDriver::waitPacketSent(uint16_t timeout)
 {
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    uint64_t deadline = simulatorMicros() + (uint64_t)timeout * 1000;
+    while (_mode == RHModeTx)
+    {
+	if (simulatorMicros() >= deadline)
+	    return false;
+	simulatorRunUntil(deadline);
+    }
+    return true;
+#else
     unsigned long starttime = millis();
     while ((millis() - starttime) < timeout)
     {
@@ -72,6 +107,7 @@ bool RHGenericDriver::waitPacketSent(uint16_t timeout)
 	YIELD;
     }
     return false;
+#endif
 }
 
 // Wait until no channel activity detected or timeout
@@ -111,6 +147,11 @@ void RHGenericDriver::setPromiscuous(bool promiscuous)
     _promiscuous = promiscuous;
 }
 
+bool RHGenericDriver::promiscuous()
+{
+    return _promiscuous;
+}
+
 void RHGenericDriver::setThisAddress(uint8_t address)
 {
     _thisAddress = address;
@@ -162,6 +203,11 @@ int16_t RHGenericDriver::lastRssi()
     return _lastRssi;
 }
 
+int RHGenericDriver::lastSNR()
+{
+    return 0;
+}
+
 RHGenericDriver::RHMode  RHGenericDriver::mode()
 {
     return _mode;
@@ -212,6 +258,41 @@ uint16_t RHGenericDriver::txGood()
     return _txGood;
 }
 
+void RHGenericDriver::setCapture(RHCapture* capture)
+{
+    _capture = capture;
+}
+
+void RHGenericDriver::capture(uint8_t direction, const uint8_t* payload, uint8_t len, int8_t snr)
+{
+    if (!_capture)
+	return;
+    RHCapture::Record record;
+    record.direction = direction;
+    record.node = _thisAddress;
+    if (direction == RH_CAPTURE_TX)
+    {
+	record.to    = _txHeaderTo;
+	record.from  = _txHeaderFrom;
+	record.id    = _txHeaderId;
+	record.flags = _txHeaderFlags;
+	record.rssi  = 0;
+	record.snr   = 0;
+    }
+    else
+    {
+	record.to    = _rxHeaderTo;
+	record.from  = _rxHeaderFrom;
+	record.id    = _rxHeaderId;
+	record.flags = _rxHeaderFlags;
+	record.rssi  = _lastRssi;
+	record.snr   = snr;
+    }
+    record.len = len;
+    record.payload = payload;
+    _capture->capture(record);
+}
+
 void RHGenericDriver::setCADTimeout(unsigned long cad_timeout)
 {
     _cad_timeout = cad_timeout;
@@ -7,6 +7,7 @@
 #define RHGenericDriver_h
 
 #include <RadioHead.h>
+#include <RHCapture.h>
 
 // Defines bits of the FLAGS header reserved for use by the RadioHead library and 
 // the flags available for use by applications
@@ -197,6 +198,10 @@ public:
     /// \param[in] promiscuous true if you wish to receive messages with any TO address
     virtual void           setPromiscuous(bool promiscuous);
 
+    /// Tells whether the receiver is in promiscuous mode (see setPromiscuous())
+    /// \return true if messages with any TO address are accepted
+    virtual bool           promiscuous();
+
     /// Returns the TO header of the last received message
     /// \return The TO header
     virtual uint8_t        headerTo();
@@ -219,6 +224,11 @@ public:
     /// \return The most recent RSSI measurement in dBm.
     virtual int16_t        lastRssi();
 
+    /// Returns the Signal-to-noise ratio (SNR) of the last received message, for drivers whose
+    /// radios measure it (eg RH_RF95, RH_SX126x, RH_Sim).
+    /// \return SNR of the last received message in dB, 0 if the driver does not measure it
+    virtual int            lastSNR();
+
     /// Returns the operating mode of the library.
     /// \return the current mode, one of RF69_MODE_*
     virtual RHMode          mode();
@@ -258,8 +268,23 @@ public:
     /// \return The number of packets successfully transmitted
     virtual uint16_t       txGood();
 
+    /// Sets a capture to be given a copy of every packet sent by send(), and every packet
+    /// collected by recv(), with its headers, RSSI and SNR, for debugging (see RHCapture).
+    /// Not all drivers support capture: see RHCapture for the ones that do.
+    /// \param[in] capture The capture, or NULL to stop capturing (the default)
+    void                   setCapture(RHCapture* capture);
+
 protected:
 
+    /// Called by drivers that support capture with each packet they send or receive.
+    /// Does nothing unless a capture has been set with setCapture().
+    /// The headers are taken from the TX headers for RH_CAPTURE_TX, else from the last received headers
+    /// \param[in] direction RH_CAPTURE_TX or RH_CAPTURE_RX
+    /// \param[in] payload The message after the RadioHead headers
+    /// \param[in] len Length of payload
+    /// \param[in] snr SNR in dB of a received packet, if the driver knows it
+    void                   capture(uint8_t direction, const uint8_t* payload, uint8_t len, int8_t snr = 0);
+
     /// The current transport operating mode
     volatile RHMode     _mode;
 
@@ -311,6 +336,9 @@ protected:
     /// Channel activity timeout in ms
     unsigned int        _cad_timeout;
 
+    /// Where to capture packets, if anywhere
+    RHCapture*          _capture;
+
 private:
 
 };
@@ -0,0 +1,69 @@
+// RHLoRaAirtime.cpp
+//
+// Time on air calculation for LoRa packets.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <RHLoRaAirtime.h>
+#include <math.h>
+
+// These must be kept in step with MODEM_CONFIG_TABLE in RH_RF95.cpp
+// and are indexed by the values of RH_RF95::ModemConfigChoice
+static const uint8_t RF95_MODEM_CONFIG_TABLE[][3] =
+{
+    //  1d,     1e,      26
+    { 0x72,   0x74,    0x04}, // Bw125Cr45Sf128 (the chip default), AGC enabled
+    { 0x92,   0x74,    0x04}, // Bw500Cr45Sf128, AGC enabled
+    { 0x48,   0x94,    0x04}, // Bw31_25Cr48Sf512, AGC enabled
+    { 0x78,   0xc4,    0x0c}, // Bw125Cr48Sf4096, AGC enabled
+    { 0x72,   0xb4,    0x04}, // Bw125Cr45Sf2048, AGC enabled
+};
+
+// Bandwidths in Hz indexed by bits 7..4 of RH_RF95_REG_1D_MODEM_CONFIG1
+static const uint32_t RF95_BANDWIDTHS[] =
+    {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+
+bool RHLoRaModemParamsFromRF95Registers(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26, uint16_t preamble, RHLoRaModemParams* params)
+{
+    uint8_t bw = reg_1d >> 4;
+    uint8_t cr = (reg_1d >> 1) & 0x07;
+    uint8_t sf = reg_1e >> 4;
+    if (   bw >= sizeof(RF95_BANDWIDTHS) / sizeof(RF95_BANDWIDTHS[0])
+	|| cr < 1 || cr > 4
+	|| sf < 6 || sf > 12)
+	return false;
+    params->sf = sf;
+    params->bw = RF95_BANDWIDTHS[bw];
+    params->cr = cr + 4;
+    params->preamble = preamble;
+    params->implicitHeader = reg_1d & 0x01;
+    params->crc = reg_1e & 0x04;
+    params->lowDataRateOptimize = reg_26 & 0x08;
+    return true;
+}
+
+bool RHLoRaModemParamsFromRF95Config(uint8_t index, uint16_t preamble, RHLoRaModemParams* params)
+{
+    if (index >= sizeof(RF95_MODEM_CONFIG_TABLE) / sizeof(RF95_MODEM_CONFIG_TABLE[0]))
+	return false;
+    return RHLoRaModemParamsFromRF95Registers(RF95_MODEM_CONFIG_TABLE[index][0], 
+					      RF95_MODEM_CONFIG_TABLE[index][1], 
+					      RF95_MODEM_CONFIG_TABLE[index][2], 
+					      preamble, params);
+}
+
+uint32_t RHLoRaTimeOnAir(const RHLoRaModemParams* params, uint8_t len)
+{
+    // Symbol time in microseconds
+    double tsym = (double)(1UL << params->sf) * 1000000.0 / params->bw;
+    double tpreamble = (params->preamble + 4.25) * tsym;
+    int de = params->lowDataRateOptimize ? 1 : 0;
+    int ih = params->implicitHeader ? 1 : 0;
+    int crc = params->crc ? 1 : 0;
+    double payloadSymbols = ceil((8.0 * len - 4.0 * params->sf + 28 + 16 * crc - 20 * ih) 
+				 / (4.0 * (params->sf - 2 * de)));
+    if (payloadSymbols < 0)
+	payloadSymbols = 0;
+    payloadSymbols = 8 + payloadSymbols * params->cr;
+    return (uint32_t)(tpreamble + payloadSymbols * tsym + 0.5);
+}
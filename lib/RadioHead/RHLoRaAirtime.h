@@ -0,0 +1,50 @@
+// RHLoRaAirtime.h
+//
+// Definitions for calculating the time on air of LoRa packets.
+// Used by simulated drivers and the ether simulator to model transmission times
+// of LoRa radios such as RH_RF95.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#ifndef RHLoRaAirtime_h
+#define RHLoRaAirtime_h
+
+#include <RadioHead.h>
+
+/// \brief LoRa modem parameters that determine the time on air of a packet
+typedef struct
+{
+    uint8_t     sf;                  ///< Spreading factor, 6 to 12
+    uint32_t    bw;                  ///< Signal bandwidth in Hz
+    uint8_t     cr;                  ///< Coding rate denominator, 5 to 8 (ie 4/5 to 4/8)
+    uint16_t    preamble;            ///< Preamble length in symbols, not including the 4.25 sync symbols
+    bool        implicitHeader;      ///< true if implicit (fixed length) header mode
+    bool        crc;                 ///< true if the payload CRC is on
+    bool        lowDataRateOptimize; ///< true if low data rate optimisation is on
+} RHLoRaModemParams;
+
+/// Decodes the RH_RF95 modem configuration register values (as in RH_RF95::ModemConfig) 
+/// into modem parameters.
+/// \param[in] reg_1d Value for register RH_RF95_REG_1D_MODEM_CONFIG1
+/// \param[in] reg_1e Value for register RH_RF95_REG_1E_MODEM_CONFIG2
+/// \param[in] reg_26 Value for register RH_RF95_REG_26_MODEM_CONFIG3
+/// \param[in] preamble Preamble length in symbols, as set by RH_RF95::setPreambleLength()
+/// \param[out] params The decoded parameters
+/// \return true if the register values are valid
+extern bool RHLoRaModemParamsFromRF95Registers(uint8_t reg_1d, uint8_t reg_1e, uint8_t reg_26, uint16_t preamble, RHLoRaModemParams* params);
+
+/// Gets the modem parameters for one of the canned RH_RF95::ModemConfigChoice configurations
+/// \param[in] index One of RH_RF95::ModemConfigChoice, eg RH_RF95::Bw125Cr45Sf128 (0)
+/// \param[in] preamble Preamble length in symbols, as set by RH_RF95::setPreambleLength()
+/// \param[out] params The modem parameters
+/// \return true if index is a valid choice
+extern bool RHLoRaModemParamsFromRF95Config(uint8_t index, uint16_t preamble, RHLoRaModemParams* params);
+
+/// Calculates the time on air of a LoRa packet, per Semtech AN1200.13.
+/// \param[in] params The modem parameters
+/// \param[in] len Number of octets in the packet, including any RadioHead headers 
+///            (ie message length + RH_RF95_HEADER_LEN for RH_RF95)
+/// \return Time on air in microseconds, including the preamble
+extern uint32_t RHLoRaTimeOnAir(const RHLoRaModemParams* params, uint8_t len);
+
+#endif
@@ -13,13 +13,48 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
+RHMesh::RHMesh(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHRouter(driver, thisAddress)
 {
+    _routeMetric = RH_MESH_METRIC_HOPS;
+    _arpTimeout = RH_MESH_ARP_TIMEOUT;
+    _arpRingTtl = RH_MESH_ARP_RING_MAX_TTL;
+    uint8_t j;
+    for (j = 0; j < RH_MESH_SEEN_DISCOVERIES; j++)
+	_seenDiscoveries[j].used = false;
+    for (j = 0; j < RH_MESH_SEEN_DELIVERIES; j++)
+	_seenDeliveries[j].used = false;
+#if RH_MESH_END_TO_END_ACK
+    _endToEndAck = false;
+    _endToEndTimeout = RH_MESH_E2E_TIMEOUT;
+    _endToEndRetries = RH_MESH_E2E_RETRIES;
+    _receiptAwaited = false;
+    _heldFirst = 0;
+    _heldCount = 0;
+#endif
+#if RH_MESH_SOURCE_ROUTES
+    _sourceRouting = false;
+    _nextSourceRoute = 0;
+    for (j = 0; j < RH_MESH_SOURCE_ROUTES; j++)
+	_sourceRoutes[j].len = 0xff;
+#endif
+#if RH_MESH_PENDING_SENDS
+    _asyncDiscovery = false;
+    _sendFailedCallback = NULL;
+    _sendFailedArg = NULL;
+    _pendingSends = 0;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_PENDING_SENDS; i++)
+	_pendingDiscoveries[i].active = false;
+#endif
+#if RH_MESH_REBROADCAST_JITTER
+    _rebroadcastJitter = RH_MESH_REBROADCAST_JITTER_AIRTIMES;
+    _rebroadcastSuppress = RH_MESH_REBROADCAST_SUPPRESS_COPIES;
+    _airtime = RH_MESH_DEFAULT_AIRTIME;
+    _rebroadcastLen = 0;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -28,65 +63,729 @@ RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress)
 ////////////////////////////////////////////////////////////////////
 // Discovers a route to the destination (if necessary), sends and 
 // waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
 {
     if (len > RH_MESH_MAX_MESSAGE_LEN)
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
-    if (address != RH_BROADCAST_ADDRESS)
+    if (address != RH_DATAGRAM_BROADCAST_ADDRESS)
     {
-	RoutingTableEntry* route = getRouteTo(address);
+	bool route = hasRouteTo(address);
+#if RH_MESH_PENDING_SENDS
+	if (!route && _asyncDiscovery)
+	    return queueSend(buf, len, address, flags);
+#endif
+	// A payload in payloadBuffer() would be overwritten by the messages received during route discovery, 
+	// or while waiting for a receipt
+	bool keep = !route;
+#if RH_MESH_END_TO_END_ACK
+	keep = keep || _endToEndAck;
+#endif
+	if (keep && buf == payloadBuffer())
+	{
+	    memcpy(_tmpMessage, buf, len);
+	    buf = _tmpMessage;
+	}
 	if (!route && !doArp(address))
 	    return RH_ROUTER_ERROR_NO_ROUTE;
+#if RH_MESH_END_TO_END_ACK
+	if (_endToEndAck)
+	    return sendtoWaitReceipt(buf, len, address, flags);
+#endif
+    }
+    return sendApplicationMessage(buf, len, address, flags);
+}
+
+#if RH_MESH_END_TO_END_ACK
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendtoWaitReceipt(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
+{
+    // Every copy has the same ID, so the destination can tell them apart from new messages
+    uint8_t id = _lastE2ESequenceNumber++;
+    uint8_t tries;
+    for (tries = 0; tries <= _endToEndRetries; tries++)
+    {
+	// The route may have failed since the last try
+	if (tries && !hasRouteTo(address) && !doArp(address))
+	    return RH_ROUTER_ERROR_NO_ROUTE;
+
+	uint8_t msgLen = buildApplicationMessage(buf, len, address, 
+						 RH_MESH_MESSAGE_TYPE_APPLICATION | RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED);
+	uint8_t error = RHRouter::sendtoFromSourceIdWait(RHRouter::payloadBuffer(), msgLen, address, _thisAddress, id, flags);
+	if (error != RH_ROUTER_ERROR_NONE)
+	    return error;
+
+	// Carry on routing for other nodes while waiting. recvfromAck() clears _receiptAwaited 
+	// when the receipt arrives
+	_receiptAwaited = true;
+	_receiptDest = address;
+	_receiptId = id;
+	unsigned long starttime = millis();
+	int32_t timeLeft;
+	while (_receiptAwaited && (timeLeft = _endToEndTimeout - (millis() - starttime)) > 0)
+	{
+	    int32_t due = serviceTimers();
+	    if (due >= 0 && due < timeLeft)
+		timeLeft = due ? due : 1;
+	    if (_heldCount == RH_MESH_HELD_MESSAGES)
+	    {
+		// No room to hold another message for our caller. Leave anything that arrives on 
+		// the radio unacknowledged, so its sender tries again, rather than acknowledge and drop it
+		delay(timeLeft);
+	    }
+	    else if (waitAvailableTimeout(timeLeft))
+	    {
+		HeldMessage* h = &_held[(_heldFirst + _heldCount) % RH_MESH_HELD_MESSAGES];
+		h->len = sizeof(h->data);
+		if (recvfromAck(h->data, &h->len, &h->source, &h->dest, &h->id, &h->flags, &h->hops))
+		    _heldCount++;
+	    }
+	    YIELD;
+	}
+	if (!_receiptAwaited)
+	    return RH_ROUTER_ERROR_NONE;
+    }
+    _receiptAwaited = false;
+    return RH_ROUTER_ERROR_NO_REPLY;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendApplicationMessage(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
+{
+    // Now have a route. Contruct an application layer message in place and send it via that route
+    uint8_t msgLen = buildApplicationMessage(buf, len, address, RH_MESH_MESSAGE_TYPE_APPLICATION);
+    return RHRouter::sendtoWait(RHRouter::payloadBuffer(), msgLen, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::buildApplicationMessage(uint8_t* buf, uint8_t len, RHAddress address, uint8_t msgType)
+{
+    uint8_t* msg = RHRouter::payloadBuffer();
+    uint8_t offset = 0;
+#if RH_MESH_SOURCE_ROUTES
+    // The path goes in front of the application message, if there is room
+    SourceRoute* route = findSourceRoute(address);
+    if (route && (uint16_t)route->len * RH_ADDRESS_LEN + 2 + sizeof(MeshMessageHeader) + len <= RH_ROUTER_MAX_MESSAGE_LEN)
+	offset = route->len * RH_ADDRESS_LEN + 2;
+#else
+    (void)address; // Not used
+#endif
+    // The data may be in payloadBuffer(), where the path goes: move it first
+    MeshApplicationMessage* a = (MeshApplicationMessage*)(msg + offset);
+    if (buf != a->data)
+	memmove(a->data, buf, len);
+    a->header.msgType = msgType;
+#if RH_MESH_SOURCE_ROUTES
+    if (offset)
+    {
+	MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)msg;
+	s->header.msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+	s->pathlen = route->len;
+	uint8_t i;
+	for (i = 0; i < route->len; i++)
+	    RHputAddress(s->path[i], route->path[i]);
+    }
+#endif
+    return offset + sizeof(MeshMessageHeader) + len;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::hasRouteTo(RHAddress address)
+{
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    if (chainForwarding())
+	return true; // Always onwards along the line
+#endif
+#if RH_MESH_SOURCE_ROUTES
+    if (findSourceRoute(address))
+	return true;
+#endif
+    // A static route whose next hop failed is only used again if no other route is found
+    RoutingTableEntry* route = getRouteTo(address);
+    return route && !(route->state == StaticFailed && route->next_hop == route->alt_hop);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRouteMetric(uint8_t metric)
+{
+    _routeMetric = metric;
+}
+
+#if RH_MESH_END_TO_END_ACK
+////////////////////////////////////////////////////////////////////
+void RHMesh::setEndToEndAck(bool ack)
+{
+    _endToEndAck = ack;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setEndToEndTimeout(uint16_t timeout)
+{
+    _endToEndTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setEndToEndRetries(uint8_t retries)
+{
+    _endToEndRetries = retries;
+}
+#endif
+
+#if RH_MESH_SOURCE_ROUTES
+////////////////////////////////////////////////////////////////////
+void RHMesh::setSourceRouting(bool sourceRouting)
+{
+    _sourceRouting = sourceRouting;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::setSourceRoute(RHAddress dest, const RHAddress* path, uint8_t len)
+{
+    if (len > RH_MESH_SOURCE_ROUTE_MAX_HOPS)
+	return false;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTES; i++)
+	if (_sourceRoutes[i].len != 0xff && _sourceRoutes[i].dest == dest)
+	    break;
+    if (i >= RH_MESH_SOURCE_ROUTES)
+    {
+	// A new destination takes the next entry round, which was set longest ago
+	i = _nextSourceRoute;
+	_nextSourceRoute = (_nextSourceRoute + 1) % RH_MESH_SOURCE_ROUTES;
+    }
+    SourceRoute* route = &_sourceRoutes[i];
+    route->dest = dest;
+    route->len = len;
+    route->learned = false;
+    memcpy(route->path, path, len * sizeof(RHAddress));
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+const RHAddress* RHMesh::getSourceRoute(RHAddress dest, uint8_t* len)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTES; i++)
+    {
+	if (_sourceRoutes[i].len != 0xff && _sourceRoutes[i].dest == dest)
+	{
+	    *len = _sourceRoutes[i].len;
+	    return _sourceRoutes[i].path;
+	}
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::deleteSourceRoute(RHAddress dest)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTES; i++)
+	if (_sourceRoutes[i].len != 0xff && _sourceRoutes[i].dest == dest)
+	    _sourceRoutes[i].len = 0xff;
+}
+
+////////////////////////////////////////////////////////////////////
+RHMesh::SourceRoute* RHMesh::findSourceRoute(RHAddress dest)
+{
+    if (!_sourceRouting)
+	return NULL;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTES; i++)
+	if (_sourceRoutes[i].len != 0xff && _sourceRoutes[i].dest == dest)
+	    return &_sourceRoutes[i];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::deleteFailedSourceRoute(RHAddress dest)
+{
+    SourceRoute* route = findSourceRoute(dest);
+    if (route && route->learned)
+	route->len = 0xff;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::learnSourceRoute(RHAddress dest, const RHAddressField* path, uint8_t len)
+{
+    // Paths set by the application are not replaced
+    SourceRoute* route = findSourceRoute(dest);
+    if (!_sourceRouting || (route && !route->learned))
+	return;
+    if (len > RH_MESH_SOURCE_ROUTE_MAX_HOPS)
+    {
+	deleteSourceRoute(dest); // Too long: the old one is out of date
+	return;
     }
+    RHAddress relays[RH_MESH_SOURCE_ROUTE_MAX_HOPS];
+    uint8_t i;
+    for (i = 0; i < len; i++)
+	relays[i] = RHgetAddress(path[i]);
+    setSourceRoute(dest, relays, len);
+    findSourceRoute(dest)->learned = true;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setArpTimeout(uint16_t timeout)
+{
+    _arpTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setArpRing(uint8_t maxTtl)
+{
+    _arpRingTtl = maxTtl;
+}
 
-    // Now have a route. Contruct an application layer message and send it via that route
-    MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
-    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
-    memcpy(a->data, buf, len);
-    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+////////////////////////////////////////////////////////////////////
+// Expanding ring search: look for the destination a few hops away first, 
+// and only flood the whole network if it is not found nearby
+bool RHMesh::doArp(RHAddress address)
+{
+    uint16_t ttl; // Doubling past 128 would wrap a uint8_t to 0
+    for (ttl = 1; ttl < _arpRingTtl && ttl < _max_hops; ttl *= 2)
+	if (discoverRoute(address, ttl))
+	    return true;
+    return discoverRoute(address, 0) || retryStaticRoute(address);
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::doArp(uint8_t address)
+unsigned long RHMesh::sendDiscoveryRequest(RHAddress address, uint8_t ttl)
 {
     // Need to discover a route
     // Broadcast a route discovery message with nothing in it
-    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
-    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
-    p->destlen = 1; 
-    p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
+    MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)RHRouter::payloadBuffer();
+    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST | _routeMetric;
+    p->destlen = RH_ADDRESS_LEN; 
+    RHputAddress(p->dest, address); // Who we are looking for
+    uint8_t len = sizeof(RHMesh::MeshMessageHeader) + 1 + RH_ADDRESS_LEN;
+    if (_routeMetric != RH_MESH_METRIC_HOPS)
+    {
+	// The path starts here
+	MeshRouteDiscoveryMetricMessage* m = (MeshRouteDiscoveryMetricMessage*)p;
+	m->metric[0] = 0;
+	m->metric[1] = 0;
+	len += 2;
+    }
+    // The TTL goes in the RHRouter flags, which nodes that do not know about it pass on as 0
+    unsigned long starttime = millis();
+    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, len, RH_DATAGRAM_BROADCAST_ADDRESS, ttl);
     if (error !=  RH_ROUTER_ERROR_NONE)
+	return 0;
+    unsigned long airtime = millis() - starttime;
+
+    // A ring of ttl hops should answer within about the time it takes the request to get out 
+    // and the response and its acknowledgements to get back, which is a few times the time on air
+    // of the request at each hop
+    unsigned long timeout = _arpTimeout;
+    uint8_t airtimes = RH_MESH_ARP_HOP_AIRTIMES;
+#if RH_MESH_REBROADCAST_JITTER
+    if (airtime)
+	_airtime = airtime;
+    airtimes += _rebroadcastJitter; // Each relay may hold the request back for up to this long
+#endif
+    if (ttl)
+    {
+	unsigned long hopTime = airtime * airtimes;
+	if (hopTime < RH_MESH_ARP_MIN_HOP_TIME)
+	    hopTime = RH_MESH_ARP_MIN_HOP_TIME;
+	timeout = ttl * hopTime;
+    }
+    return timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::discoverRoute(RHAddress address, uint8_t ttl)
+{
+    unsigned long timeout = sendDiscoveryRequest(address, ttl);
+    if (!timeout)
 	return false;
     
     // Wait for a reply, which will be unicast back to us
     // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
     unsigned long starttime = millis();
+    bool found = false;
     int32_t timeLeft;
-    while ((timeLeft = RH_MESH_ARP_TIMEOUT - (millis() - starttime)) > 0)
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
 	if (waitAvailableTimeout(timeLeft))
 	{
-	    if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
+	    uint8_t* message;
+	    uint8_t messageLen;
+	    if (RHRouter::recvfromAckInPlace(&message, &messageLen))
 	    {
-		if (   messageLen > 1
-		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+		MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)message;
+		if (   messageLen > 1 + RH_ADDRESS_LEN
+		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+		       && RHgetAddress(p->dest) == address)
 		{
 		    // Got a reply, now add the next hop to the dest to the routing table
 		    // The first hop taken is the first octet
 		    addRouteTo(address, headerFrom());
 		    return true;
 		}
+		else if (   messageLen > 1 + RH_ADDRESS_LEN
+			 && (p->header.msgType & RH_MESH_MESSAGE_TYPE_METRIC_MASK)
+			 && (p->header.msgType & ~RH_MESH_MESSAGE_TYPE_METRIC_MASK) == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+			 && RHgetAddress(p->dest) == address
+			 && !found)
+		{
+		    // Got a reply with a path metric, and peekAtMessage() has added the route.
+		    // Replies over other paths may still be on their way: give them a chance to replace it
+		    found = true;
+		    timeout = millis() - starttime + RH_MESH_METRIC_RESPONSE_WAIT;
+		}
 	    }
 	}
 	YIELD;
     }
+    return found;
+}
+
+#if RH_MESH_PENDING_SENDS
+////////////////////////////////////////////////////////////////////
+void RHMesh::setAsyncDiscovery(bool async)
+{
+    _asyncDiscovery = async;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setSendFailedCallback(SendFailedCallback callback, void* arg)
+{
+    _sendFailedCallback = callback;
+    _sendFailedArg = arg;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::pendingSends()
+{
+    return _pendingSends;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::queueSend(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
+{
+    if (_pendingSends >= RH_MESH_PENDING_SENDS)
+	return RH_ROUTER_ERROR_QUEUE_FULL;
+
+    // Park the message until the route is known. Messages are kept in the order they were sent.
+    // This comes first, as the request is built where a payload from payloadBuffer() is
+    PendingSend* p = &_pending[_pendingSends++];
+    p->dest = address;
+    p->flags = flags;
+    p->len = len;
+    memcpy(p->data, buf, len);
+
+    // Start discovering the route, unless that is already happening
+    uint8_t i;
+    int freeSlot = -1;
+    for (i = 0; i < RH_MESH_PENDING_SENDS; i++)
+    {
+	if (_pendingDiscoveries[i].active && _pendingDiscoveries[i].dest == address)
+	    break;
+	if (freeSlot < 0 && !_pendingDiscoveries[i].active)
+	    freeSlot = i;
+    }
+    if (i >= RH_MESH_PENDING_SENDS)
+    {
+	// There is always a free slot, because there are fewer destinations than pending sends
+	PendingDiscovery* d = &_pendingDiscoveries[freeSlot];
+	d->active = true;
+	d->dest = address;
+	d->ttl = (_arpRingTtl > 1 && _max_hops > 1) ? 1 : 0;
+	d->sent = millis();
+	d->timeout = sendDiscoveryRequest(address, d->ttl);
+    }
+
+    return RH_ROUTER_ERROR_QUEUED;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::processPendingSends()
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_PENDING_SENDS; i++)
+    {
+	PendingDiscovery* d = &_pendingDiscoveries[i];
+	if (!d->active)
+	    continue;
+	if (hasRouteTo(d->dest))
+	{
+	    // Found it
+	    d->active = false;
+	    sendPending(d->dest, true);
+	}
+	else if (millis() - d->sent >= d->timeout)
+	{
+	    if (d->ttl)
+	    {
+		// Nothing within this ring. Try the next one, or the whole network
+		uint16_t ttl = d->ttl * 2; // Doubling past 128 would wrap d->ttl to 0
+		d->ttl = (ttl >= _arpRingTtl || ttl >= _max_hops) ? 0 : ttl;
+		d->sent = millis();
+		d->timeout = sendDiscoveryRequest(d->dest, d->ttl);
+	    }
+	    else
+	    {
+		// Given up
+		d->active = false;
+		sendPending(d->dest, retryStaticRoute(d->dest));
+	    }
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::sendPending(RHAddress address, bool routeFound)
+{
+    // Only the messages already waiting: the callback may queue more
+    uint8_t i = 0;
+    uint8_t end = _pendingSends;
+    while (i < end)
+    {
+	PendingSend* p = &_pending[i];
+	if (p->dest != address)
+	{
+	    i++;
+	    continue;
+	}
+	uint8_t error = RH_ROUTER_ERROR_NO_ROUTE;
+	if (routeFound)
+	    error = sendApplicationMessage(p->data, p->len, p->dest, p->flags);
+	if (error != RH_ROUTER_ERROR_NONE && _sendFailedCallback)
+	    (*_sendFailedCallback)(p->dest, p->data, p->len, error, _sendFailedArg);
+	// Remove it by moving the later ones down
+	end--;
+	_pendingSends--;
+	memmove(p, p + 1, sizeof(PendingSend) * (_pendingSends - i));
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+int32_t RHMesh::pendingTimeLeft()
+{
+    int32_t timeLeft = -1;
+    uint8_t i;
+    for (i = 0; i < RH_MESH_PENDING_SENDS; i++)
+    {
+	PendingDiscovery* d = &_pendingDiscoveries[i];
+	if (!d->active)
+	    continue;
+	int32_t left = d->timeout - (millis() - d->sent);
+	if (left < 0)
+	    left = 0;
+	if (timeLeft < 0 || left < timeLeft)
+	    timeLeft = left;
+    }
+    return timeLeft;
+}
+#endif
+
+#if RH_MESH_REBROADCAST_JITTER
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastJitter(uint8_t airtimes)
+{
+    _rebroadcastJitter = airtimes;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastSuppression(uint8_t copies)
+{
+    _rebroadcastSuppress = copies;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::scheduleRebroadcast(uint8_t* buf, uint8_t len, RHAddress source, uint8_t id, uint8_t flags)
+{
+    bool better = _rebroadcastLen && _rebroadcastSource == source && _rebroadcastId == id;
+    if (_rebroadcastLen && !better)
+	sendRebroadcast(); // Only room for one
+    memcpy(_rebroadcast.data, buf, len);
+    _rebroadcastLen = len;
+    if (better)
+	return; // Keep its place and count
+
+    _rebroadcastSource = source;
+    _rebroadcastId = id;
+    _rebroadcastFlags = flags;
+    _rebroadcastCopies = 1;
+    _rebroadcastQueued = millis();
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    _rebroadcastDelay = _airtime * _rebroadcastJitter * (random() & 0xFF) / 256;
+#else
+    _rebroadcastDelay = _airtime * _rebroadcastJitter * random(0, 256) / 256;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::sendRebroadcast()
+{
+    uint8_t len = _rebroadcastLen;
+    _rebroadcastLen = 0;
+    unsigned long starttime = millis();
+    // REVISIT: if this fails what can we do?
+    if (   sendMessageWait(&_rebroadcast, len, RH_DATAGRAM_BROADCAST_ADDRESS, 
+			   _rebroadcastSource, _rebroadcastId, _rebroadcastFlags) == RH_ROUTER_ERROR_NONE
+	&& millis() != starttime)
+	_airtime = millis() - starttime;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+int32_t RHMesh::serviceTimers()
+{
+    int32_t timeLeft = serviceForwards();
+#if RH_MESH_REBROADCAST_JITTER
+    if (_rebroadcastLen)
+    {
+	int32_t left = _rebroadcastDelay - (millis() - _rebroadcastQueued);
+	if (left <= 0)
+	    sendRebroadcast();
+	else if (timeLeft < 0 || left < timeLeft)
+	    timeLeft = left;
+    }
+#endif
+#if RH_MESH_PENDING_SENDS
+    processPendingSends();
+    int32_t pendingLeft = pendingTimeLeft();
+    if (pendingLeft >= 0 && (timeLeft < 0 || pendingLeft < timeLeft))
+	timeLeft = pendingLeft;
+#endif
+    return timeLeft;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::seenMessage(SeenMessage* table, uint8_t size, unsigned long time, RHAddress source, uint8_t id)
+{
+    unsigned long now = millis();
+    uint8_t i;
+    uint8_t oldest = 0;
+    for (i = 0; i < size; i++)
+    {
+	SeenMessage* s = &table[i];
+	if (s->used && now - s->seen < time)
+	{
+	    if (s->source == source && s->id == id)
+		return true;
+	}
+	else
+	    s->used = false; // Too old to match
+	if (   table[oldest].used
+	    && (!s->used || now - s->seen > now - table[oldest].seen))
+	    oldest = i;
+    }
+    // Not seen: remember it in place of the oldest
+    table[oldest].used = true;
+    table[oldest].source = source;
+    table[oldest].id = id;
+    table[oldest].seen = now;
     return false;
 }
 
+////////////////////////////////////////////////////////////////////
+bool RHMesh::seenDiscovery(RHAddress source, uint8_t id)
+{
+    return seenMessage(_seenDiscoveries, RH_MESH_SEEN_DISCOVERIES, RH_MESH_SEEN_DISCOVERY_TIME, source, id);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::sendReceipt(RHAddress source, uint8_t id, const RHAddressField* path, uint8_t pathLen)
+{
+    MeshDeliveryReceiptMessage r;
+    r.header.msgType = RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT;
+    r.id = id;
+    // REVISIT: if this fails the source will send the message again
+    sendBackAlongPath(path, pathLen, (uint8_t*)&r, sizeof(r), source);
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHMesh::addLinkMetric(uint8_t metricType, uint16_t metric, RHAddress neighbour)
+{
+    if (metricType == RH_MESH_MESSAGE_TYPE_METRIC_SNR)
+    {
+	// The most significant octet is the worst SNR on the path, as 128 - SNR,
+	// and the least significant is the number of hops
+	int weakness = 128 - _driver.lastSNR();
+	if (weakness < (metric >> 8))
+	    weakness = metric >> 8;
+	if (weakness < 0)
+	    weakness = 0;
+	else if (weakness > 255)
+	    weakness = 255;
+	uint8_t hops = metric & 0xff;
+	if (hops < 0xfe)
+	    hops++;
+	return (weakness << 8) | hops;
+    }
+
+    // Otherwise it is the sum of the ETX of the links. Links not used yet count as one transmission
+    uint16_t etx = RH_ROUTER_ETX_ONE;
+#if RH_ROUTER_LINK_METRICS
+    if (linkEtx(neighbour))
+	etx = linkEtx(neighbour);
+#else
+    (void)neighbour; // Not used
+#endif
+    if (metric >= RH_ROUTER_METRIC_UNKNOWN - etx)
+	return RH_ROUTER_METRIC_UNKNOWN - 1;
+    return metric + etx;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::addBetterRouteTo(RHAddress dest, RHAddress next_hop, uint16_t metric)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (!route || metric < route->metric)
+	addRouteTo(dest, next_hop, Valid, metric);
+    else if (route->next_hop == next_hop && metric != RH_ROUTER_METRIC_UNKNOWN)
+	route->metric = metric; // Same path, but its quality has changed
+    else
+	addAlternateRouteTo(dest, next_hop, metric); // Worse, but something to fall back to
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::deleteFailedRouteTo(RHAddress dest)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (!route)
+	return;
+    if (route->state == Static)
+    {
+	// Keep it to go back to, but look for another way round first (see hasRouteTo())
+	route->state = StaticFailed;
+	route->alt_hop = route->next_hop;
+	route->alt_metric = route->metric;
+    }
+    else if (route->state == StaticFailed)
+	failoverRouteTo(dest); // Back to the static next hop, if another was in use
+    else
+	deleteRouteTo(dest);
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::retryStaticRoute(RHAddress dest)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (!route || route->state != StaticFailed)
+	return false;
+    route->state = Static;
+    route->next_hop = route->alt_hop;
+    route->metric = route->alt_metric;
+    route->alt_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::addShortAlternateRouteTo(RHAddress dest, RHAddress next_hop, uint8_t hops)
+{
+    // A longer way round is more likely to fail too, and would be kept until it did
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (route && hops <= route->metric)
+	addAlternateRouteTo(dest, next_hop, hops);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Called by RHRouter::recvfromAck whenever a message goes past
 void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
@@ -99,22 +798,93 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 	// being routed back to the originator here. Want to scrape some routing data out of the response
 	// We can find the routes to all the nodes between here and the responding node
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
-	addRouteTo(d->dest, headerFrom());
-	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
+	addRouteTo(RHgetAddress(d->dest), headerFrom());
+	uint8_t numRoutes = (messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 1 - RH_ADDRESS_LEN) / RH_ADDRESS_LEN;
 	uint8_t i;
 	// Find us in the list of nodes that were traversed to get to the responding node
 	for (i = 0; i < numRoutes; i++)
-	    if (d->route[i] == _thisAddress)
+	    if (RHgetAddress(d->route[i]) == _thisAddress)
 		break;
 	i++;
 	while (i < numRoutes)
-	    addRouteTo(d->route[i++], headerFrom());
+	    addRouteTo(RHgetAddress(d->route[i++]), headerFrom());
+#if RH_MESH_SOURCE_ROUTES
+	if (RHgetAddress(message->header.dest) == _thisAddress)
+	    learnSourceRoute(RHgetAddress(d->dest), d->route, numRoutes); // The path our request took
+#endif
+    }
+    else if (   messageLen >= sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader) + 3 + RH_ADDRESS_LEN
+	     && (m->msgType & RH_MESH_MESSAGE_TYPE_METRIC_MASK)
+	     && (m->msgType & ~RH_MESH_MESSAGE_TYPE_METRIC_MASK) == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+    {
+	// A response carrying the metric of the path from the node we got it from to the responding node.
+	// Add the link from that node, and pass the new metric on towards the originator
+	MeshRouteDiscoveryMetricMessage* d = (MeshRouteDiscoveryMetricMessage*)message->data;
+	uint16_t metric = addLinkMetric(m->msgType & RH_MESH_MESSAGE_TYPE_METRIC_MASK,
+					(d->metric[0] << 8) | d->metric[1], headerFrom());
+	d->metric[0] = metric >> 8;
+	d->metric[1] = metric & 0xff;
+	RHAddress dest = RHgetAddress(d->dest);
+	addBetterRouteTo(dest, headerFrom(), metric);
+
+	// The response may not be coming back along the path the request took, so the nodes after us
+	// in the list of nodes the request visited are only known to be reachable through the node we got it from
+	// if that is the next one
+	uint8_t numRoutes = (messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 3 - RH_ADDRESS_LEN) / RH_ADDRESS_LEN;
+	uint8_t i = 0;
+	if (RHgetAddress(message->header.dest) != _thisAddress)
+	{
+	    // We are not the originator, so we should be in the list
+	    while (i < numRoutes && RHgetAddress(d->route[i]) != _thisAddress)
+		i++;
+	    i++;
+	}
+	if (i < numRoutes && RHgetAddress(d->route[i]) == headerFrom())
+	    while (i < numRoutes)
+		addBetterRouteTo(RHgetAddress(d->route[i++]), headerFrom(), RH_ROUTER_METRIC_UNKNOWN);
+#if RH_MESH_SOURCE_ROUTES
+	// Keep the path our request took if it is the best so far
+	RoutingTableEntry* route = getRouteTo(dest);
+	if (   RHgetAddress(message->header.dest) == _thisAddress
+	    && route && route->next_hop == headerFrom() && route->metric == metric)
+	    learnSourceRoute(dest, d->route, numRoutes);
+#endif
+    }
+    else if (   messageLen > sizeof(RoutedMessageHeader)
+	     && m->msgType == (RH_MESH_MESSAGE_TYPE_APPLICATION | RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED)
+	     && RHgetAddress(message->header.source) != _thisAddress
+	     && !getRouteTo(RHgetAddress(message->header.source)))
+    {
+	// The delivery receipt will come back the way this message came
+	addRouteTo(RHgetAddress(message->header.source), headerFrom());
     }
     else if (   messageLen > 1 
 	     && m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
     {
 	MeshRouteFailureMessage* d = (MeshRouteFailureMessage*)message->data;
-	deleteRouteTo(d->dest);
+	// Try another way round if we know one, rather than discovering a new route
+	if (!failoverRouteTo(RHgetAddress(d->dest)))
+	    deleteFailedRouteTo(RHgetAddress(d->dest));
+    }
+    else if (   messageLen > sizeof(RoutedMessageHeader)
+	     && m->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	     && RHgetAddress(message->header.dest) == _thisAddress)
+    {
+	// Relays pass source routed messages on without looking at them. At the source, a route failure 
+	// coming back along the path means the path is broken
+	uint8_t offset = sourceRouteLen(message->data, messageLen - sizeof(RoutedMessageHeader));
+	MeshRouteFailureMessage* d = (MeshRouteFailureMessage*)(message->data + offset);
+	if (   offset
+	    && messageLen >= sizeof(RoutedMessageHeader) + offset + sizeof(MeshRouteFailureMessage)
+	    && d->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
+	{
+	    RHAddress dest = RHgetAddress(d->dest);
+#if RH_MESH_SOURCE_ROUTES
+	    deleteFailedSourceRoute(dest);
+#endif
+	    if (!failoverRouteTo(dest))
+		deleteFailedRouteTo(dest);
+	}
     }
 }
 
@@ -122,68 +892,242 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 // This is called when a message is to be delivered to the next hop
 uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 {
-    uint8_t from = headerFrom(); // Might get clobbered during call to superclass route()
+    RHAddress from = headerFrom(); // Might get clobbered during call to superclass route()
+    if (   messageLen > sizeof(RoutedMessageHeader)
+	&& message->data[0] == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+	return routeSourceRouted(message, messageLen, from);
+
     uint8_t ret = RHRouter::route(message, messageLen);
+    if (ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
+    {
+	// Our own messages try the secondary next hop straight away. Relays report the failure 
+	// instead, rather than spending more time deaf to the network, and each node on the way 
+	// back fails over when it gets the report
+	if (   RHgetAddress(message->header.source) == _thisAddress
+	    && failoverRouteTo(RHgetAddress(message->header.dest)))
+	    ret = RHRouter::route(message, messageLen);
+    }
     if (   ret == RH_ROUTER_ERROR_NO_ROUTE
 	|| ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
+	ret = routeFailed(message, from, ret);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::routeFailed(RoutedMessage* message, RHAddress from, uint8_t error)
+{
+    // Cant deliver to the next hop. Delete the route, unless it was provisioned
+    deleteFailedRouteTo(RHgetAddress(message->header.dest));
+    if (RHgetAddress(message->header.source) == _thisAddress)
+	return error;
+
+    // This is being proxied, so tell the originator about it
+    // The message may be the one in the message buffer: take what is needed from its header first
+    RHAddress source = RHgetAddress(message->header.source);
+    RHAddress dest = RHgetAddress(message->header.dest);
+    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)RHRouter::payloadBuffer();
+    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+    RHputAddress(p->dest, dest); // Who you were trying to deliver to
+    // Make sure there is a route back towards whoever sent the original message
+    addRouteTo(source, from);
+    return RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + RH_ADDRESS_LEN, source);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::forwardFailed(RoutedMessage* message, uint8_t messageLen, RHAddress from)
+{
+    if (   messageLen > sizeof(RoutedMessageHeader)
+	&& message->data[0] == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+	sourceRouteFailed(message, RH_ROUTER_ERROR_UNABLE_TO_DELIVER);
+    else
+	routeFailed(message, from, RH_ROUTER_ERROR_UNABLE_TO_DELIVER);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::routeSourceRouted(RoutedMessage* message, uint8_t messageLen, RHAddress from)
+{
+    (void)from; // Not used: failures go back along the path
+    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)message->data;
+    // The relay that got it over n hops is path[n - 1]. The source has sent it 0 hops
+    uint8_t hops = message->header.hops;
+    if (   !sourceRouteLen(message->data, messageLen - sizeof(RoutedMessageHeader))
+	|| hops > s->pathlen
+	|| (hops && RHgetAddress(s->path[hops - 1]) != _thisAddress))
+	return RH_ROUTER_ERROR_NO_ROUTE; // Not on its path: drop it
+
+    RHAddress next_hop = hops < s->pathlen ? RHgetAddress(s->path[hops]) : RHgetAddress(message->header.dest);
+    uint8_t ret = routeVia(message, messageLen, next_hop);
+    if (ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
+	ret = sourceRouteFailed(message, ret);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sourceRouteFailed(RoutedMessage* message, uint8_t error)
+{
+    RHAddress dest = RHgetAddress(message->header.dest);
+    if (RHgetAddress(message->header.source) == _thisAddress)
     {
-	// Cant deliver to the next hop. Delete the route
-	deleteRouteTo(message->header.dest);
-	if (message->header.source != _thisAddress)
-	{
-	    // This is being proxied, so tell the originator about it
-	    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&_tmpMessage;
-	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
-	    p->dest = message->header.dest; // Who you were trying to deliver to
-	    // Make sure there is a route back towards whoever sent the original message
-	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
-	}
+	// Cant reach the first relay: find another way for the next message
+#if RH_MESH_SOURCE_ROUTES
+	deleteFailedSourceRoute(dest);
+#endif
+	deleteFailedRouteTo(dest);
+	return error;
     }
-    return ret;
+
+    // Tell the source, back through the relays before this one
+    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)message->data;
+    MeshRouteFailureMessage f;
+    f.header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+    RHputAddress(f.dest, dest); // Who you were trying to deliver to
+    return sendBackAlongPath(s->path, message->header.hops - 1, (uint8_t*)&f, sizeof(f), RHgetAddress(message->header.source));
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendBackAlongPath(const RHAddressField* path, uint8_t pathLen, uint8_t* buf, uint8_t len, RHAddress dest)
+{
+    // Built with room for the RHRouter header, so the message just received stays where it is
+    struct
+    {
+	RoutedMessageHeader header;
+	uint8_t             data[2 + RH_MESH_SOURCE_ROUTE_MAX_HOPS * RH_ADDRESS_LEN + sizeof(MeshRouteFailureMessage)];
+    } m;
+    uint8_t offset = 0;
+    if (path)
+    {
+	if (pathLen > RH_MESH_SOURCE_ROUTE_MAX_HOPS)
+	    return RH_ROUTER_ERROR_INVALID_LENGTH;
+	// Laid out as a MeshSourceRoutedMessage, which is bigger than m.data
+	m.data[0] = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+	m.data[1] = pathLen;
+	RHAddressField* reversed = (RHAddressField*)(m.data + 2);
+	uint8_t i;
+	for (i = 0; i < pathLen; i++)
+	    reversed[i] = path[pathLen - 1 - i];
+	offset = pathLen * RH_ADDRESS_LEN + 2;
+    }
+    memcpy(m.data + offset, buf, len);
+    return sendMessageWait((RoutedMessage*)&m, offset + len, dest, _thisAddress, _lastE2ESequenceNumber++, 0);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sourceRouteLen(const uint8_t* buf, uint8_t len)
+{
+    const MeshSourceRoutedMessage* s = (const MeshSourceRoutedMessage*)buf;
+    // There must be at least the type of the message carried after the path
+    if (   len < 2 
+	|| s->header.msgType != RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	|| (uint16_t)s->pathlen * RH_ADDRESS_LEN + 3 > len)
+	return 0;
+    return s->pathlen * RH_ADDRESS_LEN + 2;
 }
 
 ////////////////////////////////////////////////////////////////////
 // Subclasses may want to override
 bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
 {
-    // Can only handle physical addresses 1 octet long, which is the physical node address
-    return addresslen == 1 && address[0] == _thisAddress;
+    // Can only handle physical addresses RH_ADDRESS_LEN octets long, which is the physical node address
+    return addresslen == RH_ADDRESS_LEN && RHgetAddress(*(RHAddressField*)address) == _thisAddress;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {     
-    uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _source;
-    uint8_t _dest;
+    uint8_t* msg;
+    uint8_t msgLen;
+    if (!recvfromAckInPlace(&msg, &msgLen, source, dest, id, flags, hops))
+	return false;
+    if (*len > msgLen)
+	*len = msgLen;
+    memcpy(buf, msg, *len);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAckInPlace(uint8_t** buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{     
+    uint8_t* tmpMessage;
+    uint8_t tmpMessageLen;
+    RHAddress _source;
+    RHAddress _dest;
     uint8_t _id;
     uint8_t _flags;
     uint8_t _hops;
-    if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags, &_hops))
+#if RH_MESH_END_TO_END_ACK
+    if (_heldCount && !_receiptAwaited)
     {
-	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
+	// Arrived while sendtoWait() was waiting for a receipt. Valid until the next sendtoWait()
+	HeldMessage* h = &_held[_heldFirst];
+	_heldFirst = (_heldFirst + 1) % RH_MESH_HELD_MESSAGES;
+	_heldCount--;
+	if (source) *source = h->source;
+	if (dest)   *dest   = h->dest;
+	if (id)     *id     = h->id;
+	if (flags)  *flags  = h->flags;
+	if (hops)   *hops   = h->hops;
+	*buf = h->data;
+	*len = h->len;
+	return true;
+    }
+#endif
+    serviceTimers();
+    if (RHRouter::recvfromAckInPlace(&tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags, &_hops))
+    {
+	// Parsed, and any reply or rebroadcast built, where it was received
+	MeshMessageHeader* p = (MeshMessageHeader*)tmpMessage;
+	// A source routed message carries the real one after its path
+	const RHAddressField* path = NULL;
+	uint8_t pathLen = 0;
+	if (tmpMessageLen >= 1 && p->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+	{
+	    uint8_t offset = sourceRouteLen(tmpMessage, tmpMessageLen);
+	    if (!offset || _dest != _thisAddress)
+		return false;
+	    path = ((MeshSourceRoutedMessage*)p)->path;
+	    pathLen = (offset - 2) / RH_ADDRESS_LEN;
+	    p = (MeshMessageHeader*)(tmpMessage + offset);
+	    tmpMessageLen -= offset;
+	}
 
 	if (   tmpMessageLen >= 1 
-	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
+	    && (p->msgType & ~RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED) == RH_MESH_MESSAGE_TYPE_APPLICATION)
 	{
 	    MeshApplicationMessage* a = (MeshApplicationMessage*)p;
+	    bool receipt = (p->msgType & RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED) && _dest == _thisAddress;
+	    if (receipt && seenMessage(_seenDeliveries, RH_MESH_SEEN_DELIVERIES, RH_MESH_SEEN_DELIVERY_TIME, _source, _id))
+	    {
+		// Already delivered, but the source did not get the receipt
+		sendReceipt(_source, _id, path, pathLen);
+		return false;
+	    }
 	    // Handle application layer messages, presumably for our caller
 	    if (source) *source = _source;
 	    if (dest)   *dest   = _dest;
 	    if (id)     *id     = _id;
 	    if (flags)  *flags  = _flags;
 	    if (hops)   *hops   = _hops;
-	    uint8_t msgLen = tmpMessageLen - sizeof(MeshMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, a->data, *len);
+	    *buf = a->data;
+	    *len = tmpMessageLen - sizeof(MeshMessageHeader);
+	    if (receipt)
+		sendReceipt(_source, _id, path, pathLen);
 	    
 	    return true;
 	}
-	else if (   _dest == RH_BROADCAST_ADDRESS 
+	else if (   _dest == _thisAddress
+		 && tmpMessageLen >= sizeof(MeshDeliveryReceiptMessage)
+		 && p->msgType == RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT)
+	{
+#if RH_MESH_END_TO_END_ACK
+	    MeshDeliveryReceiptMessage* r = (MeshDeliveryReceiptMessage*)p;
+	    if (_receiptAwaited && _source == _receiptDest && r->id == _receiptId)
+		_receiptAwaited = false;
+#endif
+	    return false;
+	}
+	else if (   _dest == RH_DATAGRAM_BROADCAST_ADDRESS 
 		 && tmpMessageLen > 1 
-		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
+		 && (p->msgType & ~RH_MESH_MESSAGE_TYPE_METRIC_MASK) == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
 	{
 	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
 	    // Handle Route discovery requests
@@ -192,40 +1136,128 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    if (_source == _thisAddress)
 		return false;
 	    
-	    uint8_t numRoutes = tmpMessageLen - sizeof(MeshMessageHeader) - 2;
+	    // Requests with a path metric have it before the array
+	    uint8_t metricType = p->msgType & RH_MESH_MESSAGE_TYPE_METRIC_MASK;
+	    uint8_t routeOffset = sizeof(MeshMessageHeader) + (metricType ? 3 : 1) + RH_ADDRESS_LEN;
+	    if (tmpMessageLen < routeOffset)
+		return false;
+	    RHAddressField* route = (RHAddressField*)((uint8_t*)p + routeOffset);
+	    uint8_t numRoutes = (tmpMessageLen - routeOffset) / RH_ADDRESS_LEN;
 	    uint8_t i;
 	    // Are we already mentioned?
 	    for (i = 0; i < numRoutes; i++)
-		if (d->route[i] == _thisAddress)
+		if (RHgetAddress(route[i]) == _thisAddress)
 		    return false; // Already been through us. Discard
+
+	    // Have we already had another copy of this request? It is still worth learning 
+	    // the path of a copy that carries a metric, but it is not passed on again
+	    bool seen = seenDiscovery(_source, _id);
+	    if (seen && !metricType)
+	    {
+		// Another way back to the originator, and the nodes this copy went through
+		addShortAlternateRouteTo(_source, headerFrom(), numRoutes + 1);
+		if (_isa_router)
+		{
+		    for (i = 0; i < numRoutes; i++)
+			addShortAlternateRouteTo(RHgetAddress(route[i]), headerFrom(), numRoutes - i);
+		}
+	    }
+	    bool waiting = false; // Another copy of the request we are waiting to rebroadcast
+#if RH_MESH_REBROADCAST_JITTER
+	    if (seen && _rebroadcastLen && _rebroadcastSource == _source && _rebroadcastId == _id)
+	    {
+		waiting = true;
+		if (_rebroadcastSuppress && ++_rebroadcastCopies >= _rebroadcastSuppress)
+		{
+		    // Enough of our neighbours have passed it on
+		    _rebroadcastLen = 0;
+		    waiting = false;
+		}
+	    }
+#endif
+	    if (seen && !metricType)
+		return false;
 	    
-	        
-            addRouteTo(_source, headerFrom()); // The originator needs to be added regardless of node type
-
-	    // Hasnt been past us yet, record routes back to the earlier nodes
-            // No need to waste memory if we are not participating in routing
-            if (_isa_router)
-            {
-	        for (i = 0; i < numRoutes; i++)
-		    addRouteTo(d->route[i], headerFrom());
-            }
-
-	    if (isPhysicalAddress(&d->dest, d->destlen))
+	    MeshRouteDiscoveryMetricMessage* dm = (MeshRouteDiscoveryMetricMessage*)p;
+	    if (metricType)
+	    {
+		// Keep the route back to the originator if this path is better than the one we know, 
+		// and pass on the metric of the path to here
+		uint16_t metric = addLinkMetric(metricType, (dm->metric[0] << 8) | dm->metric[1], headerFrom());
+		dm->metric[0] = metric >> 8;
+		dm->metric[1] = metric & 0xff;
+		addBetterRouteTo(_source, headerFrom(), metric);
+#if RH_MESH_REBROADCAST_JITTER
+		if (waiting)
+		{
+		    // Pass on this copy instead if it came over a better path
+		    MeshRouteDiscoveryMetricMessage* w = (MeshRouteDiscoveryMetricMessage*)_rebroadcast.data;
+		    waiting = metric < ((w->metric[0] << 8) | w->metric[1]);
+		}
+#endif
+		if (_isa_router)
+		{
+		    for (i = 0; i < numRoutes; i++)
+			addBetterRouteTo(RHgetAddress(route[i]), headerFrom(), RH_ROUTER_METRIC_UNKNOWN);
+		}
+	    }
+	    else
+	    {
+		// The hop counts are kept as the metrics, to rank the secondary next hops
+		addRouteTo(_source, headerFrom(), Valid, numRoutes + 1); // The originator needs to be added regardless of node type
+
+		// Hasnt been past us yet, record routes back to the earlier nodes
+		// No need to waste memory if we are not participating in routing
+		if (_isa_router)
+		{
+		    for (i = 0; i < numRoutes; i++)
+			addRouteTo(RHgetAddress(route[i]), headerFrom(), Valid, numRoutes - i);
+		}
+	    }
+
+	    if (isPhysicalAddress((uint8_t*)&d->dest, d->destlen))
 	    {
 		// This route discovery is for us. Unicast the whole route back to the originator
 		// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
 		// We are certain to have a route there, because we just got it
-		d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
-		RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
+		d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE | metricType;
+		if (metricType)
+		{
+		    // Send the response back the way this request came, even if we know a better route,
+		    // so the originator gets to compare the paths of all the requests that reach us.
+		    // The metric of the path back from here is added up on the way
+		    RoutingTableEntry best;
+		    RoutingTableEntry* known = getRouteTo(_source);
+		    if (known)
+			best = *known;
+		    uint16_t metric = (dm->metric[0] << 8) | dm->metric[1];
+		    addRouteTo(_source, headerFrom(), Valid, metric);
+		    dm->metric[0] = 0;
+		    dm->metric[1] = 0;
+		    RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
+		    if (known && best.metric < metric)
+			addRouteTo(_source, best.next_hop, Valid, best.metric);
+		}
+		else
+		    RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
 	    }
-	    else if ((i < _max_hops) && _isa_router)
+	    else if (   (!seen || waiting)
+		     && numRoutes < _max_hops
+		     && (!_flags || numRoutes + 1 < _flags)
+		     && _isa_router)
 	    {
-		// Its for someone else, rebroadcast it, after adding ourselves to the list
-		d->route[numRoutes] = _thisAddress;
-		tmpMessageLen++;
-		// Have to impersonate the source
+		// Its for someone else, and the TTL the originator put in the flags (if any) lets it 
+		// go another hop. Rebroadcast it, after adding ourselves to the list
+		RHputAddress(route[numRoutes], _thisAddress);
+		tmpMessageLen += RH_ADDRESS_LEN;
+		// Have to impersonate the source, and keep its ID so other nodes can recognise copies of the request
+#if RH_MESH_REBROADCAST_JITTER
+		if (_rebroadcastJitter)
+		    scheduleRebroadcast((uint8_t*)p, tmpMessageLen, _source, _id, _flags);
+		else
+#endif
 		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
+		RHRouter::sendtoFromSourceIdWait((uint8_t*)p, tmpMessageLen, RH_DATAGRAM_BROADCAST_ADDRESS, _source, _id, _flags);
 	    }
 	}
     }
@@ -233,12 +1265,21 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags, uint8_t* hops)
+bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {  
+#if RH_MESH_END_TO_END_ACK
+    // Messages held while sendtoWait() waited for a receipt are already here
+    if (_heldCount && !_receiptAwaited)
+	return recvfromAck(buf, len, from, to, id, flags, hops);
+#endif
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
+	// Wake up in time for any forwarding, rebroadcast or asynchronous route discovery that is due
+	int32_t due = serviceTimers();
+	if (due >= 0 && due < timeLeft)
+	    timeLeft = due ? due : 1;
 	if (waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags, hops))
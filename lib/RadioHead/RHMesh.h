@@ -14,10 +14,150 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST        1
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
+#define RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT               4
+#define RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED                  5
 
-// Timeout for address resolution in milliecs
+// Flag added to the type of RH_MESH_MESSAGE_TYPE_APPLICATION messages whose destination
+// should return a RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT (see setEndToEndAck())
+#define RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED              0x80
+
+// Flags added to the type of RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST and RESPONSE messages
+// that carry a path metric, in a MeshRouteDiscoveryMetricMessage. They say which metric it is
+#define RH_MESH_MESSAGE_TYPE_METRIC_ETX                     0x40
+#define RH_MESH_MESSAGE_TYPE_METRIC_SNR                     0x80
+#define RH_MESH_MESSAGE_TYPE_METRIC_MASK                    0xc0
+
+// Ways of choosing between routes, for setRouteMetric()
+// The route in the first discovery response, normally the one with the fewest hops
+#define RH_MESH_METRIC_HOPS   0
+// The route with the lowest total ETX of its links
+#define RH_MESH_METRIC_ETX    RH_MESH_MESSAGE_TYPE_METRIC_ETX
+// The route whose worst link has the best SNR, then the fewest hops
+#define RH_MESH_METRIC_SNR    RH_MESH_MESSAGE_TYPE_METRIC_SNR
+
+// Default timeout for address resolution in milliecs (see setArpTimeout())
 #define RH_MESH_ARP_TIMEOUT 4000
 
+// Default limit of the TTLs tried by the expanding ring search before the whole network is searched (see setArpRing())
+#define RH_MESH_ARP_RING_MAX_TTL 8
+
+// Each ring of the expanding ring search waits this many times the time taken to send the request, per hop
+#define RH_MESH_ARP_HOP_AIRTIMES 4
+
+// and at least this many ms per hop
+#define RH_MESH_ARP_MIN_HOP_TIME 50
+
+// Number of route discovery requests each node remembers, so that it passes each one on only once
+#ifndef RH_MESH_SEEN_DISCOVERIES
+ #define RH_MESH_SEEN_DISCOVERIES 8
+#endif
+
+// How long in ms a node remembers a route discovery request. Must be longer than it takes a request 
+// to flood the network, but shorter than it takes a node to send 256 requests
+#ifndef RH_MESH_SEEN_DISCOVERY_TIME
+ #define RH_MESH_SEEN_DISCOVERY_TIME 10000
+#endif
+
+// Number of messages that can wait for asynchronous route discovery (see setAsyncDiscovery()).
+// Each keeps a copy of the caller's message, up to RH_MESH_MAX_MESSAGE_LEN octets, along with the 
+// state of its discovery. Defaults to 4 if RH_HAVE_PLENTY_OF_RAM, else 0, which leaves asynchronous route discovery out
+#ifndef RH_MESH_PENDING_SENDS
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_MESH_PENDING_SENDS 4
+ #else
+  #define RH_MESH_PENDING_SENDS 0
+ #endif
+#endif
+
+// Relays hold route discovery requests back for a random time before rebroadcasting them, and drop them 
+// if enough of their neighbours rebroadcast them first (see "Rebroadcast Jitter" below).
+// The request being held back is kept in a buffer of its own. On by default if RH_HAVE_PLENTY_OF_RAM.
+// 0 leaves it out, and relays rebroadcast straight away
+#ifndef RH_MESH_REBROADCAST_JITTER
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_MESH_REBROADCAST_JITTER 1
+ #else
+  #define RH_MESH_REBROADCAST_JITTER 0
+ #endif
+#endif
+
+// Default longest time a relay holds a request back, in times the time on air of a request (see setRebroadcastJitter())
+#ifndef RH_MESH_REBROADCAST_JITTER_AIRTIMES
+ #define RH_MESH_REBROADCAST_JITTER_AIRTIMES 4
+#endif
+
+// Default number of copies of a request that stop a relay rebroadcasting it (see setRebroadcastSuppression())
+#ifndef RH_MESH_REBROADCAST_SUPPRESS_COPIES
+ #define RH_MESH_REBROADCAST_SUPPRESS_COPIES 3
+#endif
+
+// Time on air of a request in ms assumed until the node has timed one of its own broadcasts.
+// About right for a LoRa radio with the default RH_RF95 modem configuration
+#ifndef RH_MESH_DEFAULT_AIRTIME
+ #define RH_MESH_DEFAULT_AIRTIME 50
+#endif
+
+// sendtoWait() can wait for end to end acknowledgement (see setEndToEndAck()). Messages for this node
+// that arrive while it waits are held for the caller (see RH_MESH_HELD_MESSAGES). On by default if 
+// RH_HAVE_PLENTY_OF_RAM. Nodes without it still return receipts
+#ifndef RH_MESH_END_TO_END_ACK
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_MESH_END_TO_END_ACK 1
+ #else
+  #define RH_MESH_END_TO_END_ACK 0
+ #endif
+#endif
+
+// Number of messages for this node that can arrive while sendtoWait() waits for a delivery receipt, 
+// and be held for recvfromAck(). Each takes about RH_MESH_MAX_MESSAGE_LEN octets
+#ifndef RH_MESH_HELD_MESSAGES
+ #define RH_MESH_HELD_MESSAGES 4
+#endif
+
+// Default time in ms sendtoWait() waits for a delivery receipt before sending the message again (see setEndToEndTimeout())
+#ifndef RH_MESH_E2E_TIMEOUT
+ #define RH_MESH_E2E_TIMEOUT 3000
+#endif
+
+// Default number of times sendtoWait() sends a message again if no delivery receipt comes back (see setEndToEndRetries())
+#ifndef RH_MESH_E2E_RETRIES
+ #define RH_MESH_E2E_RETRIES 2
+#endif
+
+// Number of messages that asked for a receipt each node remembers, so that it delivers 
+// each only once when the source sends it again
+#ifndef RH_MESH_SEEN_DELIVERIES
+ #define RH_MESH_SEEN_DELIVERIES 8
+#endif
+
+// How long in ms a node remembers a message that asked for a receipt. Must be longer than
+// the source keeps sending it again
+#ifndef RH_MESH_SEEN_DELIVERY_TIME
+ #define RH_MESH_SEEN_DELIVERY_TIME 30000
+#endif
+
+// Number of destinations a source keeps the whole path to, for source routing (see setSourceRouting()).
+// A path is up to RH_MESH_SOURCE_ROUTE_MAX_HOPS relay addresses. Defaults to 8 if RH_HAVE_PLENTY_OF_RAM. 
+// Relays need no room to pass source routed messages on, so nodes without it still forward them. 
+// 0 leaves sending source routed messages out
+#ifndef RH_MESH_SOURCE_ROUTES
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_MESH_SOURCE_ROUTES 8
+ #else
+  #define RH_MESH_SOURCE_ROUTES 0
+ #endif
+#endif
+
+// Most relays on a source route. Also the most relays a route failure or delivery receipt
+// can be sent back through along the path of a source routed message
+#ifndef RH_MESH_SOURCE_ROUTE_MAX_HOPS
+ #define RH_MESH_SOURCE_ROUTE_MAX_HOPS 8
+#endif
+
+// How long in ms address resolution waits for better routes after the first response,
+// when a route metric is set
+#define RH_MESH_METRIC_RESPONSE_WAIT 500
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
 /// \brief RHRouter subclass for sending addressed, optionally acknowledged datagrams
@@ -49,6 +189,13 @@
 /// If a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST that already has itself 
 /// listed in the visited nodes, it knows it has already seen and rebroadcast this request, 
 /// and threfore ignores it. This prevents broadcast storms.
+/// Copies of the same request also arrive over different paths without the node in their list. 
+/// Relays keep the originator's ID (the RHRouter ID header) when they rebroadcast a request,
+/// and each node remembers the originator and ID of the last RH_MESH_SEEN_DISCOVERIES requests for 
+/// RH_MESH_SEEN_DISCOVERY_TIME ms, so it rebroadcasts each request only once, 
+/// and the number of rebroadcasts grows with the number of nodes rather than the number of paths.
+/// Later copies are ignored, except that with a route metric (see below) they can still
+/// improve the routes a node knows, and the destination responds to each of them.
 /// When a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST it can use the list of 
 /// nodes aready visited to deduce routes back towards the originating (requesting node). 
 /// This also means that when the destination node of the request is reached, it (and all 
@@ -56,6 +203,43 @@
 /// This means the unicast RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE 
 /// reply will be routed successfully back to the original route requester.
 ///
+/// Route discovery starts with an expanding ring search: the request is first sent with a 
+/// TTL (time to live) of 1 hop, so only the neighbours of the node receive it. If there is no response, it is sent 
+/// again with a TTL of 2 hops, then 4 and so on, each time waiting long enough for a response to come back
+/// from that far away (RH_MESH_ARP_HOP_AIRTIMES times the time it took to send the request, for each hop). 
+/// Once the TTL reaches the limit set by setArpRing() or the max hops (see RHRouter::setMaxHops()) the request is 
+/// flooded through the whole network, and the node waits for up to the time set by setArpTimeout(). 
+/// So destinations nearby are found quickly, with little traffic, at the cost of a longer search 
+/// for the ones far away. The TTL is carried in the RHRouter flags of the request.
+///
+/// \par Rebroadcast Jitter
+///
+/// If every relay rebroadcast a request as soon as it got it, all the neighbours of a node
+/// would rebroadcast its request at the same moment, and they would collide wherever they overlap.
+/// So relays wait a random time of up to setRebroadcastJitter() times the time on air of a request 
+/// (measured when the node last broadcast one) before they rebroadcast it. 
+/// While it waits, a relay counts the copies of the request it hears from its neighbours. Once it has heard
+/// setRebroadcastSuppression() copies, the nodes around it have very likely already got the request, 
+/// so it does not rebroadcast it at all (counter based flooding). In dense networks this
+/// removes most of the rebroadcasts. With a route metric, a relay that hears a copy over a better path 
+/// while it waits rebroadcasts that one instead.
+/// The waiting request is sent from within recvfromAck() or recvfromAckTimeout(), 
+/// so relays must keep calling them. A relay keeps only one request waiting: if it has to pass 
+/// on another one, it rebroadcasts the first straight away.
+/// Not available if RH_MESH_REBROADCAST_JITTER is 0.
+///
+/// \par Asynchronous Route Discovery
+///
+/// Route discovery normally blocks sendtoWait(), so the node cannot do anything else, not even forward
+/// messages for other nodes, until the route is found or the search times out.
+/// After setAsyncDiscovery(true), sendtoWait() instead parks messages to destinations without a route 
+/// in a queue of up to RH_MESH_PENDING_SENDS messages, starts route discovery if it is not already running for 
+/// that destination, and returns RH_ROUTER_ERROR_QUEUED straight away (or RH_ROUTER_ERROR_QUEUE_FULL).
+/// Route discovery, including the expanding ring search, then carries on while recvfromAck() or 
+/// recvfromAckTimeout() are called. When the route is found, the messages waiting for it are sent 
+/// from within those calls, in the order they were queued. If the route is not found, or a message 
+/// cannot be delivered to the next hop, the function given to setSendFailedCallback() is called.
+///
 /// The RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE sent back by the destination node contains 
 /// the full list of nodes that were visited on the way to the destination.
 /// Therefore, intermediate nodes that route the reply back towards the originating node can use the 
@@ -67,7 +251,28 @@
 ///
 /// Note that there is a race condition here that can effect routing on multipath routes. For example, 
 /// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// will be the one used, unless a route metric has been set.
+///
+/// \par Route Metrics
+///
+/// By default, the route used is simply the one in the first (or last) response, normally the one with 
+/// the fewest hops, however poor its links. setRouteMetric() makes a node choose routes by the quality 
+/// of their links instead:
+/// - RH_MESH_METRIC_ETX chooses the route with the lowest sum of the expected transmission counts (ETX) 
+///   of its links, which each node estimates from the acknowledgements of the messages it sends 
+///   (see RHRouter::linkEtx()). Links that have not been used yet count as one transmission, so this 
+///   learns to avoid lossy links as routes are rediscovered. Needs RH_ROUTER_LINK_METRICS, or it is the same as
+///   counting hops.
+/// - RH_MESH_METRIC_SNR chooses the route whose weakest link has the best SNR, as measured by each node when
+///   it receives the discovery messages, and then the one with the fewest hops. Needs a driver that measures SNR
+///   (see RHGenericDriver::lastSNR()).
+///
+/// Route discovery messages then carry the metric of the path they have taken so far, and every node 
+/// they pass through adds the metric of the link they arrived on. Each node keeps the route with the best 
+/// metric, replacing it when a discovery message arrives over a better path, and the originator waits 
+/// RH_MESH_METRIC_RESPONSE_WAIT ms after the first response for better ones.
+/// Nodes follow the metric given by the originator of each discovery, so nodes with different
+/// metrics can be mixed, but only with nodes whose RHMesh also supports metrics.
 ///
 /// \par Route Failure
 ///
@@ -84,6 +289,79 @@
 /// (either because an intermediate node is off the air, or has moved out of range) a new route 
 /// will be established the next time a message is to be sent.
 ///
+/// Route discovery often shows a node more than one neighbour that can reach a destination: 
+/// other copies of a request, responses over other paths, or paths with a worse metric.
+/// The best of the others is kept as the secondary next hop of the route (see RHRouter::addAlternateRouteTo()).
+/// When counting hops, only paths no longer than the route are kept.
+/// When the next hop does not acknowledge one of its own messages, the node switches to the secondary 
+/// next hop and sends the message that way straight away, so one flaky link does not cost a new route 
+/// discovery through the whole network. Intermediate nodes send the RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE 
+/// as before, and each node that gets it, including the source, switches to its secondary next hop 
+/// if it has one, rather than deleting the route.
+/// A relay that would send a message back to the node it got it from treats its route as out of date
+/// in the same way, rather than passing the message back and forth until it runs out of hops. 
+/// This can happen after routes change, particularly with routes learned passively from overheard 
+/// messages (see RHRouter::setPassiveRouteLearning()), which lets nodes near busy paths send 
+/// without route discovery.
+///
+/// \par End to End Acknowledgement
+///
+/// Applications that need to know a message got to its destination used to send it again themselves 
+/// if no reply came back, and each time it was sent over every hop. After setEndToEndAck(true), 
+/// sendtoWait() asks the destination for a delivery receipt: a small RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT
+/// message sent back to the source along the reverse path, which the nodes the message passed through learn
+/// on the way. sendtoWait() waits for the receipt for up to setEndToEndTimeout() ms, and sends the message again 
+/// (with the same ID) up to setEndToEndRetries() times if it does not come, before returning 
+/// RH_ROUTER_ERROR_NO_REPLY. The destination delivers each message only once, however many times it gets it, 
+/// but returns a receipt each time.
+/// While sendtoWait() waits, the node carries on routing messages for other nodes. If a message for this node 
+/// arrives, it is held and returned by a later call to recvfromAck(), in the order they arrived.
+/// There is room to hold RH_MESH_HELD_MESSAGES. Once they are all in use, sendtoWait() stops taking messages 
+/// off the radio until the receipt times out, so messages are left unacknowledged for their senders to send again,
+/// rather than acknowledged and lost.
+/// Every node that may be a destination must support receipts, which all nodes with this version of RHMesh do,
+/// even if RH_MESH_END_TO_END_ACK is 0. Messages queued by asynchronous route discovery are sent without receipts.
+///
+/// \par Source Routing
+///
+/// Normally every relay looks up the next hop to the destination in its own routing table, so every relay 
+/// needs a route to every destination it forwards to, and a change of route has to reach the tables 
+/// of all the relays on the way. Route discovery responses carry the whole path the request took,
+/// and after setSourceRouting(true) the source keeps it (for up to RH_MESH_SOURCE_ROUTES destinations), 
+/// or it can be given with setSourceRoute(), for example on a fixed chain. 
+/// sendtoWait() then sends a RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED message, with the list of relays in front 
+/// of the application message. Each relay sends it on to the next one in the list (or to the destination 
+/// after the last) without looking in its routing table, and without learning anything from it. 
+/// A new path takes effect at once, for the next message the source sends.
+/// Delivery receipts and route failures go back to the source along the same path, reversed.
+/// When one comes back, or the source cannot reach the first relay, the source forgets the path 
+/// (and the route in its routing table), so the next message discovers a new route. 
+/// All nodes with this version of RHMesh forward source routed messages, even if RH_MESH_SOURCE_ROUTES is 0.
+///
+/// \par Sending and Receiving In Place
+///
+/// Like RHRouter (see there), RHMesh builds and parses its messages in the RHRouter message buffer, 
+/// with room for the RHRouter and RHMesh headers in front of the application payload, so messages 
+/// forwarded and route discovery requests passed on by this node are not copied between the layers. 
+/// An application payload written straight into payloadBuffer() is sent by sendtoWait() without being 
+/// copied, and recvfromAckInPlace() returns a pointer to a received payload instead of copying it.
+/// If sendtoWait() has to discover a route first, or wait for a delivery receipt, it keeps a copy 
+/// of such a payload, since the buffer is needed for receiving meanwhile.
+///
+/// \par Static Routes
+///
+/// Route discovery costs a flood of requests, and seconds of latency, the first time each node 
+/// sends to each destination after it starts. If the topology is fixed (say a chain 1-2-3-4), the routes
+/// can instead be provisioned at startup with RHRouter::addStaticRoutes(), from a table compiled into 
+/// the sketch or read from EEPROM. sendtoWait() then sends straight away along the static route, 
+/// and route discovery is only used as a fallback for destinations that have no static route.
+/// Static routes are not replaced by the routes learned from route discovery, and are not deleted 
+/// when a message cannot be delivered along them (sendtoWait() returns the error as usual).
+/// Instead the next sendtoWait() to that destination discovers a route, which is used in place of 
+/// the static one until it fails too, and then the static route is used again. If discovery finds 
+/// nothing, the static route is tried again straight away, in case its next hop has recovered. 
+/// So a dead static next hop costs a route discovery, but does not make its destinations unreachable.
+///
 /// \par Message Format
 ///
 /// RHMesh uses a number of message formats layered on top of RHRouter:
@@ -92,8 +370,18 @@
 /// - MeshRouteDiscoveryMessage (message types RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST 
 ///   and RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE). Carries Route Discovery messages 
 ///   (broadcast) and replies (unicast).
+/// - MeshRouteDiscoveryMetricMessage (message types RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST 
+///   and RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE plus one of RH_MESH_MESSAGE_TYPE_METRIC_*). 
+///   Route Discovery messages that also carry a path metric
 /// - MeshRouteFailureMessage (message type RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE) Informs nodes of 
 ///   route failures.
+/// - MeshDeliveryReceiptMessage (message type RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT) Tells the source 
+///   that an application message with RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED got to its destination
+/// - MeshSourceRoutedMessage (message type RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED) Carries one of the 
+///   other messages along a path chosen by the source
+///
+/// With 16 bit addresses (see RH_ADDRESS_16 in RHDatagram.h) each node address in these messages 
+/// is 2 octets, most significant first, so route discovery messages and source routes are longer.
 ///
 /// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers 
 /// (see http://www.hoperf.com)
@@ -132,26 +420,66 @@ public:
 	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application layer payload data
     } MeshApplicationMessage;
 
-    /// Signals a route discovery request or reply (At present only supports physical dest addresses of length 1 octet)
+    /// Signals a route discovery request or reply (At present only supports physical dest addresses 
+    /// the length of a node address)
     typedef struct
     {
 	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_*
-	uint8_t             destlen; ///< Reserved. Must be 1
-	uint8_t             dest;    ///< The address of the destination node whose route is being sought
-	uint8_t             route[RH_MESH_MAX_MESSAGE_LEN - 2]; ///< List of node addresses visited so far. Length is implcit
+	uint8_t             destlen; ///< Reserved. Must be RH_ADDRESS_LEN
+	RHAddressField      dest;    ///< The address of the destination node whose route is being sought
+	RHAddressField      route[(RH_MESH_MAX_MESSAGE_LEN - 1 - RH_ADDRESS_LEN) / RH_ADDRESS_LEN]; ///< List of node addresses visited so far. Length is implcit
     } MeshRouteDiscoveryMessage;
 
+    /// Signals a route discovery request or reply that carries the metric of the path taken
+    typedef struct
+    {
+	MeshMessageHeader   header;    ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_* plus RH_MESH_MESSAGE_TYPE_METRIC_*
+	uint8_t             destlen;   ///< Reserved. Must be RH_ADDRESS_LEN
+	RHAddressField      dest;      ///< The address of the destination node whose route is being sought
+	uint8_t             metric[2]; ///< Metric of the path so far, most significant octet first
+	RHAddressField      route[(RH_MESH_MAX_MESSAGE_LEN - 3 - RH_ADDRESS_LEN) / RH_ADDRESS_LEN]; ///< List of node addresses visited so far. Length is implcit
+    } MeshRouteDiscoveryMetricMessage;
+
+#if RH_MESH_PENDING_SENDS
+    /// Type of the function called when a message that was queued while its route was discovered could not be sent.
+    /// See setSendFailedCallback()
+    /// \param[in] dest The destination of the message
+    /// \param[in] buf The application message data. Only valid during the call
+    /// \param[in] len Number of octets in the application message data
+    /// \param[in] error Why it failed: RH_ROUTER_ERROR_NO_ROUTE if no route was found, 
+    /// else the error from sending it to the next hop
+    /// \param[in] arg The arg given to setSendFailedCallback()
+    typedef void (*SendFailedCallback)(RHAddress dest, const uint8_t* buf, uint8_t len, uint8_t error, void* arg);
+#endif
+
     /// Signals a route failure
     typedef struct
     {
 	MeshMessageHeader   header; ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
-	uint8_t             dest; ///< The address of the destination towards which the route failed
+	RHAddressField      dest; ///< The address of the destination towards which the route failed
     } MeshRouteFailureMessage;
 
+    /// Signals the delivery of an application message to its destination
+    typedef struct
+    {
+	MeshMessageHeader   header; ///< msgType = RH_MESH_MESSAGE_TYPE_DELIVERY_RECEIPT
+	uint8_t             id;     ///< The RHRouter ID of the message that was delivered
+    } MeshDeliveryReceiptMessage;
+
+    /// Carries another RHMesh message along a path chosen by the source. The relay that got it 
+    /// over n hops (the RHRouter HOPS header) is path[n - 1], and sends it on to path[n], 
+    /// or to the destination if it is the last
+    typedef struct
+    {
+	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	uint8_t             pathlen; ///< Number of relays in path
+	RHAddressField      path[(RH_MESH_MAX_MESSAGE_LEN - 1) / RH_ADDRESS_LEN]; ///< The relays, from the source end, followed by the message carried
+    } MeshSourceRoutedMessage;
+
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHMesh(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHMesh(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Sends a message to the destination node. Initialises the RHRouter message header 
     /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls 
@@ -172,7 +500,18 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    ///         - RH_ROUTER_ERROR_QUEUED With asynchronous route discovery, the message is waiting for its route
+    ///         - RH_ROUTER_ERROR_QUEUE_FULL With asynchronous route discovery, there was no route and no room
+    ///           to park the message
+    ///         - RH_ROUTER_ERROR_NO_REPLY With end to end acknowledgement, no delivery receipt came back
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
+
+    /// Returns where the application payload of the next message goes in the message buffer, after room 
+    /// for the RHRouter and RHMesh headers. A payload of up to RH_MESH_MAX_MESSAGE_LEN octets written here 
+    /// and passed to sendtoWait() is not copied again (see "Sending and Receiving In Place" above).
+    /// The buffer is also used for receiving, so the payload must be written just before sendtoWait() is called.
+    /// \return Pointer to the application payload area of the message buffer
+    uint8_t* payloadBuffer() { return RHRouter::payloadBuffer() + sizeof(MeshMessageHeader); }
 
     /// Starts the receiver if it is not running already, processes and possibly routes any received messages
     /// addressed to other nodes
@@ -190,14 +529,26 @@ public:
     /// If the message is not a broadcast, acknowledge to the sender before returning.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
     /// (not just those addressed to this node).
     /// \return true if a valid message was received for this node and copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
+    /// Like recvfromAck(), but instead of copying the application payload, points *buf at it 
+    /// in the message buffer. It stays valid until the next message is sent or received.
+    /// \param[out] buf Set to point to the application payload of the received message
+    /// \param[out] len Set to the length of the payload
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid application layer message was received for this node
+    bool recvfromAckInPlace(uint8_t** buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid application layer 
@@ -206,14 +557,112 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
+    /// Sets how this node chooses between routes to the destinations it discovers.
+    /// See "Route Metrics" above.
+    /// \param[in] metric One of RH_MESH_METRIC_*. The default is RH_MESH_METRIC_HOPS
+    void setRouteMetric(uint8_t metric);
+
+    /// Sets how long route discovery waits for a response once the request has been sent to the whole network.
+    /// The expanding ring search before that takes extra time (see "Route Discovery" above)
+    /// \param[in] timeout The timeout in milliseconds. The default is RH_MESH_ARP_TIMEOUT (4000)
+    void setArpTimeout(uint16_t timeout);
+
+    /// Sets the limit of the expanding ring search. Route discovery tries requests with TTLs of 1, 2, 4 hops 
+    /// and so on while they are less than maxTtl (and the max hops), before sending the request to the whole network.
+    /// \param[in] maxTtl The limit. The default is RH_MESH_ARP_RING_MAX_TTL (8). 
+    /// 0 or 1 send the request to the whole network straight away.
+    void setArpRing(uint8_t maxTtl);
+
+#if RH_MESH_PENDING_SENDS
+    /// Turns asynchronous route discovery on or off (see "Asynchronous Route Discovery" above).
+    /// Only available if RH_MESH_PENDING_SENDS is not 0.
+    /// \param[in] async true to queue messages while their route is discovered. The default is false
+    void setAsyncDiscovery(bool async);
+
+    /// Sets the function called when a message that was queued by asynchronous route discovery could not be sent.
+    /// It is called from within recvfromAck() or recvfromAckTimeout(), and may call sendtoWait().
+    /// \param[in] callback The function, or NULL for none
+    /// \param[in] arg Passed to the function
+    void setSendFailedCallback(SendFailedCallback callback, void* arg = NULL);
+
+    /// \return The number of messages waiting for asynchronous route discovery
+    uint8_t pendingSends();
+#endif
+
+#if RH_MESH_END_TO_END_ACK
+    /// Turns end to end acknowledgement of the messages sent by sendtoWait() on or off
+    /// (see "End to End Acknowledgement" above).
+    /// Only available if RH_MESH_END_TO_END_ACK is not 0.
+    /// \param[in] ack true to wait for delivery receipts. The default is false
+    void setEndToEndAck(bool ack);
+
+    /// Sets how long sendtoWait() waits for a delivery receipt before sending the message again.
+    /// Should be more than the time the message and the receipt take to cross the network.
+    /// Only available if RH_MESH_END_TO_END_ACK is not 0.
+    /// \param[in] timeout The timeout in milliseconds. The default is RH_MESH_E2E_TIMEOUT (3000)
+    void setEndToEndTimeout(uint16_t timeout);
+
+    /// Sets how many times sendtoWait() sends a message again if no delivery receipt comes back.
+    /// Only available if RH_MESH_END_TO_END_ACK is not 0.
+    /// \param[in] retries The number of retries. The default is RH_MESH_E2E_RETRIES (2)
+    void setEndToEndRetries(uint8_t retries);
+#endif
+
+#if RH_MESH_SOURCE_ROUTES
+    /// Turns source routing of the messages sent by sendtoWait() on or off (see "Source Routing" above).
+    /// When it is on, the paths in route discovery responses are kept, and messages to destinations 
+    /// with a known path are source routed. Only needed at the source.
+    /// Only available if RH_MESH_SOURCE_ROUTES is not 0.
+    /// \param[in] sourceRouting true to source route messages. The default is false
+    void setSourceRouting(bool sourceRouting);
+
+    /// Sets the path to a destination used by source routing, replacing any path known to it. 
+    /// If there is no room for another destination, the one whose path was set longest ago is forgotten.
+    /// Only available if RH_MESH_SOURCE_ROUTES is not 0.
+    /// \param[in] dest The destination node address
+    /// \param[in] path The relays between this node and dest, in order from this node. 
+    /// Neither this node nor dest are included
+    /// \param[in] len The number of relays. 0 if dest is a neighbour
+    /// \return false if there are more than RH_MESH_SOURCE_ROUTE_MAX_HOPS relays
+    bool setSourceRoute(RHAddress dest, const RHAddress* path, uint8_t len);
+
+    /// Returns the path source routing uses to a destination
+    /// Only available if RH_MESH_SOURCE_ROUTES is not 0.
+    /// \param[in] dest The destination node address
+    /// \param[out] len Set to the number of relays in the path
+    /// \return The relays between this node and dest, or NULL if no path is known
+    const RHAddress* getSourceRoute(RHAddress dest, uint8_t* len);
+
+    /// Forgets the path source routing uses to a destination, if any
+    /// Only available if RH_MESH_SOURCE_ROUTES is not 0.
+    /// \param[in] dest The destination node address
+    void deleteSourceRoute(RHAddress dest);
+#endif
+
+#if RH_MESH_REBROADCAST_JITTER
+    /// Sets the longest time this node waits before rebroadcasting a route discovery request 
+    /// (see "Rebroadcast Jitter" above).
+    /// Only available if RH_MESH_REBROADCAST_JITTER is not 0.
+    /// \param[in] airtimes The longest wait, in times the time on air of a request. 
+    /// The default is RH_MESH_REBROADCAST_JITTER_AIRTIMES (4). 0 rebroadcasts requests straight away
+    void setRebroadcastJitter(uint8_t airtimes);
+
+    /// Sets how many copies of a route discovery request this node must hear, while it waits 
+    /// to rebroadcast it, to cancel the rebroadcast (see "Rebroadcast Jitter" above).
+    /// Only available if RH_MESH_REBROADCAST_JITTER is not 0.
+    /// \param[in] copies The number of copies, including the first one. 
+    /// The default is RH_MESH_REBROADCAST_SUPPRESS_COPIES (3). 0 always rebroadcasts
+    void setRebroadcastSuppression(uint8_t copies);
+#endif
 
 protected:
 
@@ -231,15 +680,49 @@ protected:
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
     /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// with an expanding ring search, which may take up to the ARP timeout (see setArpTimeout()) 
+    /// plus the time for the smaller rings.
     /// Virtual so subclasses can override.
     /// \param [in] address The physical address to resolve
+    /// \return true if the address was resolved and added to the local routing table, 
+    /// or there is a static route to it to try again (see retryStaticRoute())
+    virtual bool doArp(RHAddress address);
+
+    /// Broadcasts one route discovery request and waits for a response.
+    /// \param [in] address The physical address to resolve
+    /// \param [in] ttl The number of hops the request may go. 0 for the whole network, 
+    /// in which case it waits for the ARP timeout, else for a time that depends on ttl
     /// \return true if the address was resolved and added to the local routing table
-    virtual bool doArp(uint8_t address);
+    bool discoverRoute(RHAddress address, uint8_t ttl);
+
+    /// Broadcasts a route discovery request, without waiting for a response
+    /// \param [in] address The physical address to resolve
+    /// \param [in] ttl The number of hops the request may go. 0 for the whole network
+    /// \return How long to wait for a response in ms, 0 if the request could not be sent
+    unsigned long sendDiscoveryRequest(RHAddress address, uint8_t ttl);
+
+    /// Sends an application layer message along a known route
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendApplicationMessage(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags);
+
+    /// Builds an application layer message in the message buffer (RHRouter::payloadBuffer()), 
+    /// source routed if there is a path to the destination (see setSourceRouting())
+    /// \param [in] buf The application message data. May be payloadBuffer()
+    /// \param [in] len Number of octets in the application message data
+    /// \param [in] address The destination node address
+    /// \param [in] msgType RH_MESH_MESSAGE_TYPE_APPLICATION, maybe with RH_MESH_MESSAGE_TYPE_RECEIPT_REQUESTED
+    /// \return The length of the RHMesh message
+    uint8_t buildApplicationMessage(uint8_t* buf, uint8_t len, RHAddress address, uint8_t msgType);
+
+    /// Tests whether sendtoWait() can send to a destination without discovering a route
+    /// \param [in] address The destination node address
+    /// \return true if there is a route in the routing table (other than a static route whose next hop failed 
+    /// with nothing found in its place), or a path for source routing, or chain forwarding is on
+    bool hasRouteTo(RHAddress address);
 
     /// Tests if the given address of length addresslen is indentical to the
     /// physical address of this node.
-    /// RHMesh always implements physical addresses as the 1 octet address of the node
+    /// RHMesh always implements physical addresses as the RH_ADDRESS_LEN octet address of the node
     /// given by _thisAddress
     /// Called by recvfromAck() to test whether a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
     /// is for this node.
@@ -249,9 +732,312 @@ protected:
     /// \return true if the physical address of this node is identical to address
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
+    /// Adds the metric of the link from a neighbour to the metric of a path.
+    /// Called while processing a discovery message just received from the neighbour.
+    /// \param [in] metricType The kind of metric, one of RH_MESH_MESSAGE_TYPE_METRIC_*
+    /// \param [in] metric The metric of the path to the neighbour
+    /// \param [in] neighbour The address of the neighbour
+    /// \return The metric of the path including the link
+    uint16_t addLinkMetric(uint8_t metricType, uint16_t metric, RHAddress neighbour);
+
+    /// Adds or updates a route to dest through next_hop, unless there is already a route 
+    /// through a different next hop with a better metric.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The address of the next hop to send messages destined for dest
+    /// \param [in] metric The metric of the route through next_hop, or RH_ROUTER_METRIC_UNKNOWN
+    void addBetterRouteTo(RHAddress dest, RHAddress next_hop, uint16_t metric);
+
+    /// Offers next_hop as the secondary next hop of the route to dest, if the path through it 
+    /// is no more hops than the route has now. Used when route discovery counts hops.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The neighbour the path goes through
+    /// \param [in] hops The number of hops to dest through next_hop
+    void addShortAlternateRouteTo(RHAddress dest, RHAddress next_hop, uint8_t hops);
+
+    /// Tells the source of a message that could not be forwarded, and deletes the route that failed
+    /// \param [in] message The message
+    /// \param [in] from The node this node got the message from
+    /// \param [in] error The error from RHRouter::route()
+    /// \return error if this node is the source, else the result of sending the RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
+    uint8_t routeFailed(RoutedMessage* message, RHAddress from, uint8_t error);
+
+    /// Sends a RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED message on to the next relay in its path, 
+    /// or to its destination, without looking in the routing table. Called by route()
+    /// \param [in] message Pointer to the RHRouter message to be sent
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node this node got the message from
+    /// \return The result code, as for route()
+    uint8_t routeSourceRouted(RoutedMessage* message, uint8_t messageLen, RHAddress from);
+
+    /// Handles a RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED message that could not be sent on to the next relay: 
+    /// the source forgets the path, and relays send a RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE back along it
+    /// \param [in] message Pointer to the RHRouter message that could not be sent
+    /// \param [in] error The error from RHRouter::routeVia()
+    /// \return error if this node is the source, else the result of sending the RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
+    uint8_t sourceRouteFailed(RoutedMessage* message, uint8_t error);
+
+    /// Sends a short message (a delivery receipt or route failure) back along the path of a source routed
+    /// message, to the source
+    /// \param [in] path The relays between the source and this node, in order from the source.
+    /// NULL to route the message through the routing tables as usual
+    /// \param [in] pathLen The number of relays
+    /// \param [in] buf The message to send, at most sizeof(MeshRouteFailureMessage) octets
+    /// \param [in] len Length of the message
+    /// \param [in] dest The source of the source routed message
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendBackAlongPath(const RHAddressField* path, uint8_t pathLen, uint8_t* buf, uint8_t len, RHAddress dest);
+
+    /// Checks a RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED message
+    /// \param [in] buf The RHMesh message
+    /// \param [in] len Length of the message
+    /// \return The length of the RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED header and path before the message carried, 
+    /// or 0 if it is not a valid RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED message
+    uint8_t sourceRouteLen(const uint8_t* buf, uint8_t len);
+
+    /// Handles a message queued by asynchronous forwarding that its next hop did not acknowledge,
+    /// in the same way as route() handles a message it could not forward (see RHRouter::setAsyncForwarding())
+    /// \param [in] message The message
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node this node got the message from
+    virtual void forwardFailed(RoutedMessage* message, uint8_t messageLen, RHAddress from);
+
+    /// Does any deferred work that is due: asynchronous forwarding, rebroadcasts and asynchronous route discovery.
+    /// Called by recvfromAck() and recvfromAckTimeout()
+    /// \return ms until more work is due, -1 if there is none
+    int32_t serviceTimers();
+
+    /// Deletes the route to a destination that could not be reached along it. A static route is kept, 
+    /// but marked StaticFailed, so that another route is looked for before it is used again. 
+    /// If a route found that way fails, the static route is used again.
+    /// \param [in] dest The destination node address
+    void deleteFailedRouteTo(RHAddress dest);
+
+    /// Goes back to a static route whose next hop failed, when route discovery has found no other route.
+    /// Its next hop may have recovered.
+    /// \param [in] dest The destination node address
+    /// \return true if there was such a route
+    bool retryStaticRoute(RHAddress dest);
+
+    /// How this node chooses routes, one of RH_MESH_METRIC_*
+    uint8_t _routeMetric;
+
+    /// Timeout in ms of route discovery sent to the whole network
+    uint16_t _arpTimeout;
+
+    /// Limit of the TTL of the expanding ring search
+    uint8_t _arpRingTtl;
+
+    /// A message that has been seen recently
+    typedef struct
+    {
+	bool          used;    ///< true if this entry holds a message
+	RHAddress     source;  ///< Originator of the message
+	uint8_t       id;      ///< Originator sequence number of the message
+	unsigned long seen;    ///< millis() when it was first seen
+    } SeenMessage;
+
+    /// Checks whether a message is in a table of recently seen messages, and remembers it if not,
+    /// in place of the oldest
+    /// \param [in] table The table
+    /// \param [in] size The number of entries in the table
+    /// \param [in] time How long in ms messages are remembered
+    /// \param [in] source The originator of the message
+    /// \param [in] id The originator's sequence number of the message
+    /// \return true if it was seen in the last time ms
+    bool seenMessage(SeenMessage* table, uint8_t size, unsigned long time, RHAddress source, uint8_t id);
+
+    /// Checks whether a route discovery request has been seen recently, and remembers it if not
+    /// \param [in] source The originator of the request
+    /// \param [in] id The originator's sequence number of the request
+    /// \return true if it was seen in the last RH_MESH_SEEN_DISCOVERY_TIME ms
+    bool seenDiscovery(RHAddress source, uint8_t id);
+
+    /// Sends a delivery receipt back to the source of a message
+    /// \param [in] source The source of the message
+    /// \param [in] id The RHRouter ID of the message
+    /// \param [in] path If the message was source routed, the relays it came through, else NULL
+    /// \param [in] pathLen The number of relays in path
+    void sendReceipt(RHAddress source, uint8_t id, const RHAddressField* path = NULL, uint8_t pathLen = 0);
+
+    /// Recently seen route discovery requests
+    SeenMessage _seenDiscoveries[RH_MESH_SEEN_DISCOVERIES];
+
+    /// Recently delivered messages that asked for a receipt
+    SeenMessage _seenDeliveries[RH_MESH_SEEN_DELIVERIES];
+
+#if RH_MESH_END_TO_END_ACK
+    /// Sends an application message asking for a delivery receipt, and waits for the receipt, 
+    /// sending it again if it does not come
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendtoWaitReceipt(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags);
+
+    /// true if sendtoWait() waits for delivery receipts
+    bool                 _endToEndAck;
+
+    /// How long to wait for each receipt in ms
+    uint16_t             _endToEndTimeout;
+
+    /// How many times to send a message again
+    uint8_t              _endToEndRetries;
+
+    /// true while sendtoWait() is waiting for the receipt from _receiptDest for the message _receiptId
+    bool                 _receiptAwaited;
+    RHAddress            _receiptDest;
+    uint8_t              _receiptId;
+
+    /// An application message that arrived while waiting for a receipt, held for recvfromAck()
+    typedef struct
+    {
+	uint8_t          len;
+	RHAddress        source;
+	RHAddress        dest;
+	uint8_t          id;
+	uint8_t          flags;
+	uint8_t          hops;
+	uint8_t          data[RH_MESH_MAX_MESSAGE_LEN];
+    } HeldMessage;
+
+    /// The held messages: a ring of _heldCount, the oldest at _heldFirst
+    HeldMessage          _held[RH_MESH_HELD_MESSAGES];
+    uint8_t              _heldFirst;
+    uint8_t              _heldCount;
+#endif
+
+#if RH_MESH_SOURCE_ROUTES
+    /// A path kept for source routing
+    typedef struct
+    {
+	RHAddress     dest;    ///< Destination node address
+	uint8_t       len;     ///< Number of relays in path, 0xff if the entry is not used
+	bool          learned; ///< true if learned from route discovery, false if set by setSourceRoute()
+	RHAddress     path[RH_MESH_SOURCE_ROUTE_MAX_HOPS]; ///< The relays, in order from this node
+    } SourceRoute;
+
+    /// Finds the path source routing uses to a destination
+    /// \param [in] dest The destination node address
+    /// \return The path, or NULL if source routing is off or there is no path to dest
+    SourceRoute*         findSourceRoute(RHAddress dest);
+
+    /// Forgets the path to a destination that could not be reached along it, unless it was set by setSourceRoute()
+    /// \param [in] dest The destination node address
+    void                 deleteFailedSourceRoute(RHAddress dest);
+
+    /// Keeps the path of a route discovery response this node asked for, if source routing is on
+    /// \param [in] dest The destination node address
+    /// \param [in] path The relays the request went through
+    /// \param [in] len The number of relays
+    void                 learnSourceRoute(RHAddress dest, const RHAddressField* path, uint8_t len);
+
+    /// true if sendtoWait() source routes messages
+    bool                 _sourceRouting;
+
+    /// The known paths
+    SourceRoute          _sourceRoutes[RH_MESH_SOURCE_ROUTES];
+
+    /// Index of the next entry in _sourceRoutes to use for a new destination
+    uint8_t              _nextSourceRoute;
+#endif
+
+#if RH_MESH_PENDING_SENDS
+    /// A message waiting for asynchronous route discovery
+    typedef struct
+    {
+	RHAddress     dest;    ///< Destination node address
+	uint8_t       flags;   ///< Flags to send with the message
+	uint8_t       len;     ///< Length of data
+	uint8_t       data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application message data
+    } PendingSend;
+
+    /// An asynchronous route discovery in progress
+    typedef struct
+    {
+	bool          active;  ///< true if this discovery is in progress
+	RHAddress     dest;    ///< Address whose route is being discovered
+	uint8_t       ttl;     ///< TTL of the latest request, 0 if it was sent to the whole network
+	unsigned long sent;    ///< millis() when the latest request was sent
+	unsigned long timeout; ///< How long to wait for a response to it
+    } PendingDiscovery;
+
+    /// Parks a message to a destination without a route, and starts discovering the route
+    /// \return RH_ROUTER_ERROR_QUEUED, or RH_ROUTER_ERROR_QUEUE_FULL
+    uint8_t queueSend(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags);
+
+    /// Moves asynchronous route discoveries on: sends the messages waiting for routes that have been found, 
+    /// and tries the next ring or gives up on routes that have not been found in time
+    void processPendingSends();
+
+    /// Sends or fails all the messages waiting for a destination
+    /// \param [in] address The destination
+    /// \param [in] routeFound true to send them, false to fail them with RH_ROUTER_ERROR_NO_ROUTE
+    void sendPending(RHAddress address, bool routeFound);
+
+    /// \return ms until the next asynchronous route discovery times out, -1 if there is none
+    int32_t pendingTimeLeft();
+
+    /// true if sendtoWait() queues messages while discovering routes
+    bool                 _asyncDiscovery;
+
+    /// Called when a queued message cannot be sent
+    SendFailedCallback   _sendFailedCallback;
+
+    /// Passed to _sendFailedCallback
+    void*                _sendFailedArg;
+
+    /// Messages waiting for their routes, in the order they were sent
+    PendingSend          _pending[RH_MESH_PENDING_SENDS];
+
+    /// Number of messages in _pending
+    uint8_t              _pendingSends;
+
+    /// Route discoveries in progress. There cannot be more than there are pending messages
+    PendingDiscovery     _pendingDiscoveries[RH_MESH_PENDING_SENDS];
+#endif
+
+#if RH_MESH_REBROADCAST_JITTER
+    /// Holds a route discovery request back for a random time before it is rebroadcast, 
+    /// or replaces the one waiting with a better copy of the same request
+    /// \param [in] buf The request, with this node already added to its list of nodes
+    /// \param [in] len Length of the request
+    /// \param [in] source The originator of the request
+    /// \param [in] id The originator's sequence number of the request
+    /// \param [in] flags The RHRouter flags (the TTL) of the request
+    void scheduleRebroadcast(uint8_t* buf, uint8_t len, RHAddress source, uint8_t id, uint8_t flags);
+
+    /// Rebroadcasts the waiting route discovery request now
+    void sendRebroadcast();
+
+    /// Longest rebroadcast wait, in times _airtime
+    uint8_t              _rebroadcastJitter;
+
+    /// Copies of a request that cancel its rebroadcast, 0 for none
+    uint8_t              _rebroadcastSuppress;
+
+    /// Time on air of the last broadcast this node sent, in ms
+    unsigned long        _airtime;
+
+    /// The request waiting to be rebroadcast, with room for the RHRouter header so it is sent from here
+    RoutedMessage        _rebroadcast;
+
+    /// Length of _rebroadcast, 0 if there is no request waiting
+    uint8_t              _rebroadcastLen;
+
+    /// Originator, sequence number and RHRouter flags of the waiting request
+    RHAddress            _rebroadcastSource;
+    uint8_t              _rebroadcastId;
+    uint8_t              _rebroadcastFlags;
+
+    /// Number of copies of the waiting request heard so far
+    uint8_t              _rebroadcastCopies;
+
+    /// millis() when the request started waiting, and how long it waits
+    unsigned long        _rebroadcastQueued;
+    unsigned long        _rebroadcastDelay;
+#endif
+
 private:
-    /// Temporary message buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+    /// Keeps a payload from payloadBuffer() while sendtoWait() discovers a route or waits for a receipt.
+    /// One per instance, so that several meshes can run in one process (eg with RH_Sim)
+    uint8_t _tmpMessage[RH_MESH_MAX_MESSAGE_LEN];
 
 };
 
@@ -0,0 +1,166 @@
+// RHPcapFile.cpp
+//
+// Captures RadioHead packets to a memory mapped pcap ring file.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <RHPcapFile.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <algorithm>
+
+// pcap file header, in host byte order
+typedef struct
+{
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} PcapFileHeader;
+
+// pcap record header, in host byte order
+typedef struct
+{
+    uint32_t tsSec;
+    uint32_t tsUsec;
+    uint32_t inclLen;
+    uint32_t origLen;
+} PcapRecordHeader;
+
+// Length of each record in the file, including the pcap record header
+#define RH_PCAP_SLOT_LEN (sizeof(PcapRecordHeader) + RH_PCAP_RECORD_LEN)
+
+RHPcapFile::RHPcapFile()
+    : _map(NULL),
+      _mapLen(0),
+      _fd(-1),
+      _records(0),
+      _captured(0)
+{
+}
+
+RHPcapFile::~RHPcapFile()
+{
+    close();
+}
+
+bool RHPcapFile::open(const char* filename, uint32_t records)
+{
+    close();
+    if (records == 0)
+	return false;
+    _fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0)
+    {
+	fprintf(stderr, "RHPcapFile: could not open %s: %s\n", filename, strerror(errno));
+	return false;
+    }
+    _mapLen = sizeof(PcapFileHeader) + (size_t)records * RH_PCAP_SLOT_LEN;
+    if (ftruncate(_fd, _mapLen) < 0)
+    {
+	fprintf(stderr, "RHPcapFile: could not size %s: %s\n", filename, strerror(errno));
+	::close(_fd);
+	_fd = -1;
+	return false;
+    }
+    void* map = mmap(NULL, _mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+	fprintf(stderr, "RHPcapFile: could not map %s: %s\n", filename, strerror(errno));
+	::close(_fd);
+	_fd = -1;
+	return false;
+    }
+    _map = (uint8_t*)map;
+    _records = records;
+    _captured = 0;
+
+    PcapFileHeader* header = (PcapFileHeader*)_map;
+    header->magic = 0xa1b2c3d4; // Microsecond timestamps
+    header->versionMajor = 2;
+    header->versionMinor = 4;
+    header->thiszone = 0;
+    header->sigfigs = 0;
+    header->snaplen = RH_PCAP_RECORD_LEN;
+    header->network = RH_PCAP_LINKTYPE;
+
+    // Every record is valid but empty until it is used. The rest of the file is already 0
+    for (uint32_t i = 0; i < records; i++)
+    {
+	PcapRecordHeader* r = (PcapRecordHeader*)(_map + sizeof(PcapFileHeader) + (size_t)i * RH_PCAP_SLOT_LEN);
+	r->inclLen = RH_PCAP_RECORD_LEN;
+	r->origLen = RH_PCAP_RECORD_LEN;
+    }
+    return true;
+}
+
+void RHPcapFile::close()
+{
+    if (_map)
+    {
+	// Once the ring has wrapped, the oldest record is the next one to be overwritten. 
+	// Move it to the front, so the records are in the order they were captured
+	uint8_t* first = _map + sizeof(PcapFileHeader);
+	if (_captured > _records)
+	    std::rotate(first, first + (size_t)(_captured % _records) * RH_PCAP_SLOT_LEN, _map + _mapLen);
+	munmap(_map, _mapLen);
+	_map = NULL;
+	// Drop the unused records if the ring never filled
+	if (_captured < _records)
+	    if (ftruncate(_fd, sizeof(PcapFileHeader) + (size_t)_captured * RH_PCAP_SLOT_LEN) < 0)
+		fprintf(stderr, "RHPcapFile: could not truncate: %s\n", strerror(errno));
+    }
+    if (_fd >= 0)
+    {
+	::close(_fd);
+	_fd = -1;
+    }
+}
+
+void RHPcapFile::capture(const Record& record)
+{
+    if (!_map)
+	return;
+
+    uint8_t* slot = _map + sizeof(PcapFileHeader) + (size_t)(_captured % _records) * RH_PCAP_SLOT_LEN;
+    PcapRecordHeader* r = (PcapRecordHeader*)slot;
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    uint64_t now = simulatorMicros();
+    r->tsSec = now / 1000000;
+    r->tsUsec = now % 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    r->tsSec = tv.tv_sec;
+    r->tsUsec = tv.tv_usec;
+#endif
+
+    uint8_t* p = slot + sizeof(PcapRecordHeader);
+    p[0] = RH_PCAP_RECORD_VERSION;
+    p[1] = record.direction;
+    p[2] = record.node;
+    p[3] = (uint8_t)record.snr;
+    p[4] = (uint16_t)record.rssi >> 8;
+    p[5] = (uint16_t)record.rssi & 0xff;
+    p[6] = record.to;
+    p[7] = record.from;
+    p[8] = record.id;
+    p[9] = record.flags;
+    p[10] = record.len;
+    memcpy(p + RH_PCAP_RECORD_HEADER_LEN, record.payload, record.len);
+    _captured++;
+}
+
+#endif
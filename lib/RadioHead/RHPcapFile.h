@@ -0,0 +1,107 @@
+// RHPcapFile.h
+//
+// Captures RadioHead packets to a memory mapped pcap ring file.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#ifndef RHPcapFile_h
+#define RHPcapFile_h
+
+#include <RHCapture.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+
+// pcap link type of the records: LINKTYPE_USER0
+#define RH_PCAP_LINKTYPE           147
+
+// Version of the record format, in the first octet of each record
+#define RH_PCAP_RECORD_VERSION     1
+
+// Length of the fields before the payload in each record
+#define RH_PCAP_RECORD_HEADER_LEN  11
+
+// Length of the data in each record: fields and the longest possible payload
+#define RH_PCAP_RECORD_LEN         (RH_PCAP_RECORD_HEADER_LEN + 255)
+
+// Default number of records in the ring
+#define RH_PCAP_DEFAULT_RECORDS    65536
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHPcapFile RHPcapFile.h <RHPcapFile.h>
+/// \brief RHCapture that writes packets to a memory mapped pcap ring file
+///
+/// The file is a standard pcap file with link type LINKTYPE_USER0 (147) and microsecond timestamps,
+/// which Wireshark can read with the dissector in tools/radiohead.lua.
+/// Every record has the same length, so the file is a ring of records: when it is full,
+/// the oldest records are overwritten, so a capture can run indefinitely in a fixed amount
+/// of disk. Records are written straight into the mapped file without any system calls,
+/// so capture costs little more than a memcpy, and the records written before a crash are kept.
+/// Unused records are marked as empty (version 0), so the file can be read at any time.
+/// If the ring has not wrapped, close() truncates the file after the last record. If it has,
+/// close() moves the records round so they are in the order they were captured. Until then (or after 
+/// a crash) they are in ring order, with the oldest after the newest: reordercap can sort them.
+///
+/// Timestamps are the time of day, or the simulated time in virtual clock simulator builds.
+///
+/// Each record contains, in network byte order:
+/// \code
+/// version    1 octet  RH_PCAP_RECORD_VERSION, 0 for an unused record
+/// direction  1 octet  One of RH_CAPTURE_*
+/// node       1 octet  Address of the capturing node
+/// snr        1 octet  SNR in dB, signed
+/// rssi       2 octets RSSI in dBm, signed
+/// to         1 octet  RadioHead TO header
+/// from       1 octet  RadioHead FROM header
+/// id         1 octet  RadioHead ID header
+/// flags      1 octet  RadioHead FLAGS header
+/// length     1 octet  Length of the payload
+/// payload    255 octets, of which length are used
+/// \endcode
+///
+/// Only available on Linux and compatible platforms.
+class RHPcapFile : public RHCapture
+{
+public:
+    /// Constructor. Call open() to start capturing
+    RHPcapFile();
+
+    /// Destructor. Closes the file
+    virtual ~RHPcapFile();
+
+    /// Creates (or truncates) the capture file, and maps it into memory
+    /// \param[in] filename Name of the file
+    /// \param[in] records Number of records in the ring
+    /// \return true if the file was created and mapped. Errors are reported on stderr
+    bool open(const char* filename, uint32_t records = RH_PCAP_DEFAULT_RECORDS);
+
+    /// Unmaps and closes the file, truncating it after the last record if the ring has not wrapped,
+    /// or putting the records in the order they were captured if it has
+    void close();
+
+    /// Writes a packet to the next record in the ring, overwriting the oldest if it is full.
+    /// Does nothing if the file is not open
+    /// \param[in] record The packet
+    virtual void capture(const Record& record);
+
+    /// \return The number of packets captured since the file was opened
+    uint32_t captured() { return _captured; }
+
+private:
+    /// Start of the mapped file, or NULL if not open
+    uint8_t*  _map;
+
+    /// Length of the mapped file
+    size_t    _mapLen;
+
+    /// File descriptor of the file
+    int       _fd;
+
+    /// Number of records in the ring
+    uint32_t  _records;
+
+    /// Count of packets captured
+    uint32_t  _captured;
+};
+
+#endif
+#endif
@@ -12,17 +12,31 @@
 // $Id: RHReliableDatagram.cpp,v 1.18 2018/11/08 02:31:43 mikem Exp $
 
 #include <RHReliableDatagram.h>
+#include <RHCRC.h>
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHDatagram(driver, thisAddress)
 {
     _retransmissions = 0;
     _lastSequenceNumber = 0;
     _timeout = RH_DEFAULT_TIMEOUT;
     _retries = RH_DEFAULT_RETRIES;
+#if RH_ADDRESS_16
+    RHclearAddressValues(_seenIds, RH_RELIABLE_DATAGRAM_SEEN_IDS);
+#else
     memset(_seenIds, 0, sizeof(_seenIds));
+#endif
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+    _window = RH_RELIABLE_DATAGRAM_WINDOW;
+    uint8_t i;
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_WINDOW_PEERS; i++)
+	_windowPeers[i].from = RH_DATAGRAM_BROADCAST_ADDRESS;
+#endif
+    _lastSnapshot = 0;
+    _snapshotCrc = 0;
+    _snapshotTaken = false;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -45,68 +59,49 @@ uint8_t RHReliableDatagram::retries()
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address)
 {
     // Assemble the message
     uint8_t thisSequenceNumber = ++_lastSequenceNumber;
     uint8_t retries = 0;
     while (retries++ <= _retries)
     {
-	setHeaderId(thisSequenceNumber);
-
-        // Set and clear header flags depending on if this is an
-        // initial send or a retry.
-        uint8_t headerFlagsToSet = RH_FLAGS_NONE;
-        // Always clear the ACK flag
-        uint8_t headerFlagsToClear = RH_FLAGS_ACK;
-        if (retries == 1) {
-            // On an initial send, clear the RETRY flag in case
-            // it was previously set
-            headerFlagsToClear |= RH_FLAGS_RETRY;
-        } else {
-            // Not an initial send, set the RETRY flag
-            headerFlagsToSet = RH_FLAGS_RETRY;
-        }
-        setHeaderFlags(headerFlagsToSet, headerFlagsToClear);
-
-	sendto(buf, len, address);
-	waitPacketSent();
+	transmit(buf, len, address, thisSequenceNumber, retries > 1);
 
 	// Never wait for ACKS to broadcasts:
-	if (address == RH_BROADCAST_ADDRESS)
+	if (address == RH_DATAGRAM_BROADCAST_ADDRESS)
 	    return true;
 
-	if (retries > 1)
-	    _retransmissions++;
 	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
 
-	// Compute a new timeout, random between _timeout and _timeout*2
-	// This is to prevent collisions on every retransmit
-	// if 2 nodes try to transmit at the same time
-#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
-	uint16_t timeout = _timeout + (_timeout * (random() & 0xFF) / 256);
-#else
-	uint16_t timeout = _timeout + (_timeout * random(0, 256) / 256);
-#endif
+	uint16_t timeout = ackTimeout();
 	int32_t timeLeft;
         while ((timeLeft = timeout - (millis() - thisSendTime)) > 0)
 	{
 	    if (waitAvailableTimeout(timeLeft))
 	    {
-		uint8_t from, to, id, flags;
+		RHAddress from, to;
+		uint8_t id, flags;
 		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
 		{
 		    // Now have a message: is it our ACK?
 		    if (   from == address 
 			   && to == _thisAddress 
 			   && (flags & RH_FLAGS_ACK) 
+			   && !(flags & RH_FLAGS_WINDOW)
 			   && (id == thisSequenceNumber))
 		    {
 			// Its the ACK we are waiting for
 			return true;
 		    }
-		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
+		    else if ((flags & RH_FLAGS_ACK) && to == _thisAddress)
+		    {
+			// An ACK for some other message, maybe one sent with transmit()
+			ackReceived(from, id);
+		    }
+		    else if (   !(flags & (RH_FLAGS_ACK | RH_FLAGS_WINDOW))
+				&& to == _thisAddress
+				&& (id == seenId(from)))
 		    {
 			// This is a request we have already received. ACK it again
 			acknowledge(id, from);
@@ -124,16 +119,173 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
     return false;
 }
 
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setWindow(uint8_t window)
+{
+    if (window < 1)
+	window = 1;
+    else if (window > RH_RELIABLE_DATAGRAM_MAX_WINDOW)
+	window = RH_RELIABLE_DATAGRAM_MAX_WINDOW;
+    _window = window;
+}
+
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+uint8_t RHReliableDatagram::sendtoWaitWindow(uint8_t** bufs, uint8_t* lens, uint8_t count, RHAddress address, bool* acknowledged)
+{
+    uint8_t i;
+    if (acknowledged)
+	for (i = 0; i < count; i++)
+	    acknowledged[i] = true;
+    if (address == RH_DATAGRAM_BROADCAST_ADDRESS)
+    {
+	// Nothing will acknowledge them
+	for (i = 0; i < count; i++)
+	    sendtoWait(bufs[i], lens[i], address);
+	return count;
+    }
+
+    // Message i has ID firstId + i
+    uint8_t firstId = _lastSequenceNumber + 1;
+    _lastSequenceNumber += count;
+    uint8_t base = 0;      // The oldest message not acknowledged
+    uint8_t sent = 0;      // The messages before this have been sent at least once
+    uint32_t acked = 0;    // Bit n is set if message base + n has been acknowledged
+    uint8_t tries = 0;     // Attempts in a row that got nothing new acknowledged
+    bool ackLost = false;  // true if the last attempt got no ACK at all
+    uint8_t gaveUp = 0;    // Messages given up
+    while (base < count)
+    {
+	if (tries > _retries)
+	{
+	    // Retries exhausted for the oldest missing message. Give up on it, but not the rest
+	    if (acknowledged)
+		acknowledged[base] = false;
+	    gaveUp++;
+	    do
+	    {
+		acked >>= 1;
+		base++;
+	    } while (base < count && (acked & 1));
+	    tries = 0;
+	    ackLost = false;
+	    continue;
+	}
+	if (ackLost)
+	{
+	    // Ask again, with the oldest missing message
+	    transmitWindow(bufs[base], lens[base], address, firstId + base, firstId + base, true, true);
+	}
+	else
+	{
+	    // The window, less what has been acknowledged: any that were sent before were lost.
+	    // Only the last one asks for an ACK
+	    uint8_t end = count - base > _window ? base + _window : count;
+	    uint8_t last = end - 1;
+	    while (acked & (1UL << (last - base)))
+		last--;
+	    for (i = base; i <= last; i++)
+		if (!(acked & (1UL << (i - base))))
+		    transmitWindow(bufs[i], lens[i], address, firstId + i, firstId + base, i < sent, i == last);
+	    if (end > sent)
+		sent = end;
+	}
+
+	// Wait for the selective ACK
+	bool progress = false;
+	ackLost = true;
+	unsigned long thisSendTime = millis(); // Timeout does not include the transmit time
+	uint16_t timeout = ackTimeout();
+	int32_t timeLeft;
+	while (ackLost && (timeLeft = timeout - (millis() - thisSendTime)) > 0)
+	{
+	    if (waitAvailableTimeout(timeLeft))
+	    {
+		RHAddress from, to;
+		uint8_t id, flags;
+		uint8_t ack[4];
+		uint8_t ackLen = sizeof(ack);
+		if (recvfrom(ack, &ackLen, &from, &to, &id, &flags))
+		{
+		    uint8_t done = id - (uint8_t)(firstId + base);
+		    if (   from == address
+			&& to == _thisAddress
+			&& (flags & RH_FLAGS_ACK)
+			&& (flags & RH_FLAGS_WINDOW)
+			&& ackLen == sizeof(ack)
+			&& done <= sent - base) // Else an old ACK
+		    {
+			// Everything before id has arrived, and the bitmap says which of the ones after it have
+			ackLost = false;
+			uint32_t bitmap = ((uint32_t)ack[0] << 24) | ((uint32_t)ack[1] << 16) | ((uint32_t)ack[2] << 8) | ack[3];
+			uint8_t outstanding = sent - base - done;
+			if (outstanding < RH_RELIABLE_DATAGRAM_MAX_WINDOW)
+			    bitmap &= (1UL << outstanding) - 1;
+			acked = done < RH_RELIABLE_DATAGRAM_MAX_WINDOW ? acked >> done : 0;
+			if (done || (bitmap & ~acked))
+			    progress = true;
+			base += done;
+			acked |= bitmap;
+			while (base < count && (acked & 1))
+			{
+			    acked >>= 1;
+			    base++;
+			}
+		    }
+		    else if ((flags & RH_FLAGS_ACK) && to == _thisAddress)
+		    {
+			// An ACK for some other message, maybe one sent with transmit()
+			ackReceived(from, id);
+		    }
+		    else if (   !(flags & (RH_FLAGS_ACK | RH_FLAGS_WINDOW))
+			     && to == _thisAddress
+			     && (id == seenId(from)))
+		    {
+			// This is a request we have already received. ACK it again
+			acknowledge(id, from);
+		    }
+		    // Else discard it
+		}
+	    }
+	    YIELD;
+	}
+	tries = progress ? 0 : tries + 1;
+    }
+    return count - gaveUp;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {  
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in some drivers
     if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
     {
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+	if (!(_flags & RH_FLAGS_ACK) && (_flags & RH_FLAGS_WINDOW))
+	{
+	    // Sent by sendtoWaitWindow(). The first octet is the oldest message the sender is waiting for
+	    if (_to != _thisAddress || *len < 1)
+		return false;
+	    WindowPeer* peer = windowPeer(_from, buf[0]);
+	    bool isNew = windowReceived(peer, _id);
+	    if (_flags & RH_FLAGS_ACK_REQUEST)
+		acknowledgeWindow(peer);
+	    if (!isNew)
+		return false; // Seen it before
+	    (*len)--;
+	    memmove(buf, buf + 1, *len);
+	    if (from)  *from =  _from;
+	    if (to)    *to =    _to;
+	    if (id)    *id =    _id;
+	    if (flags) *flags = _flags;
+	    return true;
+	}
+#endif
 	// Never ACK an ACK
 	if (!(_flags & RH_FLAGS_ACK))
 	{
@@ -160,23 +312,25 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
             // shuts down between transmissions. Devices that do this will report the
             // the same ID each time since their internal sequence number will reset
             // to zero each time the device starts up.
-	    if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY)) || _id != _seenIds[_from])
+	    if ((RH_ENABLE_EXPLICIT_RETRY_DEDUP && !(_flags & RH_FLAGS_RETRY)) || _id != seenId(_from))
 	    {
 		if (from)  *from =  _from;
 		if (to)    *to =    _to;
 		if (id)    *id =    _id;
 		if (flags) *flags = _flags;
-		_seenIds[_from] = _id;
+		setSeenId(_from, _id);
 		return true;
 	    }
 	    // Else just re-ack it and wait for a new one
 	}
+	else if (_to == _thisAddress)
+	    ackReceived(_from, _id);
     }
     // No message for us available
     return false;
 }
 
-bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
     int32_t timeLeft;
@@ -202,10 +356,62 @@ void RHReliableDatagram::resetRetransmissions()
     _retransmissions = 0;
 }
  
-void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::transmit(uint8_t* buf, uint8_t len, RHAddress address, uint8_t id, bool retry, uint8_t flags)
 {
     setHeaderId(id);
-    setHeaderFlags(RH_FLAGS_ACK);
+
+    // Set and clear header flags depending on if this is an
+    // initial send or a retry.
+    uint8_t headerFlagsToSet = flags;
+    // Always clear the ACK flag, and the window flags unless they are wanted
+    uint8_t headerFlagsToClear = RH_FLAGS_ACK | ((RH_FLAGS_WINDOW | RH_FLAGS_ACK_REQUEST) & ~flags);
+    if (!retry) {
+	// On an initial send, clear the RETRY flag in case
+	// it was previously set
+	headerFlagsToClear |= RH_FLAGS_RETRY;
+    } else {
+	// Not an initial send, set the RETRY flag
+	headerFlagsToSet |= RH_FLAGS_RETRY;
+	_retransmissions++;
+    }
+    setHeaderFlags(headerFlagsToSet, headerFlagsToClear);
+
+    sendto(buf, len, address);
+    waitPacketSent();
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::nextSequenceNumber()
+{
+    return ++_lastSequenceNumber;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::ackTimeout()
+{
+    // Compute a new timeout, random between _timeout and _timeout*2
+    // This is to prevent collisions on every retransmit
+    // if 2 nodes try to transmit at the same time
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    return _timeout + (_timeout * (random() & 0xFF) / 256);
+#else
+    return _timeout + (_timeout * random(0, 256) / 256);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override
+void RHReliableDatagram::ackReceived(RHAddress from, uint8_t id)
+{
+    (void)from; // Not used
+    (void)id; // Not used
+}
+
+void RHReliableDatagram::acknowledge(uint8_t id, RHAddress from)
+{
+    setHeaderId(id);
+    setHeaderFlags(RH_FLAGS_ACK, RH_FLAGS_APPLICATION_SPECIFIC | RH_FLAGS_WINDOW | RH_FLAGS_ACK_REQUEST);
     // We would prefer to send a zero length ACK,
     // but if an RH_RF22 receives a 0 length message with a CRC error, it will never receive
     // a 0 length message again, until its reset, which makes everything hang :-(
@@ -216,3 +422,242 @@ void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
     waitPacketSent();
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHReliableDatagram::seenId(RHAddress from)
+{
+#if RH_ADDRESS_16
+    RHAddressValue* v = RHfindAddressValue(_seenIds, RH_RELIABLE_DATAGRAM_SEEN_IDS, from);
+    return v->address == from ? v->value : 0;
+#else
+    return _seenIds[from];
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::setSeenId(RHAddress from, uint8_t id)
+{
+#if RH_ADDRESS_16
+    RHAddressValue* v = RHfindAddressValue(_seenIds, RH_RELIABLE_DATAGRAM_SEEN_IDS, from);
+    v->address = from;
+    v->value = id;
+#else
+    _seenIds[from] = id;
+#endif
+}
+
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::transmitWindow(uint8_t* buf, uint8_t len, RHAddress address, uint8_t id, uint8_t base, bool retry, bool ackRequest)
+{
+    // The message, after the oldest one we are waiting for
+    uint8_t message[RH_MAX_MESSAGE_LEN];
+    if (len > sizeof(message) - 1)
+	len = sizeof(message) - 1;
+    message[0] = base;
+    memcpy(message + 1, buf, len);
+    transmit(message, len + 1, address, id, retry, RH_FLAGS_WINDOW | (ackRequest ? RH_FLAGS_ACK_REQUEST : RH_FLAGS_NONE));
+}
+
+////////////////////////////////////////////////////////////////////
+RHReliableDatagram::WindowPeer* RHReliableDatagram::windowPeer(RHAddress from, uint8_t base)
+{
+    unsigned long now = millis();
+    uint8_t i;
+    uint8_t oldest = 0;
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_WINDOW_PEERS; i++)
+    {
+	WindowPeer* p = &_windowPeers[i];
+	if (p->from != RH_DATAGRAM_BROADCAST_ADDRESS && now - p->heard >= RH_RELIABLE_DATAGRAM_WINDOW_IDLE)
+	    p->from = RH_DATAGRAM_BROADCAST_ADDRESS; // Its transfer is long over
+	if (p->from == from)
+	{
+	    oldest = i;
+	    break;
+	}
+	if (   _windowPeers[oldest].from != RH_DATAGRAM_BROADCAST_ADDRESS
+	    && (p->from == RH_DATAGRAM_BROADCAST_ADDRESS || now - p->heard > now - _windowPeers[oldest].heard))
+	    oldest = i;
+    }
+    WindowPeer* peer = &_windowPeers[oldest];
+    uint8_t ahead = base - peer->base;
+    if (peer->from != from || (ahead >= 128 && (uint8_t)-ahead > RH_RELIABLE_DATAGRAM_MAX_WINDOW))
+    {
+	// A new transfer, or the sender has restarted: the window starts at base
+	peer->from = from;
+	peer->base = base;
+	peer->received = 0;
+    }
+    else if (ahead && ahead < 128)
+    {
+	// The sender has had everything before base acknowledged
+	peer->received = ahead < RH_RELIABLE_DATAGRAM_MAX_WINDOW ? peer->received >> ahead : 0;
+	peer->base = base;
+    }
+    peer->heard = now;
+    return peer;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::windowReceived(WindowPeer* peer, uint8_t id)
+{
+    uint8_t offset = id - peer->base;
+    if (offset >= RH_RELIABLE_DATAGRAM_MAX_WINDOW || (peer->received & (1UL << offset)))
+	return false; // Already had it
+    peer->received |= 1UL << offset;
+    while (peer->received & 1)
+    {
+	peer->received >>= 1;
+	peer->base++;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHReliableDatagram::acknowledgeWindow(WindowPeer* peer)
+{
+    #if defined(RH_ACK_DELAY)
+    unsigned long ts = millis();
+    while ((millis() - ts) <= RH_ACK_DELAY)
+	YIELD;
+    #endif
+    // The oldest message still missing, and which of the ones after it have arrived
+    setHeaderId(peer->base);
+    setHeaderFlags(RH_FLAGS_ACK | RH_FLAGS_WINDOW, RH_FLAGS_APPLICATION_SPECIFIC | RH_FLAGS_ACK_REQUEST);
+    uint8_t ack[4];
+    ack[0] = peer->received >> 24;
+    ack[1] = (peer->received >> 16) & 0xff;
+    ack[2] = (peer->received >> 8) & 0xff;
+    ack[3] = peer->received & 0xff;
+    sendto(ack, sizeof(ack), peer->from);
+    waitPacketSent();
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+// CRC of the body of a snapshot image
+static uint16_t snapshotCrc(const uint8_t* body, uint16_t len)
+{
+    uint16_t crc = 0xffff;
+    while (len--)
+	crc = RHcrc_ccitt_update(crc, *body++);
+    return crc;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::snapshot(uint8_t* buf, uint16_t len)
+{
+    if (len < RH_SNAPSHOT_HEADER_LEN)
+	return 0;
+    uint16_t bodyLen = snapshotState(buf + RH_SNAPSHOT_HEADER_LEN, len - RH_SNAPSHOT_HEADER_LEN);
+    if (!bodyLen)
+	return 0;
+    uint16_t crc = snapshotCrc(buf + RH_SNAPSHOT_HEADER_LEN, bodyLen);
+    buf[0] = 'R';
+    buf[1] = 'H';
+    buf[2] = RH_SNAPSHOT_VERSION;
+    buf[3] = bodyLen >> 8;
+    buf[4] = bodyLen & 0xff;
+    buf[5] = crc >> 8;
+    buf[6] = crc & 0xff;
+    _lastSnapshot = millis();
+    _snapshotCrc = crc;
+    _snapshotTaken = true;
+    return RH_SNAPSHOT_HEADER_LEN + bodyLen;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHReliableDatagram::snapshotIfDue(uint8_t* buf, uint16_t len, unsigned long interval)
+{
+    if (_snapshotTaken && millis() - _lastSnapshot < interval)
+	return 0;
+    uint16_t lastCrc = _snapshotCrc;
+    bool taken = _snapshotTaken;
+    uint16_t imageLen = snapshot(buf, len);
+    if (taken && imageLen && _snapshotCrc == lastCrc)
+	return 0; // Nothing has changed, so there is no need to write it again
+    return imageLen;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHReliableDatagram::restore(const uint8_t* buf, uint16_t len)
+{
+    if (   len < RH_SNAPSHOT_HEADER_LEN 
+	|| buf[0] != 'R' || buf[1] != 'H' || buf[2] != RH_SNAPSHOT_VERSION)
+	return false;
+    uint16_t bodyLen = (buf[3] << 8) | buf[4];
+    if (   bodyLen > len - RH_SNAPSHOT_HEADER_LEN
+	|| snapshotCrc(buf + RH_SNAPSHOT_HEADER_LEN, bodyLen) != ((buf[5] << 8) | buf[6]))
+	return false; // Torn or corrupted
+    return restoreState(buf + RH_SNAPSHOT_HEADER_LEN, bodyLen) == bodyLen;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses that keep more state extend this
+uint16_t RHReliableDatagram::snapshotState(uint8_t* buf, uint16_t len)
+{
+    // The sequence number, then the last id seen from each node that has sent us anything
+    uint16_t count = 0;
+    uint16_t i;
+#if RH_ADDRESS_16
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_SEEN_IDS; i++)
+	if (_seenIds[i].address != RH_DATAGRAM_BROADCAST_ADDRESS && _seenIds[i].value)
+	    count++;
+#else
+    for (i = 0; i < 256; i++)
+	if (_seenIds[i])
+	    count++;
+#endif
+    if (len < 3 + count * (RH_ADDRESS_LEN + 1))
+	return 0;
+    buf[0] = _lastSequenceNumber;
+    buf[1] = count >> 8;
+    buf[2] = count & 0xff;
+    uint8_t* p = buf + 3;
+#if RH_ADDRESS_16
+    for (i = 0; i < RH_RELIABLE_DATAGRAM_SEEN_IDS; i++)
+    {
+	if (_seenIds[i].address != RH_DATAGRAM_BROADCAST_ADDRESS && _seenIds[i].value)
+	{
+	    RHputAddress(*(RHAddressField*)p, _seenIds[i].address);
+	    p += RH_ADDRESS_LEN;
+	    *p++ = _seenIds[i].value;
+	}
+    }
+#else
+    for (i = 0; i < 256; i++)
+    {
+	if (_seenIds[i])
+	{
+	    *p++ = i;
+	    *p++ = _seenIds[i];
+	}
+    }
+#endif
+    return p - buf;
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses that keep more state extend this
+uint16_t RHReliableDatagram::restoreState(const uint8_t* buf, uint16_t len)
+{
+    if (len < 3)
+	return 0;
+    uint16_t count = (buf[1] << 8) | buf[2];
+    if (count > 256 || len < 3 + count * (RH_ADDRESS_LEN + 1))
+	return 0;
+    // Messages may have been sent after the image was taken, and their ids will still be 
+    // remembered by the nodes that got them
+    _lastSequenceNumber = buf[0] + RH_SNAPSHOT_SEQUENCE_SKIP;
+#if RH_ADDRESS_16
+    RHclearAddressValues(_seenIds, RH_RELIABLE_DATAGRAM_SEEN_IDS);
+#else
+    memset(_seenIds, 0, sizeof(_seenIds));
+#endif
+    const uint8_t* p = buf + 3;
+    while (count--)
+    {
+	setSeenId(RHgetAddress(*(const RHAddressField*)p), p[RH_ADDRESS_LEN]);
+	p += RH_ADDRESS_LEN + 1;
+    }
+    return p - buf;
+}
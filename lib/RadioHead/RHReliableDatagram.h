@@ -15,6 +15,12 @@
 /// The retry bit in the header FLAGS. This indicates that the payload is a retry for a
 /// previously sent message.
 #define RH_FLAGS_RETRY 0x40
+/// The window bit in the header FLAGS. This indicates a message sent by sendtoWaitWindow(), 
+/// or the selective ACK of such messages
+#define RH_FLAGS_WINDOW 0x20
+/// The ACK request bit in the header FLAGS. Set on the messages sent by sendtoWaitWindow() 
+/// that the receiver should acknowledge
+#define RH_FLAGS_ACK_REQUEST 0x10
 
 /// This macro enables enhanced message deduplication behavior. This currently defaults
 /// to 0 (off), but this may change to default to 1 (on) in future releases. Consumers who
@@ -37,6 +43,62 @@
 /// The default number of retries
 #define RH_DEFAULT_RETRIES 3
 
+/// Number of nodes whose last message ID is remembered for duplicate detection, with 16 bit addresses
+/// (see RH_ADDRESS_16). With 8 bit addresses every node is remembered
+#ifndef RH_RELIABLE_DATAGRAM_SEEN_IDS
+ #define RH_RELIABLE_DATAGRAM_SEEN_IDS 64
+#endif
+
+/// Number of senders whose windows of messages (see sendtoWaitWindow()) a receiver keeps track of at once. 
+/// 0 leaves windowed sending and receiving out
+#ifndef RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+ #define RH_RELIABLE_DATAGRAM_WINDOW_PEERS 4
+#endif
+
+/// The default number of messages sendtoWaitWindow() sends before it waits for an ACK (see setWindow())
+#ifndef RH_RELIABLE_DATAGRAM_WINDOW
+ #define RH_RELIABLE_DATAGRAM_WINDOW 8
+#endif
+
+/// The most messages that can be outstanding in a window: the number of bits in a selective ACK
+#define RH_RELIABLE_DATAGRAM_MAX_WINDOW 32
+
+/// How long in ms a receiver remembers the window of a sender it has not heard from
+#ifndef RH_RELIABLE_DATAGRAM_WINDOW_IDLE
+ #define RH_RELIABLE_DATAGRAM_WINDOW_IDLE 10000
+#endif
+
+/// Version of the image format written by RHReliableDatagram::snapshot(). 
+/// Images with 16 bit addresses are different
+#if RH_ADDRESS_16
+ #define RH_SNAPSHOT_VERSION 0x81
+#else
+ #define RH_SNAPSHOT_VERSION 1
+#endif
+
+/// Length of the header of a snapshot image: "RH", version, length of the rest, CRC of the rest
+#define RH_SNAPSHOT_HEADER_LEN 7
+
+/// Longest state RHReliableDatagram writes in a snapshot image: sequence number, count, 
+/// and the last ID seen from each node
+#if RH_ADDRESS_16
+ #define RH_SNAPSHOT_SEEN_IDS_MAX_LEN (3 + RH_RELIABLE_DATAGRAM_SEEN_IDS * (RH_ADDRESS_LEN + 1))
+#else
+ #define RH_SNAPSHOT_SEEN_IDS_MAX_LEN (3 + 256 * 2)
+#endif
+
+/// Default minimum time in milliseconds between the images returned by snapshotIfDue(), 
+/// to spare the flash they are written to
+#ifndef RH_SNAPSHOT_INTERVAL
+ #define RH_SNAPSHOT_INTERVAL 60000
+#endif
+
+/// How far restore() moves the sequence numbers on, to get past the ids of messages sent 
+/// after the image was taken. Should be more than the number of messages sent between images
+#ifndef RH_SNAPSHOT_SEQUENCE_SKIP
+ #define RH_SNAPSHOT_SEQUENCE_SKIP 64
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHReliableDatagram RHReliableDatagram.h <RHReliableDatagram.h>
 /// \brief RHDatagram subclass for sending addressed, acknowledged, retransmitted datagrams.
@@ -86,6 +148,44 @@
 /// retransmit strategy and configuration lest they hang for a long time
 /// trying to reply to clients that are unreachable.
 ///
+/// \par Windowed Sending
+///
+/// Waiting for the ACK of each message before sending the next limits a transfer of many messages,
+/// such as a log upload, to one message per time on air of the message, turnaround and time on air of the ACK.
+/// sendtoWaitWindow() sends a list of messages to one node with up to setWindow() of them outstanding:
+/// it sends a window of messages back to back, with RH_FLAGS_WINDOW set, and RH_FLAGS_ACK_REQUEST 
+/// set on the last one only. The receiver's recvfromAck() delivers each new message as it arrives,
+/// and answers the flagged one with a selective ACK: the ID of the oldest message it is still missing,
+/// and a 4 octet bitmap of the later ones it has got. The sender then sends the missing messages again 
+/// along with the next new ones, so on a good link the channel carries a whole window of messages
+/// for each ACK. If no ACK comes, it asks again by sending the oldest missing message on its own. 
+/// When retries() attempts in a row get nothing new acknowledged, it gives up the oldest missing message, 
+/// as sendtoWait() would, and carries on with the rest of the list.
+///
+/// Each message sent this way carries one more octet, the ID of the oldest message the sender 
+/// has not had acknowledged, so the receiver knows where the window starts even if it missed the first messages. 
+/// So messages can be at most one octet shorter than with sendtoWait().
+/// Messages lost and sent again are delivered later than the ones after them: the IDs show their order.
+/// A receiver keeps track of the windows of up to RH_RELIABLE_DATAGRAM_WINDOW_PEERS senders at once, 
+/// forgetting any it has not heard from for RH_RELIABLE_DATAGRAM_WINDOW_IDLE ms.
+/// Both ends must be built with windowed sending, which is left out if RH_RELIABLE_DATAGRAM_WINDOW_PEERS is 0.
+///
+/// \par Warm Start
+///
+/// When a node reboots, it forgets the ids it has seen from each node, and starts its own sequence numbers 
+/// again from 0, so the first messages it sends may be taken as duplicates by nodes that remember its old ones.
+/// snapshot() writes this state (and the routing table of RHRouter and RHMesh) into a compact binary image,
+/// which the application can keep in flash, EEPROM or NVS, and restore() puts it back after a reboot, 
+/// moving the sequence numbers on by RH_SNAPSHOT_SEQUENCE_SKIP. The image has a CRC, so a torn write 
+/// is refused by restore(). snapshotIfDue() only returns an image when it has changed, and no more than once
+/// every RH_SNAPSHOT_INTERVAL ms, so it can be called every time round the loop without wearing the flash out:
+/// \code
+/// uint8_t image[RH_ROUTER_SNAPSHOT_MAX_LEN];
+/// uint16_t len = manager.snapshotIfDue(image, sizeof(image));
+/// if (len)
+///     preferences.putBytes("rh", image, len);
+/// \endcode
+///
 /// Caution: if you have a radio network with a mixture of slow and fast
 /// processors and ReliableDatagrams, you may be affected by race conditions
 /// where the fast processor acknowledges a message before the sender is ready
@@ -98,7 +198,7 @@ public:
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Sets the minimum retransmit timeout. If sendtoWait is waiting for an ack 
     /// longer than this time (in milliseconds), 
@@ -134,7 +234,27 @@ public:
     /// \param[in] buf Pointer to the binary message to send
     /// \param[in] len Number of octets to send
     /// \return true if the message was transmitted and an acknowledgement was received.
-    bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendtoWait(uint8_t* buf, uint8_t len, RHAddress address);
+
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+    /// Sets the number of messages sendtoWaitWindow() keeps outstanding
+    /// \param[in] window The number of messages, 1 to RH_RELIABLE_DATAGRAM_MAX_WINDOW. 
+    /// Defaults to RH_RELIABLE_DATAGRAM_WINDOW
+    void setWindow(uint8_t window);
+
+    /// Sends a list of messages to a node, several at a time, and waits until each has been 
+    /// acknowledged or given up (see "Windowed Sending" above). The messages get consecutive IDs.
+    /// If the address is the broadcast address, the messages are just sent one after another.
+    /// Only available if RH_RELIABLE_DATAGRAM_WINDOW_PEERS is not 0.
+    /// \param[in] bufs Pointers to the messages, in the order they are to be sent
+    /// \param[in] lens The length of each message, at most one less than for sendtoWait()
+    /// \param[in] count Number of messages
+    /// \param[in] address The address to send the messages to
+    /// \param[out] acknowledged If not NULL, count flags, each set to true if that message was acknowledged,
+    /// or false if it was given up. A message that was given up may still have been delivered
+    /// \return The number of messages acknowledged, count if they all were
+    uint8_t sendtoWaitWindow(uint8_t** bufs, uint8_t* lens, uint8_t count, RHAddress address, bool* acknowledged = NULL);
+#endif
 
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
@@ -148,8 +268,8 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
@@ -157,7 +277,7 @@ public:
     /// - 1. There was no message received and waiting to be collected, or
     /// - 2. There was a message received but it was not addressed to this node, or
     /// - 3. There was a correctly addressed message but it was a duplicate of an earlier correctly received message
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
@@ -166,13 +286,13 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Returns the number of retransmissions 
     /// we have had to send since starting or since the last call to resetRetransmissions().
@@ -183,16 +303,75 @@ public:
     /// to 0. 
     void resetRetransmissions(); 
 
+    /// Writes an image of the state this node needs to carry on after a reboot (see "Warm Start" above)
+    /// \param[in] buf Where to write the image
+    /// \param[in] len Size of buf
+    /// \return The length of the image, 0 if it did not fit
+    uint16_t snapshot(uint8_t* buf, uint16_t len);
+
+    /// Calls snapshot(), but only if at least interval ms have passed since the last image was taken,
+    /// and only returns the image if it is different from the last one. 
+    /// \param[in] buf Where to write the image
+    /// \param[in] len Size of buf
+    /// \param[in] interval Minimum time between images in milliseconds
+    /// \return The length of the image if it should be saved, else 0
+    uint16_t snapshotIfDue(uint8_t* buf, uint16_t len, unsigned long interval = RH_SNAPSHOT_INTERVAL);
+
+    /// Puts back the state from an image written by snapshot(), replacing the current state. 
+    /// Call it after init(), and before adding any static routes to a RHRouter
+    /// \param[in] buf The image
+    /// \param[in] len Length of the image, or more
+    /// \return true if the image was valid and has been restored
+    bool restore(const uint8_t* buf, uint16_t len);
+
 protected:
+    /// Writes the state for snapshot(), after the image header. Subclasses with more state
+    /// call this first, then add theirs
+    /// \param[in] buf Where to write the state
+    /// \param[in] len Room in buf
+    /// \return The number of octets written, 0 if they did not fit
+    virtual uint16_t snapshotState(uint8_t* buf, uint16_t len);
+
+    /// Reads back the state written by snapshotState(). Subclasses with more state
+    /// call this first, then read theirs
+    /// \param[in] buf The state
+    /// \param[in] len Length of the state
+    /// \return The number of octets read, 0 if they are not valid
+    virtual uint16_t restoreState(const uint8_t* buf, uint16_t len);
+
     /// Send an ACK for the message id to the given from address
     /// Blocks until the ACK has been sent
-    void acknowledge(uint8_t id, uint8_t from);
+    void acknowledge(uint8_t id, RHAddress from);
 
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
     bool haveNewMessage();
 
+    /// Sends one transmission of a message that should be acknowledged, without waiting for the ACK. 
+    /// sendtoWait() uses it for each try. Subclasses that do not want to block while waiting for the ACK
+    /// (see RHRouter::setAsyncForwarding()) can call it themselves, and watch for the ACK with ackReceived()
+    /// \param[in] buf The message
+    /// \param[in] len Length of the message
+    /// \param[in] address Address to send it to
+    /// \param[in] id The ID header, from nextSequenceNumber(). The same for every try
+    /// \param[in] retry true for a retransmission: sets RH_FLAGS_RETRY and counts it in retransmissions()
+    /// \param[in] flags Other flags to set, such as RH_FLAGS_WINDOW
+    void transmit(uint8_t* buf, uint8_t len, RHAddress address, uint8_t id, bool retry, uint8_t flags = RH_FLAGS_NONE);
+
+    /// \return The sequence number for a new message
+    uint8_t nextSequenceNumber();
+
+    /// \return How long to wait for an ACK before trying again: random between the timeout and twice it
+    /// (see setTimeout())
+    uint16_t ackTimeout();
+
+    /// Called with each ACK addressed to this node, other than the one sendtoWait() is waiting for.
+    /// Subclasses may override. The default does nothing
+    /// \param[in] from The node that sent the ACK
+    /// \param[in] id The ID of the message it acknowledges
+    virtual void ackReceived(RHAddress from, uint8_t id);
+
 private:
     /// Count of retransmissions we have had to send
     uint32_t _retransmissions;
@@ -213,7 +392,71 @@ private:
     /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
     /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
     /// received that message)
+#if RH_ADDRESS_16
+    /// With 16 bit addresses, up to RH_RELIABLE_DATAGRAM_SEEN_IDS nodes are kept in a hashed table instead
+    RHAddressValue _seenIds[RH_RELIABLE_DATAGRAM_SEEN_IDS];
+#else
     uint8_t _seenIds[256];
+#endif
+
+    /// \return The last ID seen from a node, 0 if none
+    uint8_t seenId(RHAddress from);
+
+    /// Remembers the last ID seen from a node
+    void setSeenId(RHAddress from, uint8_t id);
+
+#if RH_RELIABLE_DATAGRAM_WINDOW_PEERS
+    /// What a receiver knows of the window of messages from a sender
+    typedef struct
+    {
+	RHAddress     from;     ///< The sender, RH_DATAGRAM_BROADCAST_ADDRESS if the entry is not used
+	uint8_t       base;     ///< ID of the oldest message not received yet
+	uint32_t      received; ///< Bit n is set if the message with ID base + n has been received
+	unsigned long heard;    ///< millis() when the sender was last heard
+    } WindowPeer;
+
+    /// Sends one message of a window, with the ID of the oldest unacknowledged message in front
+    /// \param[in] buf The message
+    /// \param[in] len Length of the message
+    /// \param[in] address Address to send it to
+    /// \param[in] id The ID header
+    /// \param[in] base ID of the oldest message not acknowledged yet
+    /// \param[in] retry true for a retransmission
+    /// \param[in] ackRequest true to ask the receiver for an ACK
+    void transmitWindow(uint8_t* buf, uint8_t len, RHAddress address, uint8_t id, uint8_t base, bool retry, bool ackRequest);
+
+    /// Finds the window of a sender, or starts a new one in place of the one heard from longest ago,
+    /// and moves it on past the messages the sender has had acknowledged
+    /// \param[in] from The sender
+    /// \param[in] base The ID of the oldest message the sender has not had acknowledged
+    /// \return The window
+    WindowPeer* windowPeer(RHAddress from, uint8_t base);
+
+    /// Records the receipt of a message sent by sendtoWaitWindow()
+    /// \param[in] peer The window of the sender
+    /// \param[in] id The ID of the message
+    /// \return true if the message has not been received before
+    bool windowReceived(WindowPeer* peer, uint8_t id);
+
+    /// Sends a selective ACK of the messages received in a window. Blocks until it has been sent
+    /// \param[in] peer The window
+    void acknowledgeWindow(WindowPeer* peer);
+
+    /// Number of messages sendtoWaitWindow() keeps outstanding
+    uint8_t _window;
+
+    /// The windows of the senders heard most recently
+    WindowPeer _windowPeers[RH_RELIABLE_DATAGRAM_WINDOW_PEERS];
+#endif
+
+    /// millis() when the last image was taken by snapshot()
+    unsigned long _lastSnapshot;
+
+    /// CRC of the last image taken by snapshot()
+    uint16_t _snapshotCrc;
+
+    /// True if snapshot() has taken an image
+    bool _snapshotTaken;
 };
 
 /// @example rf22_reliable_datagram_client.ino
@@ -12,16 +12,44 @@
 // $Id: RHRouter.cpp,v 1.10 2020/08/04 09:02:14 mikem Exp $
 
 #include <RHRouter.h>
-
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+ #include <RHSimTopology.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress) 
+RHRouter::RHRouter(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHReliableDatagram(driver, thisAddress)
 {
     _max_hops = RH_DEFAULT_MAX_HOPS;
     _isa_router = true;
+    _routeTimeout = 0;
+    _lastExpiry = 0;
+    _passiveLearning = false;
+#if RH_ROUTER_FORWARD_QUEUE
+    _asyncForwarding = false;
+    _forwarding = false;
+    _forwardHead = 0;
+    _forwardCount = 0;
+    _forwardInFlight = false;
+#endif
+#ifdef RH_ROUTER_NEIGHBOUR_FILTER
+    _neighboursFor = 0x10000;
+    _neighbourFilter = false;
+#endif
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    _chainForwarding = false;
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_CHAIN_NEIGHBOURS; i++)
+	_chainNeighbours[i].address = RH_DATAGRAM_BROADCAST_ADDRESS;
+#endif
+#if RH_ROUTER_LINK_METRICS
+ #if RH_ADDRESS_16
+    RHclearAddressValues(_linkEtx, RH_ROUTER_LINK_METRICS_NEIGHBOURS);
+ #else
+    memset(_linkEtx, 0, sizeof(_linkEtx));
+ #endif
+#endif
     clearRoutingTable();
 }
 
@@ -47,56 +75,160 @@ void RHRouter::setIsaRouter(bool isa_router)
     _isa_router = isa_router;
 }
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+void RHRouter::addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state, uint16_t metric)
 {
+#if RH_ROUTING_TABLE_DIRECT
+    int i = routeSlot(dest);
+    if (i < 0)
+    {
+	// Only with 16 bit addresses, where the table can fill up
+	retireOldestRoute();
+	i = routeSlot(dest);
+	if (i < 0)
+	    return; // Full of static routes
+    }
+    if (_routes[i].state == Static && state != Static)
+	return; // Provisioned routes win over learned ones
+    _routes[i].dest = dest;
+    setRoute(&_routes[i], next_hop, state, metric);
+#else
     uint8_t i;
+    int     freeSlot = -1;
 
-    // First look for an existing entry we can update
+    // Look for an existing entry we can update, and remember the first invalid entry we could use
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
     {
 	if (_routes[i].dest == dest)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	    if (_routes[i].state == Static && state != Static)
+		return; // Provisioned routes win over learned ones
+	    setRoute(&_routes[i], next_hop, state, metric);
 	    return;
 	}
+	if (freeSlot < 0 && _routes[i].state == Invalid)
+	    freeSlot = i;
     }
 
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    if (freeSlot < 0)
     {
-	if (_routes[i].state == Invalid)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	// Need to make room for a new one. The last slot is invalid after this, 
+	// unless the table is full of static routes
+	retireOldestRoute();
+	freeSlot = RH_ROUTING_TABLE_SIZE - 1;
+	if (_routes[freeSlot].state != Invalid)
 	    return;
-	}
     }
+    _routes[freeSlot].dest = dest;
+    setRoute(&_routes[freeSlot], next_hop, state, metric);
+#endif
+}
 
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+void RHRouter::setRoute(RoutingTableEntry* route, RHAddress next_hop, uint8_t state, uint16_t metric)
+{
+    if (route->state == StaticFailed && state != Static)
     {
-	if (_routes[i].state == Invalid)
+	// Stands in for the static route that failed, which is kept in alt_hop to go back to
+	if (next_hop == route->alt_hop)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	    // It works again after all
+	    route->state = Static;
+	    route->alt_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
 	}
+	route->next_hop = next_hop;
+	route->metric = metric;
+	route->lastUsed = millis();
+	return;
+    }
+    if (route->state == Invalid)
+	route->alt_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
+    else if (route->next_hop != next_hop)
+    {
+	// Keep the old next hop to fall back to
+	route->alt_hop = route->next_hop;
+	route->alt_metric = route->metric;
+    }
+    if (route->alt_hop == next_hop)
+	route->alt_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
+    route->next_hop = next_hop;
+    route->state = state;
+    route->metric = metric;
+    route->lastUsed = millis();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::addAlternateRouteTo(RHAddress dest, RHAddress next_hop, uint16_t metric)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (   route 
+	&& route->state != StaticFailed
+	&& next_hop != route->next_hop 
+	&& next_hop != RH_DATAGRAM_BROADCAST_ADDRESS
+	&& (route->alt_hop == RH_DATAGRAM_BROADCAST_ADDRESS || route->alt_hop == next_hop || metric < route->alt_metric))
+    {
+	route->alt_hop = next_hop;
+	route->alt_metric = metric;
     }
 }
 
 ////////////////////////////////////////////////////////////////////
-RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
+bool RHRouter::failoverRouteTo(RHAddress dest)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (   !route 
+	|| route->state == Static 
+	|| route->alt_hop == RH_DATAGRAM_BROADCAST_ADDRESS 
+	|| route->alt_hop == route->next_hop)
+	return false;
+    route->next_hop = route->alt_hop;
+    route->metric = route->alt_metric;
+    route->alt_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
+    if (route->state == StaticFailed)
+	route->state = Static; // The route found in its place failed too
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::addStaticRoutes(const RHAddress* routes, uint8_t count)
 {
+    uint8_t added = 0;
+    uint8_t i;
+    for (i = 0; i < count; i++)
+    {
+	RHAddress dest = routes[i * 2];
+	addRouteTo(dest, routes[i * 2 + 1], Static);
+	RoutingTableEntry* route = getRouteTo(dest);
+	if (route && route->state == Static)
+	    added++;
+    }
+    return added;
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::getRouteTo(RHAddress dest)
+{
+#if RH_ROUTING_TABLE_DIRECT
+    int i = routeSlot(dest);
+    if (i < 0 || _routes[i].state == Invalid)
+	return NULL;
+#else
     uint8_t i;
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
 	if (_routes[i].dest == dest && _routes[i].state != Invalid)
-	    return &_routes[i];
-    return NULL;
+	    break;
+    if (i >= RH_ROUTING_TABLE_SIZE)
+	return NULL;
+#endif
+    unsigned long now = millis();
+    if (_routeTimeout && _routes[i].state != Static && _routes[i].state != StaticFailed 
+	&& now - _routes[i].lastUsed > _routeTimeout)
+    {
+	// Gone stale since the last expiry check
+	deleteRoute(i);
+	return NULL;
+    }
+    _routes[i].lastUsed = now;
+    return &_routes[i];
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -106,7 +238,7 @@ bool RHRouter::getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *last
 {
   bool retval = false; // default
   bool stop = false;
-  uint8_t startIndex;
+  int startIndex;
   
   if (*lastIndex_p < 0)
       startIndex = 0;
@@ -115,14 +247,14 @@ bool RHRouter::getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *last
   
   if (startIndex >= RH_ROUTING_TABLE_SIZE)
   {
-    return true; // finished, safety.
+    return false; // finished, safety.
   }
   else
   {
-    uint8_t i = startIndex;
+    int i = startIndex;
     do
     {
-      if (_routes[i].state == Valid)
+      if (_routes[i].state == Valid || _routes[i].state == Static || _routes[i].state == StaticFailed)
       {
         *RTE_p = _routes[i];
         *lastIndex_p = i;
@@ -143,33 +275,66 @@ bool RHRouter::getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *last
 ////////////////////////////////////////////////////////////////////
 void RHRouter::deleteRoute(uint8_t index)
 {
+#if RH_ROUTING_TABLE_DIRECT && RH_ADDRESS_16
+    // Move up any later routes that would no longer be found past the empty slot
+    _routes[index].state = Invalid;
+    uint16_t hole = index;
+    uint16_t i = index;
+    while (_routes[i = (i + 1) % RH_ROUTING_TABLE_SIZE].state != Invalid)
+    {
+	uint16_t home = RHhashAddress(_routes[i].dest) % RH_ROUTING_TABLE_SIZE;
+	if (   (i + RH_ROUTING_TABLE_SIZE - home) % RH_ROUTING_TABLE_SIZE 
+	    >= (i + RH_ROUTING_TABLE_SIZE - hole) % RH_ROUTING_TABLE_SIZE)
+	{
+	    _routes[hole] = _routes[i];
+	    _routes[i].state = Invalid;
+	    hole = i;
+	}
+    }
+#elif RH_ROUTING_TABLE_DIRECT
+    _routes[index].state = Invalid;
+#else
     // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
+    memmove(&_routes[index], &_routes[index+1], 
 	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
     _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::printRoutingTable()
 {
 #ifdef RH_HAVE_SERIAL
-    uint8_t i;
+    unsigned int i;
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
     {
+#if RH_ROUTING_TABLE_DIRECT
+	if (_routes[i].state == Invalid)
+	    continue; // Only the known routes out of the 256
+#endif
 	Serial.print(i, DEC);
 	Serial.print(" Dest: ");
-	Serial.print(_routes[i].dest, DEC);
+	Serial.print((unsigned int)_routes[i].dest, DEC);
 	Serial.print(" Next Hop: ");
-	Serial.print(_routes[i].next_hop, DEC);
+	Serial.print((unsigned int)_routes[i].next_hop, DEC);
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	Serial.print(" Alt Hop: ");
+	Serial.println((unsigned int)_routes[i].alt_hop, DEC);
     }
 #endif
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::deleteRouteTo(uint8_t dest)
+bool RHRouter::deleteRouteTo(RHAddress dest)
 {
+#if RH_ROUTING_TABLE_DIRECT
+    int i = routeSlot(dest);
+    if (i < 0 || _routes[i].state == Invalid)
+	return false;
+    deleteRoute(i);
+    return true;
+#else
     uint8_t i;
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
     {
@@ -180,66 +345,306 @@ bool RHRouter::deleteRouteTo(uint8_t dest)
 	}
     }
     return false;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::retireOldestRoute()
 {
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
+    // Find the least recently used route
+    unsigned long now = millis();
+    unsigned long oldestAge = 0;
+    int oldest = -1;
+    unsigned int i;
+    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
+	if (_routes[i].state == Invalid || _routes[i].state == Static || _routes[i].state == StaticFailed)
+	    continue;
+	if (oldest < 0 || now - _routes[i].lastUsed > oldestAge)
+	{
+	    oldest = i;
+	    oldestAge = now - _routes[i].lastUsed;
+	}
+    }
+    if (oldest >= 0)
+	deleteRoute(oldest);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setRouteTimeout(unsigned long timeout)
+{
+    _routeTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::expireRoutes()
+{
+    if (!_routeTimeout)
+	return;
+    unsigned long now = millis();
+    _lastExpiry = now;
+    unsigned int i = 0;
+    while (i < RH_ROUTING_TABLE_SIZE)
+    {
+	if (   _routes[i].state != Invalid && _routes[i].state != Static && _routes[i].state != StaticFailed
+	    && now - _routes[i].lastUsed > _routeTimeout)
+	{
+	    deleteRoute(i);
+#if !RH_ROUTING_TABLE_DIRECT || RH_ADDRESS_16
+	    continue; // The following routes may have moved down into this slot
+#endif
+	}
+	i++;
+    }
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
-    uint8_t i;
+    unsigned int i;
     for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
 	_routes[i].state = Invalid;
+#if RH_ROUTING_TABLE_DIRECT && !RH_ADDRESS_16
+	_routes[i].dest = i;
+#endif
+    }
 }
 
+#if RH_ROUTING_TABLE_DIRECT
+////////////////////////////////////////////////////////////////////
+int RHRouter::routeSlot(RHAddress dest)
+{
+#if RH_ADDRESS_16
+    // Open addressing: the route is in the first slot from the one dest hashes to that has it, 
+    // or it belongs in the first empty one. deleteRoute() keeps it that way
+    uint16_t home = RHhashAddress(dest) % RH_ROUTING_TABLE_SIZE;
+    uint16_t i = home;
+    do
+    {
+	if (_routes[i].state == Invalid || _routes[i].dest == dest)
+	    return i;
+	i = (i + 1) % RH_ROUTING_TABLE_SIZE;
+    } while (i != home);
+    return -1;
+#else
+    return dest;
+#endif
+}
+#endif
+
 
-uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
+uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
 {
     return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags);
 }
 
 ////////////////////////////////////////////////////////////////////
 // Waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
+uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags)
 {
-    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+    return sendtoFromSourceIdWait(buf, len, dest, source, _lastE2ESequenceNumber++, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoFromSourceIdWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t id, uint8_t flags)
+{
+    if (((uint16_t)len + sizeof(RoutedMessageHeader) + RH_DATAGRAM_HEADER_LEN) > _driver.maxMessageLength())
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
+    // The payload may already be in place (see payloadBuffer())
+    if (buf != _tmpMessage.data)
+	memmove(_tmpMessage.data, buf, len);
+    return sendMessageWait(&_tmpMessage, len, dest, source, id, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendMessageWait(RoutedMessage* message, uint8_t len, RHAddress dest, RHAddress source, uint8_t id, uint8_t flags)
+{
     // Construct a RH RouterMessage message
-    _tmpMessage.header.source = source;
-    _tmpMessage.header.dest = dest;
-    _tmpMessage.header.hops = 0;
-    _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
-    memcpy(_tmpMessage.data, buf, len);
+    RHputAddress(message->header.source, source);
+    RHputAddress(message->header.dest, dest);
+    message->header.hops = 0;
+    message->header.id = id;
+    message->header.flags = flags;
 
-    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    return route(message, sizeof(RoutedMessageHeader)+len);
 }
 
 ////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
 {
     // Reliably deliver it if possible. See if we have a route:
-    uint8_t next_hop = RH_BROADCAST_ADDRESS;
-    if (message->header.dest != RH_BROADCAST_ADDRESS)
+    RHAddress dest = RHgetAddress(message->header.dest);
+    RHAddress next_hop = RH_DATAGRAM_BROADCAST_ADDRESS;
+    if (dest != RH_DATAGRAM_BROADCAST_ADDRESS)
     {
-	RoutingTableEntry* route = getRouteTo(message->header.dest);
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+	if (_chainForwarding)
+	    return routeChain(message, messageLen);
+#endif
+	RoutingTableEntry* route = getRouteTo(dest);
+	if (   route 
+	    && route->next_hop == headerFrom() 
+	    && RHgetAddress(message->header.source) != _thisAddress)
+	{
+	    // Sending it back where it came from would only make a loop: the route is out of date
+	    if (!failoverRouteTo(dest))
+	    {
+		if (route->state == Valid)
+		    deleteRouteTo(dest);
+		return RH_ROUTER_ERROR_NO_ROUTE;
+	    }
+	}
 	if (!route)
 	    return RH_ROUTER_ERROR_NO_ROUTE;
 	next_hop = route->next_hop;
     }
+    return routeVia(message, messageLen, next_hop);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeVia(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop)
+{
+#if RH_ROUTER_FORWARD_QUEUE
+    // Forward it without blocking if there is room
+    if (_forwarding && next_hop != RH_DATAGRAM_BROADCAST_ADDRESS && queueForward(message, messageLen, next_hop))
+	return RH_ROUTER_ERROR_QUEUED;
+#endif
 
+#if RH_ROUTER_LINK_METRICS
+    uint32_t retransmissions = RHReliableDatagram::retransmissions();
+    bool acknowledged = RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop);
+    if (next_hop != RH_DATAGRAM_BROADCAST_ADDRESS)
+	updateLinkEtx(next_hop, RHReliableDatagram::retransmissions() - retransmissions + 1, acknowledged);
+    if (!acknowledged)
+	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+#else
     if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
 	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
+#endif
 
     return RH_ROUTER_ERROR_NONE;
 }
 
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+////////////////////////////////////////////////////////////////////
+void RHRouter::setChainForwarding(bool chain)
+{
+    _chainForwarding = chain;
+    _driver.setPromiscuous(chain || _passiveLearning);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeChain(RoutedMessage* message, uint8_t messageLen)
+{
+    RHAddress dest = RHgetAddress(message->header.dest);
+    RHAddress adjacent = dest > _thisAddress ? _thisAddress + 1 : _thisAddress - 1;
+    while (1)
+    {
+	RHAddress next_hop = chainNextHop(dest);
+	uint8_t ret = routeVia(message, messageLen, next_hop);
+	if (ret == RH_ROUTER_ERROR_NONE)
+	    chainHeard(next_hop); // Its ACK
+	if (ret != RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
+	    return ret;
+	chainForget(next_hop);
+	if (next_hop == adjacent)
+	    return ret; // Nowhere nearer to try
+	// Not as far as we thought: try a nearer one
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+RHAddress RHRouter::chainNextHop(RHAddress dest)
+{
+    bool up = dest > _thisAddress;
+    RHAddress next_hop = up ? _thisAddress + 1 : _thisAddress - 1;
+    unsigned long now = millis();
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_CHAIN_NEIGHBOURS; i++)
+    {
+	ChainNeighbour* n = &_chainNeighbours[i];
+	if (n->address == RH_DATAGRAM_BROADCAST_ADDRESS || now - n->heard >= RH_ROUTER_CHAIN_HEARD_TIME)
+	    continue;
+	// Further than the best so far, but not past the destination
+	if (up ? (n->address > next_hop && n->address <= dest) : (n->address < next_hop && n->address >= dest))
+	    next_hop = n->address;
+    }
+    return next_hop;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::chainHeard(RHAddress neighbour)
+{
+    // Refresh it, or replace the neighbour heard longest ago
+    unsigned long now = millis();
+    uint8_t i;
+    uint8_t oldest = 0;
+    for (i = 0; i < RH_ROUTER_CHAIN_NEIGHBOURS; i++)
+    {
+	ChainNeighbour* n = &_chainNeighbours[i];
+	if (n->address == neighbour)
+	{
+	    oldest = i;
+	    break;
+	}
+	if (   _chainNeighbours[oldest].address != RH_DATAGRAM_BROADCAST_ADDRESS
+	    && (n->address == RH_DATAGRAM_BROADCAST_ADDRESS || now - n->heard > now - _chainNeighbours[oldest].heard))
+	    oldest = i;
+    }
+    _chainNeighbours[oldest].address = neighbour;
+    _chainNeighbours[oldest].heard = now;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::chainForget(RHAddress neighbour)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_CHAIN_NEIGHBOURS; i++)
+	if (_chainNeighbours[i].address == neighbour)
+	    _chainNeighbours[i].address = RH_DATAGRAM_BROADCAST_ADDRESS;
+}
+#endif
+
+#if RH_ROUTER_LINK_METRICS
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::linkEtx(RHAddress neighbour)
+{
+#if RH_ADDRESS_16
+    RHAddressValue* v = RHfindAddressValue(_linkEtx, RH_ROUTER_LINK_METRICS_NEIGHBOURS, neighbour);
+    return v->address == neighbour ? v->value : 0;
+#else
+    return _linkEtx[neighbour];
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::updateLinkEtx(RHAddress neighbour, uint8_t transmissions, bool acknowledged)
+{
+    uint16_t sample = transmissions * RH_ROUTER_ETX_ONE;
+    if (!acknowledged)
+	sample *= 2; // Would have needed more than we made
+    if (sample > 255)
+	sample = 255;
+    // Moving average, with the latest sample weighted 1/4
+#if RH_ADDRESS_16
+    RHAddressValue* v = RHfindAddressValue(_linkEtx, RH_ROUTER_LINK_METRICS_NEIGHBOURS, neighbour);
+    if (v->address != neighbour)
+    {
+	v->address = neighbour; // Maybe in place of a neighbour we have not heard of for a while
+	v->value = 0;
+    }
+    uint8_t* etx = &v->value;
+#else
+    uint8_t* etx = &_linkEtx[neighbour];
+#endif
+    if (*etx)
+	sample = (*etx * 3 + sample) / 4;
+    *etx = sample;
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////
 // Subclasses may want to override this to peek at messages going past
 void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
@@ -250,81 +655,74 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+{  
+    uint8_t* msg;
+    uint8_t msgLen;
+    if (!recvfromAckInPlace(&msg, &msgLen, source, dest, id, flags, hops))
+	return false;
+    if (*len > msgLen)
+	*len = msgLen;
+    memcpy(buf, msg, *len);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvfromAckInPlace(uint8_t** buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {  
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
+    // Expire idle routes now and then
+    if (_routeTimeout && millis() - _lastExpiry >= RH_ROUTER_EXPIRY_INTERVAL)
+	expireRoutes();
+#if RH_ROUTER_FORWARD_QUEUE
+    serviceForwards();
+#endif
     if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
     {
+#ifdef RH_ROUTER_NEIGHBOUR_FILTER
 	// Here we simulate networks with limited visibility between nodes
 	// so we can test routing
-#ifdef RH_TEST_NETWORK
-	if (
-#if RH_TEST_NETWORK==1
-	    // This network looks like 1-2-3-4
-	       (_thisAddress == 1 && _from == 2)
-	    || (_thisAddress == 2 && (_from == 1 || _from == 3))
-	    || (_thisAddress == 3 && (_from == 2 || _from == 4))
-	    || (_thisAddress == 4 && _from == 3)
-	    
-#elif RH_TEST_NETWORK==2
-	       // This network looks like 1-2-4
-	       //                         | | |
-	       //                         --3--
-	       (_thisAddress == 1 && (_from == 2 || _from == 3))
-	    ||  _thisAddress == 2
-	    ||  _thisAddress == 3
-	    || (_thisAddress == 4 && (_from == 2 || _from == 3))
-
-#elif RH_TEST_NETWORK==3
-	       // This network looks like 1-2-4
-	       //                         |   |
-	       //                         --3--
-	       (_thisAddress == 1 && (_from == 2 || _from == 3))
-	    || (_thisAddress == 2 && (_from == 1 || _from == 4))
-	    || (_thisAddress == 3 && (_from == 1 || _from == 4))
-	    || (_thisAddress == 4 && (_from == 2 || _from == 3))
-
-#elif RH_TEST_NETWORK==4
-	       // This network looks like 1-2-3
-	       //                           |
-	       //                           4
-	       (_thisAddress == 1 && _from == 2)
-	    ||  _thisAddress == 2
-	    || (_thisAddress == 3 && _from == 2)
-	    || (_thisAddress == 4 && _from == 2)
-
-#endif
-	    )
+	if (!isNeighbour(_from))
+	    return false; // Pretend we got nothing
+#endif
+
+	bool overheard = _to != _thisAddress && _to != RH_DATAGRAM_BROADCAST_ADDRESS;
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+	if (_chainForwarding)
 	{
-	    // OK
+	    // Anything heard from a neighbour, even on its way to another node, shows it is in range
+	    chainHeard(_from);
+	    if (overheard && !_passiveLearning)
+		return false;
 	}
-	else
+#endif
+	if (_passiveLearning && overheard)
 	{
-	    return false; // Pretend we got nothing
+	    // Overheard in promiscuous mode on its way between 2 other nodes
+	    overheardMessage(&_tmpMessage, tmpMessageLen);
+	    return false;
 	}
-#endif
 
 	peekAtMessage(&_tmpMessage, tmpMessageLen);
 	// See if its for us or has to be routed
-	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
+	RHAddress _dest = RHgetAddress(_tmpMessage.header.dest);
+	if (_dest == _thisAddress || _dest == RH_DATAGRAM_BROADCAST_ADDRESS)
 	{
 	    // Deliver it here
-	    if (source) *source  = _tmpMessage.header.source;
-	    if (dest)   *dest    = _tmpMessage.header.dest;
+	    if (source) *source  = RHgetAddress(_tmpMessage.header.source);
+	    if (dest)   *dest    = _dest;
 	    if (id)     *id      = _tmpMessage.header.id;
 	    if (flags)  *flags   = _tmpMessage.header.flags;
 	    if (hops)   *hops    = _tmpMessage.header.hops;
-	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
-	    if (*len > msgLen)
-		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
+	    *buf = _tmpMessage.data;
+	    *len = tmpMessageLen - sizeof(RoutedMessageHeader);
 	    return true; // Its for you!
 	}
-	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
+	else if (   _dest != RH_DATAGRAM_BROADCAST_ADDRESS
 		 && _tmpMessage.header.hops++ < _max_hops)
 	{
 	    // Maybe it has to be routed to the next hop
@@ -333,7 +731,15 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 	    
 	    // If we are forwarding packets, do so. Otherwise, drop.
 	    if (_isa_router)
+	    {
+#if RH_ROUTER_FORWARD_QUEUE
+		_forwarding = _asyncForwarding;
+		route(&_tmpMessage, tmpMessageLen);
+		_forwarding = false;
+#else
 	        route(&_tmpMessage, tmpMessageLen);
+#endif
+	    }
 	}
 	// Discard it and maybe wait for another
     }
@@ -341,12 +747,129 @@ bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t*
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
+void RHRouter::setPassiveRouteLearning(bool passive)
+{
+    _passiveLearning = passive;
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    _driver.setPromiscuous(passive || _chainForwarding);
+#else
+    _driver.setPromiscuous(passive);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::learnOverheardRoute(RHAddress dest, RHAddress next_hop, uint16_t hops)
+{
+    if (dest == _thisAddress || dest == RH_DATAGRAM_BROADCAST_ADDRESS)
+	return;
+    RoutingTableEntry* route = getRouteTo(dest); // Refreshes it if there is one
+    if (!route)
+	addRouteTo(dest, next_hop, Valid, hops);
+    else if (route->next_hop != next_hop && hops <= route->metric)
+	addAlternateRouteTo(dest, next_hop, hops); // Never replaces a route found some other way
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override
+void RHRouter::overheardMessage(RoutedMessage* message, uint8_t messageLen)
+{
+    if (messageLen < sizeof(RoutedMessageHeader))
+	return;
+    // The sender is a neighbour, and the message reached it from the source in hops hops.
+    // Nothing is learned about the destination: the way on from the sender could be through us
+    RHAddress from = headerFrom();
+    learnOverheardRoute(from, from, 1);
+    learnOverheardRoute(RHgetAddress(message->header.source), from, message->header.hops + 1);
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::snapshotState(uint8_t* buf, uint16_t len)
+{
+    uint16_t used = RHReliableDatagram::snapshotState(buf, len);
+    if (!used)
+	return 0;
+    uint16_t count = 0;
+    uint16_t i;
+    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+	if (_routes[i].state != Invalid)
+	    count++;
+    if (used > len || (size_t)(len - used) < 3 + count * RH_ROUTER_SNAPSHOT_ROUTE_LEN)
+	return 0;
+    uint8_t* p = buf + used;
+    *p++ = _lastE2ESequenceNumber;
+    *p++ = count >> 8;
+    *p++ = count & 0xff;
+    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    {
+	RoutingTableEntry* route = &_routes[i];
+	if (route->state == Invalid)
+	    continue;
+	RHputAddress(*(RHAddressField*)p, route->dest);
+	p += RH_ADDRESS_LEN;
+	RHputAddress(*(RHAddressField*)p, route->next_hop);
+	p += RH_ADDRESS_LEN;
+	*p++ = route->state;
+	*p++ = route->metric >> 8;
+	*p++ = route->metric & 0xff;
+	RHputAddress(*(RHAddressField*)p, route->alt_hop);
+	p += RH_ADDRESS_LEN;
+	*p++ = route->alt_metric >> 8;
+	*p++ = route->alt_metric & 0xff;
+    }
+    return p - buf;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::restoreState(const uint8_t* buf, uint16_t len)
+{
+    uint16_t used = RHReliableDatagram::restoreState(buf, len);
+    if (!used || used > len || len - used < 3)
+	return 0;
+    const uint8_t* p = buf + used;
+    uint16_t count = (p[1] << 8) | p[2];
+    if ((size_t)(len - used) < 3 + count * RH_ROUTER_SNAPSHOT_ROUTE_LEN)
+	return 0;
+    _lastE2ESequenceNumber = p[0] + RH_SNAPSHOT_SEQUENCE_SKIP;
+    p += 3;
+    clearRoutingTable();
+    while (count--)
+    {
+	// Laid out as written by snapshotState()
+	const RHAddressField* addresses = (const RHAddressField*)p;
+	RHAddress dest = RHgetAddress(addresses[0]);
+	RHAddress next_hop = RHgetAddress(addresses[1]);
+	const uint8_t* q = p + 2 * RH_ADDRESS_LEN;
+	RHAddress alt_hop = RHgetAddress(*(const RHAddressField*)(q + 3));
+	if (q[0] == StaticFailed)
+	    addRouteTo(dest, alt_hop, Static, (q[3 + RH_ADDRESS_LEN] << 8) | q[4 + RH_ADDRESS_LEN]); // Try it again
+	else if (q[0] == Valid || q[0] == Static)
+	{
+	    addRouteTo(dest, next_hop, q[0], (q[1] << 8) | q[2]);
+	    RoutingTableEntry* route = getRouteTo(dest);
+	    if (route && alt_hop != route->next_hop)
+	    {
+		route->alt_hop = alt_hop;
+		route->alt_metric = (q[3 + RH_ADDRESS_LEN] << 8) | q[4 + RH_ADDRESS_LEN];
+	    }
+	}
+	p += RH_ROUTER_SNAPSHOT_ROUTE_LEN;
+    }
+    return p - buf;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags, uint8_t* hops)
 {  
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
+#if RH_ROUTER_FORWARD_QUEUE
+	// Wake up in time to retransmit or send the next message being forwarded
+	int32_t due = serviceForwards();
+	if (due >= 0 && due < timeLeft)
+	    timeLeft = due ? due : 1;
+#endif
 	if (waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, source, dest, id, flags, hops))
@@ -357,3 +880,184 @@ bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout,
     return false;
 }
 
+#if RH_ROUTER_FORWARD_QUEUE
+////////////////////////////////////////////////////////////////////
+void RHRouter::setAsyncForwarding(bool async)
+{
+    _asyncForwarding = async;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::forwardsQueued()
+{
+    return _forwardCount;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::queueForward(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop)
+{
+    if (_forwardCount >= RH_ROUTER_FORWARD_QUEUE)
+	return false;
+    QueuedForward* f = &_forwards[(_forwardHead + _forwardCount) % RH_ROUTER_FORWARD_QUEUE];
+    f->len = messageLen;
+    f->from = headerFrom();
+    f->next_hop = next_hop;
+    memcpy(&f->message, message, messageLen);
+    _forwardCount++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::finishForward(bool acknowledged)
+{
+    QueuedForward* f = &_forwards[_forwardHead];
+    _forwardHead = (_forwardHead + 1) % RH_ROUTER_FORWARD_QUEUE;
+    _forwardCount--;
+    _forwardInFlight = false;
+#if RH_ROUTER_LINK_METRICS
+    updateLinkEtx(f->next_hop, _forwardTries, acknowledged);
+#endif
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    if (_chainForwarding)
+    {
+	if (acknowledged)
+	    chainHeard(f->next_hop);
+	else
+	    chainForget(f->next_hop);
+    }
+#endif
+    // The slot is not reused until something else is queued, which cannot happen during the call
+    if (!acknowledged)
+	forwardFailed(&f->message, f->len, f->from);
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+int32_t RHRouter::serviceForwards()
+{
+#if RH_ROUTER_FORWARD_QUEUE
+    while (_forwardCount)
+    {
+	QueuedForward* f = &_forwards[_forwardHead];
+	if (!_forwardInFlight)
+	{
+	    // Start on the oldest message
+	    _forwardId = nextSequenceNumber();
+	    _forwardTries = 0;
+	    _forwardInFlight = true;
+	}
+	else
+	{
+	    int32_t timeLeft = _forwardTimeout - (millis() - _forwardSent);
+	    if (timeLeft > 0)
+		return timeLeft;
+	    if (_forwardTries > retries())
+	    {
+		// Retries exhausted, try the next one
+		finishForward(false);
+		continue;
+	    }
+	}
+	transmit((uint8_t*)&f->message, f->len, f->next_hop, _forwardId, _forwardTries > 0);
+	_forwardTries++;
+	_forwardSent = millis(); // Timeout does not include the transmit time
+	_forwardTimeout = ackTimeout();
+	return _forwardTimeout;
+    }
+#endif
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::ackReceived(RHAddress from, uint8_t id)
+{
+#if RH_ROUTER_FORWARD_QUEUE
+    if (_forwardInFlight && from == _forwards[_forwardHead].next_hop && id == _forwardId)
+	finishForward(true);
+#else
+    (void)from; // Not used
+    (void)id; // Not used
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+// Subclasses may want to override
+void RHRouter::forwardFailed(RoutedMessage* message, uint8_t messageLen, RHAddress from)
+{
+    (void)message; // Not used
+    (void)messageLen; // Not used
+    (void)from; // Not used
+}
+
+#ifdef RH_ROUTER_NEIGHBOUR_FILTER
+#ifdef RH_TEST_NETWORK
+// The nodes each node 1 to 4 can hear in each test network, one bitmap octet per node.
+// Bit n is set if node n can be heard, 0xff if all nodes can be heard
+static const uint8_t testNetworks[4][4] =
+{
+    // This network looks like 1-2-3-4
+    { 0x04, 0x0a, 0x14, 0x08 },
+    // This network looks like 1-2-4
+    //                         | | |
+    //                         --3--
+    { 0x0c, 0xff, 0xff, 0x0c },
+    // This network looks like 1-2-4
+    //                         |   |
+    //                         --3--
+    { 0x0c, 0x12, 0x12, 0x0c },
+    // This network looks like 1-2-3
+    //                           |
+    //                           4
+    { 0x04, 0xff, 0x04, 0x04 },
+};
+#endif
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::loadNeighbours()
+{
+    _neighboursFor = _thisAddress;
+    _neighbourFilter = false;
+#ifdef RH_TEST_NETWORK
+    if (_thisAddress >= 1 && _thisAddress <= 4)
+    {
+	uint8_t heard = testNetworks[RH_TEST_NETWORK - 1][_thisAddress - 1];
+	memset(_neighbours, 0, sizeof(_neighbours));
+	_neighbours[0] = heard;
+	_neighbourFilter = (heard != 0xff);
+    }
+    else
+    {
+	// Nodes outside the test network hear nothing
+	memset(_neighbours, 0, sizeof(_neighbours));
+	_neighbourFilter = true;
+    }
+#elif (RH_PLATFORM == RH_PLATFORM_UNIX)
+    const RHSimTopology* topology = RHSimTopology::fromEnvironment();
+    if (topology && topology->isRestricted())
+    {
+	memcpy(_neighbours, topology->neighbours(_thisAddress & 0xff), sizeof(_neighbours));
+	_neighbourFilter = true;
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setNeighbours(const uint8_t* bitmap)
+{
+    _neighboursFor = 0xffffffff;
+    _neighbourFilter = (bitmap != NULL);
+    if (bitmap)
+	memcpy(_neighbours, bitmap, sizeof(_neighbours));
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::isNeighbour(RHAddress address)
+{
+    // Reload if our address has changed since the bitmap was loaded
+    if (_neighboursFor != 0xffffffff && _neighboursFor != _thisAddress)
+	loadNeighbours();
+    address &= 0xff; // The bitmap only covers 8 bit addresses
+    return !_neighbourFilter || (_neighbours[address >> 3] & (1 << (address & 7)));
+}
+#endif
+
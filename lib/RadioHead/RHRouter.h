@@ -12,8 +12,99 @@
 // Default max number of hops we will route
 #define RH_DEFAULT_MAX_HOPS 30
 
-// The default size of the routing table we keep
-#define RH_ROUTING_TABLE_SIZE 10
+// RH_HAVE_PLENTY_OF_RAM is 1 on platforms with RAM to spare (ESP32 and Linux) and 0 elsewhere.
+// It only sets the defaults of the optional RHRouter and RHMesh features below that need
+// more RAM. Each feature has its own macro, which can be set to override it
+#ifndef RH_HAVE_PLENTY_OF_RAM
+ #if (RH_PLATFORM == RH_PLATFORM_ESP32) || (RH_PLATFORM == RH_PLATFORM_UNIX) || (RH_PLATFORM == RH_PLATFORM_RASPI)
+  #define RH_HAVE_PLENTY_OF_RAM 1
+ #else
+  #define RH_HAVE_PLENTY_OF_RAM 0
+ #endif
+#endif
+
+// Set RH_ROUTING_TABLE_DIRECT to 1 to keep a routing table with a slot for every node address, 
+// indexed directly by the destination address, so finding, adding and deleting routes take constant time
+// however many routes there are. Each RoutingTableEntry is about 16 octets on 32 bit platforms, so the table takes 
+// about 4 kilobytes per RHRouter, and by default it is only used if RH_HAVE_PLENTY_OF_RAM, and only if 
+// RH_ROUTING_TABLE_SIZE has not been set.
+// With 16 bit addresses (see RH_ADDRESS_16) it is a hashed table of the same size instead, with room for 256 routes.
+// Set it to 0 for the smaller table of RH_ROUTING_TABLE_SIZE entries, which is searched linearly
+#ifndef RH_ROUTING_TABLE_DIRECT
+ #if !defined(RH_ROUTING_TABLE_SIZE) && RH_HAVE_PLENTY_OF_RAM
+  #define RH_ROUTING_TABLE_DIRECT 1
+ #else
+  #define RH_ROUTING_TABLE_DIRECT 0
+ #endif
+#endif
+
+// The size of the routing table we keep. Can be changed at compile time
+#if RH_ROUTING_TABLE_DIRECT
+ #if defined(RH_ROUTING_TABLE_SIZE) && (RH_ROUTING_TABLE_SIZE != 256)
+  #error "RH_ROUTING_TABLE_SIZE must be 256 with RH_ROUTING_TABLE_DIRECT"
+ #endif
+ #undef RH_ROUTING_TABLE_SIZE
+ #define RH_ROUTING_TABLE_SIZE 256
+#elif !defined(RH_ROUTING_TABLE_SIZE)
+ #define RH_ROUTING_TABLE_SIZE 10
+#endif
+
+// How often in ms routes are checked for expiry, if setRouteTimeout() has been called
+#define RH_ROUTER_EXPIRY_INTERVAL 1000
+
+// Set RH_ROUTER_LINK_METRICS to 1 to estimate the expected transmission count (ETX) of the link to 
+// each neighbour (see linkEtx()), which RHMesh can use to choose between routes. There is one octet for every 
+// possible neighbour, 256 per RHRouter, so it defaults to RH_HAVE_PLENTY_OF_RAM. With 16 bit addresses, 
+// the links to up to RH_ROUTER_LINK_METRICS_NEIGHBOURS neighbours are kept in a hashed table instead
+#ifndef RH_ROUTER_LINK_METRICS
+ #define RH_ROUTER_LINK_METRICS RH_HAVE_PLENTY_OF_RAM
+#endif
+
+// Number of neighbours whose link ETX is kept, with 16 bit addresses
+#ifndef RH_ROUTER_LINK_METRICS_NEIGHBOURS
+ #define RH_ROUTER_LINK_METRICS_NEIGHBOURS 64
+#endif
+
+// Number of messages a relay can hold while it forwards them without blocking (see setAsyncForwarding()).
+// Every slot is a whole routed message of up to RH_ROUTER_MAX_MESSAGE_LEN octets. 
+// Defaults to 4 if RH_HAVE_PLENTY_OF_RAM, else 0, which leaves asynchronous forwarding out
+#ifndef RH_ROUTER_FORWARD_QUEUE
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_ROUTER_FORWARD_QUEUE 4
+ #else
+  #define RH_ROUTER_FORWARD_QUEUE 0
+ #endif
+#endif
+
+// Number of recently heard neighbours kept for chain forwarding (see setChainForwarding()).
+// Each is an address and the time it was heard. Small builds leave the code out: defaults to 8
+// if RH_HAVE_PLENTY_OF_RAM, else 0, which leaves chain forwarding out
+#ifndef RH_ROUTER_CHAIN_NEIGHBOURS
+ #if RH_HAVE_PLENTY_OF_RAM
+  #define RH_ROUTER_CHAIN_NEIGHBOURS 8
+ #else
+  #define RH_ROUTER_CHAIN_NEIGHBOURS 0
+ #endif
+#endif
+
+// How long in ms a neighbour that has not been heard from is still used for chain forwarding
+#ifndef RH_ROUTER_CHAIN_HEARD_TIME
+ #define RH_ROUTER_CHAIN_HEARD_TIME 60000
+#endif
+
+// Link ETX values are fixed point, with this value meaning one transmission per delivery
+#define RH_ROUTER_ETX_ONE 16
+
+// Metric of routes whose metric is not known
+#define RH_ROUTER_METRIC_UNKNOWN 0xffff
+
+// Length of each route in a snapshot image (see RHReliableDatagram::snapshot()): 
+// 3 addresses, state and 2 metrics
+#define RH_ROUTER_SNAPSHOT_ROUTE_LEN (3 * RH_ADDRESS_LEN + 5)
+
+// Longest snapshot image a RHRouter can write: header, sequence number and seen ids, 
+// end to end sequence number and routes
+#define RH_ROUTER_SNAPSHOT_MAX_LEN (RH_SNAPSHOT_HEADER_LEN + RH_SNAPSHOT_SEEN_IDS_MAX_LEN + 3 + RH_ROUTING_TABLE_SIZE * RH_ROUTER_SNAPSHOT_ROUTE_LEN)
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -22,10 +113,12 @@
 #define RH_ROUTER_ERROR_TIMEOUT           3
 #define RH_ROUTER_ERROR_NO_REPLY          4
 #define RH_ROUTER_ERROR_UNABLE_TO_DELIVER 5
+#define RH_ROUTER_ERROR_QUEUED            6
+#define RH_ROUTER_ERROR_QUEUE_FULL        7
 
 // This size of RH_ROUTER_MAX_MESSAGE_LEN is OK for Arduino Mega, but too big for
 // Duemilanove. Size of 50 works with the sample router programs on Duemilanove.
-#define RH_ROUTER_MAX_MESSAGE_LEN (RH_MAX_MESSAGE_LEN - sizeof(RHRouter::RoutedMessageHeader))
+#define RH_ROUTER_MAX_MESSAGE_LEN (RH_MAX_MESSAGE_LEN - RH_DATAGRAM_HEADER_LEN - sizeof(RHRouter::RoutedMessageHeader))
 //#define RH_ROUTER_MAX_MESSAGE_LEN 50
 
 // These allow us to define a simulated network topology for testing purposes
@@ -35,6 +128,12 @@
 //#define RH_TEST_NETWORK 3
 //#define RH_TEST_NETWORK 4
 
+// Simulated limited visibility between nodes is available with a test network
+// or in Linux simulator builds, where the topology can be given at run time
+#if defined(RH_TEST_NETWORK) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+ #define RH_ROUTER_NEIGHBOUR_FILTER
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHRouter RHRouter.h <RHRouter.h>
 /// \brief RHReliableDatagram subclass for sending addressed, optionally acknowledged datagrams
@@ -91,9 +190,88 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
-/// retireOldestRoute()
+/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10 by default)
+/// if more than RH_ROUTING_TABLE_SIZE are added, the least recently used one will be removed by calling 
+/// retireOldestRoute(). A route is used whenever it is looked up to send or forward a message, or updated.
+/// Routes that have not been used for a while can also be expired automatically with setRouteTimeout(),
+/// which keeps the table small without throwing away busy routes.
+///
+/// Each route can also have a secondary next hop (see addAlternateRouteTo()), which failoverRouteTo() 
+/// switches to when the next hop stops acknowledging, without having to find a new route. 
+/// When addRouteTo() changes the next hop of a route, the old next hop becomes the secondary one.
+///
+/// Routes can also be learned passively (see setPassiveRouteLearning()): in promiscuous mode a node
+/// overhears its neighbours passing messages on, and each one shows a route to the source and 
+/// the destination of the message through the neighbour that sent it. In a busy network this keeps
+/// the routes along the paths in use fresh, and lets nodes near them send without route discovery.
+///
+/// The routing table is kept in the images written by snapshot(), so a node that reboots can restore() 
+/// its routes and carry on forwarding straight away (see "Warm Start" in RHReliableDatagram). 
+/// Size the buffer for the image with RH_ROUTER_SNAPSHOT_MAX_LEN.
+///
+/// Routes added with addStaticRoutes() are static: they are never retired or expired, and 
+/// learned routes (such as those found by RHMesh route discovery) do not replace them. 
+/// They are only removed by deleteRouteTo() or clearRoutingTable().
+/// RHMesh does not give up on a static route whose next hop fails either: it keeps it, but looks for 
+/// another route, which is used in its place until that fails too (see "Static Routes" in RHMesh).
+/// This lets a network whose topology is fixed be provisioned once, for example from a table compiled 
+/// into the sketch or kept in EEPROM, so RHMesh nodes can send as soon as they start, without route 
+/// discovery, and only discover routes to destinations that are not in the table.
+///
+/// On ESP32 and Linux the routing table is by default indexed directly by destination address instead
+/// (see RH_ROUTING_TABLE_DIRECT in RHRouter.h). It has room for a route to every node, and 
+/// looking up, adding and deleting a route take constant time, which matters on busy relays where
+/// they are done for every message received and forwarded.
+/// With 16 bit addresses (see RH_ADDRESS_16 in RHDatagram.h) a slot for every node would not fit, 
+/// so the table has the same 256 slots, and routes are found in it by hashing the destination address.
+/// Finding, adding and deleting routes still take constant time while the table is not close to full.
+///
+/// \par Asynchronous Forwarding
+///
+/// A relay normally forwards a message from within recvfromAck(), with RHReliableDatagram::sendtoWait(), 
+/// which blocks until the next hop acknowledges it or the retries run out. Anything that arrives meanwhile 
+/// is lost, so a chain of relays carries only one message at a time, and each hop costs a full ACK cycle.
+/// After setAsyncForwarding(true), recvfromAck() acknowledges the message and puts it in a queue of 
+/// up to RH_ROUTER_FORWARD_QUEUE messages instead, and returns straight away. The queue is worked through 
+/// from within recvfromAck() and recvfromAckTimeout(): the oldest message is sent to its next hop, 
+/// and while the relay waits for the ACK it carries on receiving (and queueing) other messages, 
+/// retransmitting when the ACK timeout runs out. So the relays along a path can all be busy at once. 
+/// The relay must keep calling recvfromAck() or recvfromAckTimeout(). If the queue is full, 
+/// the message is forwarded with sendtoWait() as before. If the next hop never acknowledges it, 
+/// forwardFailed() is called (RHMesh then tells the source, as it does for messages forwarded with sendtoWait()).
+/// Messages this node sends itself are still sent with sendtoWait().
+/// Not available if RH_ROUTER_FORWARD_QUEUE is 0.
+///
+/// \par Chain Forwarding
+///
+/// Where the nodes are laid out in a line, such as along a pipeline or a road, and are given 
+/// addresses in order along it, the way to any destination is simply onwards along the line. 
+/// After setChainForwarding(true), route() does not use the routing table: it sends each message 
+/// to the neighbour furthest along the line towards the destination (without going past it) 
+/// that this node has heard from in the last RH_ROUTER_CHAIN_HEARD_TIME ms, or if there is none, 
+/// to the adjacent node (this node's address plus or minus 1). So when the radio reaches further 
+/// than planned, messages skip the nodes in between, and when it does not they go node by node.
+/// The driver is put in promiscuous mode, so that each node hears the messages its neighbours send 
+/// to other nodes. Messages overheard that way are not delivered or forwarded.
+/// If a neighbour further away than the adjacent node does not acknowledge a message, it is forgotten 
+/// until it is heard again, and the message is sent to the next best neighbour instead 
+/// (but not for messages queued by asynchronous forwarding, which just forget it).
+/// The last RH_ROUTER_CHAIN_NEIGHBOURS neighbours heard are kept, so no routing table or route discovery 
+/// is needed: RHMesh does not discover routes while chain forwarding is on.
+/// All the nodes should use chain forwarding. Not available if RH_ROUTER_CHAIN_NEIGHBOURS is 0.
+///
+/// \par Sending and Receiving In Place
+///
+/// RHRouter builds each message it sends, and reads each message it receives, in one RoutedMessage 
+/// buffer, which has room for the RHRouter header in front of the payload. A message forwarded for 
+/// another node is routed from where it was received, so it is only copied once, by the driver.
+/// The payload of a message sent by this node is normally copied into the buffer by sendtoWait(), 
+/// and that of a message received for this node is copied out of it by recvfromAck().
+/// Both copies can be avoided: a payload written straight into payloadBuffer() is sent by sendtoWait() 
+/// without being copied, and recvfromAckInPlace() returns a pointer to the received payload in the 
+/// buffer. RHMesh does the same one layer up, with room for its own header as well.
+/// Since the buffer is shared by sending and receiving, a payload written there must be sent 
+/// straight away, and a received payload must be used (or copied) before anything else is sent or received.
 ///
 /// \par Message Format
 ///
@@ -103,9 +281,9 @@
 /// RHRouter and its subclasses add an end-to-end addressing header in the payload of the RH message, 
 /// and before the RHRouter application data.
 /// - 1 octet DEST, the destination node address (ie the address of the final 
-///   destination node for this message)
+///   destination node for this message). 2 octets, most significant first, with 16 bit addresses
 /// - 1 octet SOURCE, the source node address (ie the address of the originating node that first sent 
-///   the message).
+///   the message). 2 octets with 16 bit addresses
 /// - 1 octet HOPS, the number of hops this message has traversed so far.
 /// - 1 octet ID, an incrementing message ID for end-to-end message tracking for use by subclasses. 
 ///   Not used by RHRouter.
@@ -125,9 +303,19 @@
 /// RHRouter.cpp has the ability to 
 /// simulate a number of different small network topologies. Each simulated network supports 4 nodes with 
 /// addresses 1 to 4. It operates by pretending to not hear RH messages from certain other nodes.
-/// You can enable testing with a \#define TEST_NETWORK in RHRouter.h
+/// You can enable testing with a \#define RH_TEST_NETWORK in RHRouter.h
 /// The sample programs rf22_mesh_* rely on this feature.
 ///
+/// In Linux simulator builds the topology can instead be given at run time, without rebuilding, 
+/// with the RH_SIMULATOR_TOPOLOGY environment variable (see RHSimTopology for the format), eg:
+/// \code
+/// RH_SIMULATOR_TOPOLOGY="chain:1:16" ./mysketch
+/// \endcode
+/// Any node can be made to hear only certain other nodes with setNeighbours().
+/// Whichever way the topology is given, the nodes this node can hear are kept in a bitmap,
+/// so the check on each received message takes constant time. With 16 bit addresses,
+/// the bitmap is indexed by the least significant octet of the address.
+///
 /// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers 
 /// (see http://www.hoperf.com)
 class RHRouter : public RHReliableDatagram
@@ -137,8 +325,8 @@ public:
     /// Defines the structure of the RHRouter message header, used to keep track of end-to-end delivery parameters
     typedef struct
     {
-	uint8_t    dest;       ///< Destination node address
-	uint8_t    source;     ///< Originator node address
+	RHAddressField dest;   ///< Destination node address (see RHgetAddress())
+	RHAddressField source; ///< Originator node address
 	uint8_t    hops;       ///< Hops traversed so far
 	uint8_t    id;         ///< Originator sequence number
 	uint8_t    flags;      ///< Originator flags
@@ -157,21 +345,29 @@ public:
     {
 	Invalid = 0,           ///< No valid route is known
 	Discovering,           ///< Discovering a route (not currently used)
-	Valid                  ///< Route is valid
+	Valid,                 ///< Route is valid
+	Static,                ///< Route is valid, and was provisioned with addStaticRoutes()
+	StaticFailed           ///< Route was provisioned with addStaticRoutes(), but its next hop failed. 
+	                       ///< The static next hop is kept in alt_hop, and next_hop is a route found 
+	                       ///< instead, or the static next hop until one is found
     } RouteState;
 
     /// Defines an entry in the routing table
     typedef struct
     {
-	uint8_t      dest;      ///< Destination node address
-	uint8_t      next_hop;  ///< Send via this next hop address
+	RHAddress    dest;      ///< Destination node address
+	RHAddress    next_hop;  ///< Send via this next hop address
 	uint8_t      state;     ///< State of this route, one of RouteState
+	uint16_t     metric;    ///< Metric of the path, lower is better. RH_ROUTER_METRIC_UNKNOWN if not known
+	RHAddress    alt_hop;   ///< Secondary next hop to fail over to, RH_DATAGRAM_BROADCAST_ADDRESS if none
+	uint16_t     alt_metric; ///< Metric of the path through alt_hop
+	unsigned long lastUsed; ///< millis() when the route was last added, updated or looked up
     } RoutingTableEntry;
 
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHRouter(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHRouter(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialises this instance and the radio module connected to it.
     /// Overrides the init() function in RH.
@@ -193,25 +389,75 @@ public:
     /// \param [in] max_hops The new value for max_hops
     void setMaxHops(uint8_t max_hops);
 
+    /// Sets how long a route can go unused before it is deleted from the routing table.
+    /// Routes are checked about every RH_ROUTER_EXPIRY_INTERVAL ms while recvfromAck() is being called,
+    /// and also whenever they are looked up.
+    /// \param [in] timeout The idle timeout in milliseconds. 0 (the default) means routes never expire
+    void setRouteTimeout(unsigned long timeout);
+
+    /// Turns passive route learning on or off. When on, the driver is put in promiscuous mode, 
+    /// and the messages this node overhears being passed between other nodes are not delivered 
+    /// or forwarded, but are given to overheardMessage(), which learns routes from them.
+    /// Turning it off also turns promiscuous mode off. Off by default.
+    /// \param [in] passive true to learn routes from overheard messages
+    void setPassiveRouteLearning(bool passive);
+
+    /// Deletes all the routes that have not been used for longer than the timeout
+    /// set by setRouteTimeout(). Called automatically by recvfromAck(), but can be called at any time.
+    void expireRoutes();
+
     /// Adds a route to the local routing table, or updates it if already present.
     /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
+    /// A static route (see addStaticRoutes()) is only replaced by another static route.
+    /// If the next hop changes, the old one becomes the secondary next hop (see addAlternateRouteTo()).
     /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
+    /// \param [in] metric The metric of the route, lower is better (see RHMesh::setRouteMetric()). 
+    /// Defaults to RH_ROUTER_METRIC_UNKNOWN
+    void addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state = Valid, uint16_t metric = RH_ROUTER_METRIC_UNKNOWN);
+
+    /// Adds static routes to the local routing table, replacing any routes it already has to the same
+    /// destinations (see "The Routing Table" above). The routes are given as pairs of addresses,
+    /// so they can be kept as they are in EEPROM or flash, eg:
+    /// \code
+    /// // Node 1 of the chain 1-2-3-4 reaches everything through node 2
+    /// const RHAddress routes[] = { 2, 2,   3, 2,   4, 2 };
+    /// manager.addStaticRoutes(routes, sizeof(routes) / sizeof(routes[0]) / 2);
+    /// \endcode
+    /// \param [in] routes count pairs of addresses: the destination node address, then the next hop address
+    /// \param [in] count The number of routes
+    /// \return The number of routes added. Less than count if the table filled up with static routes
+    uint8_t addStaticRoutes(const RHAddress* routes, uint8_t count);
+
+    /// Offers a secondary next hop for an existing route. It is kept if the route has no secondary 
+    /// next hop yet, or if its metric is better than the one it has.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop Another neighbour that can reach dest. Ignored if it is the next hop of the route
+    /// \param [in] metric The metric of the path through next_hop. Defaults to RH_ROUTER_METRIC_UNKNOWN, 
+    /// which never replaces a secondary next hop
+    void addAlternateRouteTo(RHAddress dest, RHAddress next_hop, uint16_t metric = RH_ROUTER_METRIC_UNKNOWN);
+
+    /// Makes the secondary next hop of a route its next hop, and forgets the old next hop.
+    /// Static routes are not changed. A route found in place of a static route that failed 
+    /// (see StaticFailed) goes back to the static next hop.
+    /// \param [in] dest The destination node address
+    /// \return true if the route had a secondary next hop and now uses it
+    bool failoverRouteTo(RHAddress dest);
 
     /// Finds and returns a RoutingTableEntry for the given destination node
     /// \param [in] dest The desired destination node address.
     /// \return pointer to a RoutingTableEntry for dest
-    RoutingTableEntry* getRouteTo(uint8_t dest);
+    RoutingTableEntry* getRouteTo(RHAddress dest);
 
     /// Deletes from the local routing table any route for the destination node.
     /// \param [in] dest The destination node address
     /// \return true if the route was present
-    bool deleteRouteTo(uint8_t dest);
+    bool deleteRouteTo(RHAddress dest);
 
-    /// Deletes the oldest (first) route from the 
-    /// local routing table
+    /// Deletes the least recently used route from the 
+    /// local routing table. Static routes are never deleted.
+    /// Called by addRouteTo() when the table is full. With RH_ROUTING_TABLE_DIRECT the table never fills
     void retireOldestRoute();
 
     /// Clears all entries from the 
@@ -227,7 +473,7 @@ public:
     ///    caller is responsible for alloocating and deallocating the structure.
     /// \param [inout] lastIndex_p points to the index to start searching from. Set to the
     ///   index of the next valid route found. Set this to -1 to start the search.
-    /// \return false if next entry is valid, true if finished with table.
+    /// \return true if a valid entry was found, false if finished with table.
     bool getNextValidRoutingTableEntry(RoutingTableEntry *RTE_p, int *lastIndex_p); //blase 7/27/20 
 
 
@@ -247,7 +493,7 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
 
     /// Similar to sendtoWait() above, but spoofs the source address.
     /// For internal use only during routing
@@ -263,7 +509,26 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Noyt able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags = 0);
+    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags = 0);
+
+    /// Similar to sendtoFromSourceWait() above, but also spoofs the originator sequence number,
+    /// so a message can be passed on with the same source and ID.
+    /// For internal use only during routing
+    /// \param [in] buf The application message data.
+    /// \param [in] len Number of octets in the application message data. 0 is permitted.
+    /// \param [in] dest The destination node address.
+    /// \param [in] source The (fake) originating node address.
+    /// \param [in] id The (fake) originator sequence number.
+    /// \param [in] flags Optional flags for use by subclasses or application layer.
+    /// \return The result code, as for sendtoFromSourceWait()
+    uint8_t sendtoFromSourceIdWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t id, uint8_t flags = 0);
+
+    /// Returns where the payload of the next message goes in the buffer RHRouter builds messages in, 
+    /// after room for the RHRouter header. A payload of up to RH_ROUTER_MAX_MESSAGE_LEN octets written here 
+    /// and passed to sendtoWait() is sent without being copied. The buffer is also used for receiving, 
+    /// so the payload must be written just before sendtoWait() is called.
+    /// \return Pointer to the payload area of the message buffer
+    uint8_t* payloadBuffer() { return _tmpMessage.data; }
 
     /// Starts the receiver if it is not running already.
     /// If there is a valid message available for this node (or RH_BROADCAST_ADDRESS), 
@@ -279,14 +544,26 @@ public:
     /// If the message is not a broadcast, acknowledge to the sender before returning.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
     /// (not just those addressed to this node).
     /// \return true if a valid message was recvived for this node copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
+    /// Like recvfromAck(), but instead of copying the payload, points *buf at it in the message buffer 
+    /// (see payloadBuffer()). It stays valid until the next message is sent or received.
+    /// \param[out] buf Set to point to the payload of the received message
+    /// \param[out] len Set to the length of the payload
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
+    /// \return true if a valid message was received for this node
+    bool recvfromAckInPlace(uint8_t** buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
@@ -294,14 +571,62 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// \param[in] hops If present and not NULL, the referenced uint8_t will be set to the HOPS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL, uint8_t* hops = NULL);
+
+#ifdef RH_ROUTER_NEIGHBOUR_FILTER
+    /// Sets the nodes that this node can hear, for testing with simulated topologies.
+    /// Messages from any other node are ignored by recvfromAck(), as if they had not been heard.
+    /// Overrides any RH_TEST_NETWORK or RH_SIMULATOR_TOPOLOGY topology.
+    /// Only available if RH_TEST_NETWORK is defined or in Linux simulator builds.
+    /// \param[in] bitmap 32 octets, with node n heard if bit (n & 7) of octet (n >> 3) is set.
+    /// With 16 bit addresses, n is the least significant octet of the address. NULL to hear all nodes.
+    void setNeighbours(const uint8_t* bitmap);
+
+    /// Tests whether this node can hear a node in the simulated topology
+    /// \param[in] address Node address of the transmitter
+    /// \return true if messages from address are not ignored
+    bool isNeighbour(RHAddress address);
+#endif
+
+#if RH_ROUTER_FORWARD_QUEUE
+    /// Turns asynchronous forwarding on or off (see "Asynchronous Forwarding" above).
+    /// Only available if RH_ROUTER_FORWARD_QUEUE is not 0.
+    /// \param[in] async true to queue messages to be forwarded, and send them without blocking. The default is false
+    void setAsyncForwarding(bool async);
+
+    /// \return The number of messages waiting to be forwarded, including the one being sent
+    uint8_t forwardsQueued();
+#endif
+
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    /// Turns chain forwarding on or off (see "Chain Forwarding" above). Turning it on puts the driver
+    /// in promiscuous mode, and turning it off takes it out again unless passive route learning is on.
+    /// Only available if RH_ROUTER_CHAIN_NEIGHBOURS is not 0.
+    /// \param[in] chain true to send messages to the furthest neighbour heard along the line. The default is false
+    void setChainForwarding(bool chain);
+
+    /// \return true if chain forwarding is on
+    bool chainForwarding() { return _chainForwarding; }
+#endif
+
+#if RH_ROUTER_LINK_METRICS
+    /// Returns the estimated expected transmission count (ETX) of the link to a neighbour:
+    /// the average number of transmissions needed for the neighbour to acknowledge a message.
+    /// It is estimated from the acknowledgements of the messages that route() sends to the neighbour,
+    /// giving most weight to the latest. A message that was never acknowledged counts as twice the
+    /// transmissions that were made.
+    /// Only available if RH_ROUTER_LINK_METRICS is 1.
+    /// \param[in] neighbour Address of the neighbouring node
+    /// \return ETX times RH_ROUTER_ETX_ONE, at most 255. 0 if nothing has been sent to the neighbour
+    uint8_t linkEtx(RHAddress neighbour);
+#endif
 
 protected:
 
@@ -312,17 +637,97 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual void peekAtMessage(RoutedMessage* message, uint8_t messageLen);
 
+    /// Learns routes from a message overheard on its way from one node to another, 
+    /// when passive route learning is on (see setPassiveRouteLearning()).
+    /// The sender (headerFrom()) is a neighbour one hop away, and the next hop to the source of the 
+    /// message, which is the hop count in the message plus one hops away through it. Nothing is learned 
+    /// about the destination, since the sender's way on to it could be through this node.
+    /// These routes are added if there is no route yet, refreshed if there is, and otherwise offered 
+    /// as secondary next hops if they are no longer than the route. Subclasses may override.
+    /// Called by recvfromAck()
+    /// \param [in] message Pointer to the RHRouter message that was overheard.
+    /// \param [in] messageLen Length of message in octets
+    virtual void overheardMessage(RoutedMessage* message, uint8_t messageLen);
+
+    /// Adds or refreshes a route learned by overheardMessage(), or offers it as a secondary next hop
+    /// if there is already a route through another next hop that is no shorter
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The neighbour that was overheard
+    /// \param [in] hops The number of hops to dest through next_hop, used as the metric of the route
+    void learnOverheardRoute(RHAddress dest, RHAddress next_hop, uint16_t hops);
+
+    /// Adds the end to end sequence number and the routing table to the image written by 
+    /// RHReliableDatagram::snapshot(). The time each route was last used is not kept
+    /// \param[in] buf Where to write the state
+    /// \param[in] len Room in buf
+    /// \return The number of octets written, 0 if they did not fit
+    virtual uint16_t snapshotState(uint8_t* buf, uint16_t len);
+
+    /// Reads back the state written by snapshotState(), replacing the routing table. 
+    /// The restored routes count as just used
+    /// \param[in] buf The state
+    /// \param[in] len Length of the state
+    /// \return The number of octets read, 0 if they are not valid
+    virtual uint16_t restoreState(const uint8_t* buf, uint16_t len);
+
     /// Finds the next-hop route and sends the message via RHReliableDatagram::sendtoWait().
+    /// A message being forwarded is never sent back to the node it came from (headerFrom()): 
+    /// the route switches to its secondary next hop, or if it has none, 
+    /// is deleted (unless it is static) and RH_ROUTER_ERROR_NO_ROUTE is returned.
     /// This is virtual, which lets subclasses override or intercept the route() function.
     /// Called by sendtoWait after the message header has been filled in.
     /// \param [in] message Pointer to the RHRouter message to be sent.
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
+    /// Sends the message to the given next hop, as route() does once it has found the next hop 
+    /// in the routing table. Lets subclasses route messages that carry their own next hop.
+    /// \param [in] message Pointer to the RHRouter message to be sent.
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] next_hop The neighbour to send it to
+    /// \return The result code, as for route()
+    uint8_t routeVia(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop);
+
+    /// Fills in the RHRouter header of a message that already has its payload in place, and calls route().
+    /// Lets subclasses send from buffers of their own that have room for the header, without a copy.
+    /// \param [in] message The message. Only the header and len octets of payload need to be there
+    /// \param [in] len Number of octets in the payload, which must fit the driver
+    /// \param [in] dest The destination node address
+    /// \param [in] source The originating node address
+    /// \param [in] id The originator sequence number
+    /// \param [in] flags Flags for use by subclasses or the application layer
+    /// \return The result code, as for sendtoWait()
+    uint8_t sendMessageWait(RoutedMessage* message, uint8_t len, RHAddress dest, RHAddress source, uint8_t id, uint8_t flags);
+
     /// Deletes a specific rout entry from therouting table
-    /// \param [in] index The 0 based index of the routing table entry to delete
+    /// \param [in] index The 0 based index of the routing table entry to delete.
+    /// With RH_ROUTING_TABLE_DIRECT and 8 bit addresses, this is the destination address
     void deleteRoute(uint8_t index);
 
+    /// Fills in or updates a routing table entry for addRouteTo()
+    /// \param [in] route The entry. If it is Invalid, it is new
+    /// \param [in] next_hop The address of the next hop
+    /// \param [in] state The state of the route
+    /// \param [in] metric The metric of the route
+    void setRoute(RoutingTableEntry* route, RHAddress next_hop, uint8_t state, uint16_t metric);
+
+    /// Called when a message queued by asynchronous forwarding was not acknowledged by its next hop
+    /// (see setAsyncForwarding()). The default does nothing: the message is dropped. Subclasses may override
+    /// \param [in] message The message. Only valid during the call
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] from The node this node got the message from
+    virtual void forwardFailed(RoutedMessage* message, uint8_t messageLen, RHAddress from);
+
+    /// Finishes with an ACK for the message being forwarded asynchronously
+    /// \param[in] from The node that sent the ACK
+    /// \param[in] id The ID of the message it acknowledges
+    virtual void ackReceived(RHAddress from, uint8_t id);
+
+    /// Moves asynchronous forwarding on: sends the oldest queued message, or retransmits it, 
+    /// or gives up on it. Called by recvfromAck() and recvfromAckTimeout()
+    /// \return ms until more work is due, -1 if there is none
+    int32_t serviceForwards();
+
     /// The last end-to-end sequence number to be used
     /// Defaults to 0
     uint8_t _lastE2ESequenceNumber;
@@ -334,10 +739,133 @@ protected:
     /// Flag to set if packets are forwarded or not
     bool _isa_router;
 
+    /// Routes unused for this many ms are deleted. 0 means never
+    unsigned long        _routeTimeout;
+
+    /// millis() when routes were last checked for expiry
+    unsigned long        _lastExpiry;
+
+    /// True if routes are learned from overheard messages
+    bool                 _passiveLearning;
+
+#if RH_ROUTER_FORWARD_QUEUE
+    /// A message waiting to be forwarded
+    typedef struct
+    {
+	uint8_t       len;      ///< Length of message
+	RHAddress     from;     ///< The node it came from
+	RHAddress     next_hop; ///< The node to send it to
+	RoutedMessage message;  ///< The message
+    } QueuedForward;
+
+    /// Queues a message to be forwarded to next_hop
+    /// \return false if the queue is full
+    bool queueForward(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop);
+
+    /// Removes the oldest queued message, when it has been acknowledged or its retries have run out
+    /// \param[in] acknowledged true if the next hop acknowledged it
+    void finishForward(bool acknowledged);
+
+    /// true if messages are forwarded asynchronously
+    bool                 _asyncForwarding;
+
+    /// true while recvfromAck() is routing a message for another node
+    bool                 _forwarding;
+
+    /// Messages waiting to be forwarded, the oldest at _forwardHead
+    QueuedForward        _forwards[RH_ROUTER_FORWARD_QUEUE];
+    uint8_t              _forwardHead;
+    uint8_t              _forwardCount;
+
+    /// true if the oldest message has been sent and its ACK is awaited
+    bool                 _forwardInFlight;
+
+    /// ID header of the oldest message, and how many times it has been sent
+    uint8_t              _forwardId;
+    uint8_t              _forwardTries;
+
+    /// millis() when the oldest message was last sent, and how long to wait for its ACK
+    unsigned long        _forwardSent;
+    uint16_t             _forwardTimeout;
+#endif
+
 private:
+#ifdef RH_ROUTER_NEIGHBOUR_FILTER
+    /// Loads the nodes this node can hear from the RH_TEST_NETWORK or RH_SIMULATOR_TOPOLOGY topology
+    void loadNeighbours();
+
+    /// Bitmap of the nodes this node can hear, indexed by node address
+    uint8_t              _neighbours[32];
+
+    /// Address the bitmap was loaded for. 0x10000 if not yet loaded, 0xffffffff if set by setNeighbours()
+    uint32_t             _neighboursFor;
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+    /// True if messages from nodes not in _neighbours are ignored
+    bool                 _neighbourFilter;
+#endif
+
+#if RH_ROUTER_CHAIN_NEIGHBOURS
+    /// A neighbour heard recently, for chain forwarding
+    typedef struct
+    {
+	RHAddress     address; ///< The node, RH_DATAGRAM_BROADCAST_ADDRESS if the entry is not used
+	unsigned long heard;   ///< millis() when it was last heard
+    } ChainNeighbour;
+
+    /// Sends a message to the furthest neighbour heard towards its destination, 
+    /// falling back to nearer ones if it is not acknowledged
+    /// \param [in] message Pointer to the RHRouter message to be sent.
+    /// \param [in] messageLen Length of message in octets
+    /// \return The result code, as for route()
+    uint8_t routeChain(RoutedMessage* message, uint8_t messageLen);
+
+    /// Chooses the next hop along the line for chain forwarding
+    /// \param [in] dest The destination node address, not this node
+    /// \return The furthest neighbour heard towards dest, or the adjacent node if there is none
+    RHAddress chainNextHop(RHAddress dest);
+
+    /// Records that a neighbour has just been heard
+    /// \param [in] neighbour Address of the neighbouring node
+    void chainHeard(RHAddress neighbour);
+
+    /// Forgets a neighbour that did not acknowledge a message, until it is heard again
+    /// \param [in] neighbour Address of the neighbouring node
+    void chainForget(RHAddress neighbour);
+
+    /// true if route() uses chain forwarding
+    bool                 _chainForwarding;
+
+    /// The neighbours heard most recently
+    ChainNeighbour       _chainNeighbours[RH_ROUTER_CHAIN_NEIGHBOURS];
+#endif
+
+#if RH_ROUTER_LINK_METRICS
+    /// Updates the ETX estimate of the link to a neighbour after sending it a message
+    /// \param[in] neighbour Address of the neighbouring node
+    /// \param[in] transmissions Number of times the message was transmitted
+    /// \param[in] acknowledged true if the neighbour acknowledged the message
+    void updateLinkEtx(RHAddress neighbour, uint8_t transmissions, bool acknowledged);
+
+    /// ETX of the link to each neighbour, indexed by node address. See linkEtx()
+#if RH_ADDRESS_16
+    /// With 16 bit addresses, up to RH_ROUTER_LINK_METRICS_NEIGHBOURS neighbours are kept in a hashed table instead
+    RHAddressValue       _linkEtx[RH_ROUTER_LINK_METRICS_NEIGHBOURS];
+#else
+    uint8_t              _linkEtx[256];
+#endif
+#endif
+
+    /// Temporary mesage buffer.
+    /// One per instance, so that several routers can run in one process (eg with RH_Sim)
+    RoutedMessage        _tmpMessage;
+
+#if RH_ROUTING_TABLE_DIRECT
+    /// Finds the slot in the routing table for a destination
+    /// \param [in] dest The destination node address
+    /// \return The index of the slot with the route to dest if there is one, 
+    /// else of the empty slot it can have. -1 if the table is full
+    int routeSlot(RHAddress dest);
+#endif
 
     /// Local routing table
     RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
@@ -0,0 +1,196 @@
+// RHSimMedium.cpp
+//
+// Shared in-memory radio medium for RH_Sim simulated radios.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <RadioHead.h>
+
+// This can only build in the Linux simulator with the virtual clock
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) && defined(RH_SIMULATOR_VIRTUAL_CLOCK)
+
+#include <RHSimMedium.h>
+#include <RH_Sim.h>
+
+RHSimMedium::RHSimMedium()
+    : _captureMargin(RH_SIM_MEDIUM_DEFAULT_CAPTURE_MARGIN),
+      _airtime(0),
+      _transmissions(0),
+      _capture(NULL)
+{
+    RHLoRaModemParamsFromRF95Config(0, 8, &_modemParams); // Bw125Cr45Sf128, the RH_RF95 default
+    const RHSimTopology* topology = RHSimTopology::fromEnvironment();
+    if (topology)
+	_topology = *topology;
+}
+
+void RHSimMedium::setModemParams(const RHLoRaModemParams& params)
+{
+    _modemParams = params;
+}
+
+void RHSimMedium::setCaptureMargin(int8_t margin)
+{
+    _captureMargin = margin;
+}
+
+uint32_t RHSimMedium::timeOnAir(uint8_t len)
+{
+    return RHLoRaTimeOnAir(&_modemParams, len);
+}
+
+void RHSimMedium::attach(RH_Sim* radio)
+{
+    for (size_t i = 0; i < _radios.size(); i++)
+	if (_radios[i] == radio)
+	    return; // Already attached
+    _radios.push_back(radio);
+}
+
+void RHSimMedium::detach(RH_Sim* radio)
+{
+    for (size_t i = 0; i < _radios.size(); i++)
+    {
+	if (_radios[i] == radio)
+	{
+	    _radios.erase(_radios.begin() + i);
+	    break;
+	}
+    }
+}
+
+RHSimMedium::Reception* RHSimMedium::newReception()
+{
+    Reception* r;
+    if (_freeReceptions.empty())
+	r = new Reception;
+    else
+    {
+	r = _freeReceptions.back();
+	_freeReceptions.pop_back();
+    }
+    r->medium = this;
+    r->corrupted = false;
+    return r;
+}
+
+void RHSimMedium::transmit(RH_Sim* sender, const uint8_t* frame, uint8_t len)
+{
+    uint32_t toa = timeOnAir(len);
+    uint64_t now = simulatorMicros();
+    uint64_t end = now + toa;
+    uint8_t from = sender->_thisAddress;
+    _airtime += toa;
+    _transmissions++;
+    capture(RH_CAPTURE_AIR, from, frame, len, 0, 0);
+
+    // The end of the transmission is scheduled first, so the sender can get back to receive mode
+    // before the receivers can react to the packet
+    Reception* t = newReception();
+    t->radio = sender;
+    t->end = end;
+    t->len = len;
+    sender->_transmission = t;
+    simulatorSchedule(end, endTransmission, t);
+
+    // Cant receive while transmitting: anything the sender was hearing is lost.
+    // Packets ending right now have already been heard, and their end events are still to come
+    for (size_t i = 0; i < sender->_receptions.size(); i++)
+	if (sender->_receptions[i]->end > now)
+	    sender->_receptions[i]->corrupted = true;
+
+    for (size_t i = 0; i < _radios.size(); i++)
+    {
+	RH_Sim* radio = _radios[i];
+	uint8_t to = radio->_thisAddress;
+	if (   radio == sender
+	    || !_topology.isNeighbour(from, to)
+	    || (radio->_mode != RHGenericDriver::RHModeRx && radio->_mode != RHGenericDriver::RHModeCad))
+	    continue; // Out of range, or not listening (including half duplex: cant hear while transmitting)
+	float loss = _topology.loss(from, to);
+	if (loss > 0.0 && (float)::random() / RAND_MAX < loss)
+	    continue; // Lost
+
+	Reception* r = newReception();
+	r->radio = radio;
+	r->end = end;
+	r->rssi = _topology.rssi(from, to);
+	r->snr = _topology.snr(from, to);
+	r->len = len;
+	memcpy(r->frame, frame, len);
+	// Overlaps with anything else this radio is hearing.
+	// The stronger survives only if it exceeds the capture margin
+	for (size_t j = 0; j < radio->_receptions.size(); j++)
+	{
+	    Reception* o = radio->_receptions[j];
+	    if (o->end <= now)
+		continue; // Ends as this one starts
+	    if (r->rssi < o->rssi + _captureMargin)
+		r->corrupted = true;
+	    if (o->rssi < r->rssi + _captureMargin)
+		o->corrupted = true;
+	}
+	radio->_receptions.push_back(r);
+	simulatorSchedule(end, endReception, r);
+    }
+}
+
+void RHSimMedium::capture(uint8_t direction, uint8_t node, const uint8_t* frame, uint8_t len, int8_t rssi, int8_t snr)
+{
+    if (!_capture || len < RH_SIM_HEADER_LEN)
+	return;
+    RHCapture::Record record;
+    record.direction = direction;
+    record.node = node;
+    record.to = frame[0];
+    record.from = frame[1];
+    record.id = frame[2];
+    record.flags = frame[3];
+    record.rssi = rssi;
+    record.snr = snr;
+    record.len = len - RH_SIM_HEADER_LEN;
+    record.payload = frame + RH_SIM_HEADER_LEN;
+    _capture->capture(record);
+}
+
+void RHSimMedium::endReception(void* arg)
+{
+    Reception* r = (Reception*)arg;
+    RH_Sim* radio = r->radio;
+    if (radio)
+    {
+	for (size_t i = 0; i < radio->_receptions.size(); i++)
+	{
+	    if (radio->_receptions[i] == r)
+	    {
+		radio->_receptions[i] = radio->_receptions.back();
+		radio->_receptions.pop_back();
+		break;
+	    }
+	}
+	// Must still be listening at the end of the packet
+	if (radio->_mode == RHGenericDriver::RHModeRx || radio->_mode == RHGenericDriver::RHModeCad)
+	{
+	    r->medium->capture(r->corrupted ? RH_CAPTURE_COLLIDED : RH_CAPTURE_RX,
+			       radio->_thisAddress, r->frame, r->len, r->rssi, r->snr);
+	    if (r->corrupted)
+		radio->_rxBad++;
+	    else
+		radio->receive(r->frame, r->len, r->rssi, r->snr);
+	}
+    }
+    r->medium->_freeReceptions.push_back(r);
+}
+
+void RHSimMedium::endTransmission(void* arg)
+{
+    Reception* t = (Reception*)arg;
+    if (t->radio)
+    {
+	t->radio->_transmission = NULL;
+	t->radio->transmitDone();
+    }
+    t->medium->_freeReceptions.push_back(t);
+}
+
+#endif
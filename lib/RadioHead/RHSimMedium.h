@@ -0,0 +1,156 @@
+// RHSimMedium.h
+//
+// Shared in-memory radio medium for RH_Sim simulated radios.
+// Lets many simulated nodes run in a single Linux process on the simulator virtual clock.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#ifndef RHSimMedium_h
+#define RHSimMedium_h
+
+#include <RadioHead.h>
+#include <RHLoRaAirtime.h>
+#include <RHSimTopology.h>
+#include <RHCapture.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) && defined(RH_SIMULATOR_VIRTUAL_CLOCK)
+#include <vector>
+
+class RH_Sim;
+
+// RSSI margin in dB needed to capture an overlapping packet
+#define RH_SIM_MEDIUM_DEFAULT_CAPTURE_MARGIN 6
+
+// Largest frame carried by the medium, including the RadioHead headers
+#define RH_SIM_MEDIUM_MAX_FRAME_LEN 255
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHSimMedium RHSimMedium.h <RHSimMedium.h>
+/// \brief The simulated ether shared by RH_Sim radios in the same process
+///
+/// RHSimMedium passes packets between RH_Sim radios in the same process, with the same
+/// radio model as tools/etherSimulator.cpp, but without any sockets or other processes:
+/// all the nodes of a simulated network run as cooperative tasks on the simulator virtual clock
+/// (see RHutil/simulator.h), so a network of hundreds of nodes can be simulated on one core,
+/// and the results are exactly repeatable for a given RH_SIMULATOR_SEED.
+///
+/// Each packet occupies the medium for its LoRa time on air (see RHLoRaAirtime.h).
+/// A radio only hears a packet if it is in receive mode when the packet starts and ends,
+/// and is not transmitting. When two packets overlap at a receiver, the stronger
+/// is received (captured) only if its RSSI exceeds the other by at least the capture margin,
+/// otherwise both are lost.
+///
+/// Which nodes can hear each other, and the loss, RSSI and SNR of each link, are given by
+/// the medium's RHSimTopology. It starts as the RH_SIMULATOR_TOPOLOGY topology if that is set,
+/// otherwise every node can hear every other node with certainty.
+/// Use topology() to build other topologies.
+/// Links are identified by the node addresses of the radios (as set by RHGenericDriver::setThisAddress()).
+///
+/// Only available in simulator builds with -DRH_SIMULATOR_VIRTUAL_CLOCK.
+/// The medium is large, so it should be a global or static object, not on a task stack.
+class RHSimMedium
+{
+public:
+    /// A packet being received by a radio, or being transmitted by it.
+    /// Internal to RHSimMedium and RH_Sim
+    typedef struct
+    {
+	RHSimMedium* medium;    ///< The medium carrying the packet
+	RH_Sim*      radio;     ///< The receiving (or transmitting) radio, NULL if it has gone
+	uint64_t     end;       ///< Simulated time in microseconds when the packet ends
+	int8_t       rssi;      ///< Received signal strength in dBm
+	int8_t       snr;       ///< Signal to noise ratio in dB
+	bool         corrupted; ///< Collided with another packet
+	uint8_t      len;       ///< Length of frame
+	uint8_t      frame[RH_SIM_MEDIUM_MAX_FRAME_LEN]; ///< Headers and payload
+    } Reception;
+
+    /// Constructor. Uses the RH_SIMULATOR_TOPOLOGY topology if set, else all nodes can hear each other.
+    /// Uses RH_RF95::Bw125Cr45Sf128 with an 8 symbol preamble
+    RHSimMedium();
+
+    /// Sets the LoRa modem parameters used to calculate the time on air of each packet.
+    /// \param[in] params The modem parameters
+    void setModemParams(const RHLoRaModemParams& params);
+
+    /// Sets the RSSI margin needed for a packet to survive a collision with a weaker one
+    /// \param[in] margin The margin in dB. Defaults to RH_SIM_MEDIUM_DEFAULT_CAPTURE_MARGIN
+    void setCaptureMargin(int8_t margin);
+
+    /// The topology of the simulated network, which can be changed at any time
+    /// \return The topology used by this medium
+    RHSimTopology& topology() { return _topology; }
+
+    /// Time on air of a frame
+    /// \param[in] len Length of the frame, including the RadioHead headers
+    /// \return The time on air in microseconds
+    uint32_t timeOnAir(uint8_t len);
+
+    /// \return The total time on air of all the packets transmitted on this medium, in microseconds
+    uint64_t airtime() { return _airtime; }
+
+    /// \return The number of packets transmitted on this medium
+    uint32_t transmissions() { return _transmissions; }
+
+    /// Sets a capture to be given every packet transmitted on the medium (as RH_CAPTURE_AIR,
+    /// from the sender), and every reception of it at the end of its time on air (as RH_CAPTURE_RX,
+    /// or RH_CAPTURE_COLLIDED if it was lost in a collision), whoever it is addressed to.
+    /// \param[in] capture The capture, or NULL to stop capturing (the default)
+    void setCapture(RHCapture* capture) { _capture = capture; }
+
+protected:
+    friend class RH_Sim;
+
+    /// Adds a radio to the medium. Called by RH_Sim::init()
+    void attach(RH_Sim* radio);
+
+    /// Removes a radio from the medium. Called when the RH_Sim is destroyed
+    void detach(RH_Sim* radio);
+
+    /// Starts the transmission of a frame by radio to every radio that can hear it.
+    /// RH_Sim::transmitDone() is called on the sender at the end of the time on air
+    /// \param[in] sender The transmitting radio
+    /// \param[in] frame The headers and payload
+    /// \param[in] len Length of frame
+    void transmit(RH_Sim* sender, const uint8_t* frame, uint8_t len);
+
+private:
+    /// Gets an unused Reception
+    Reception* newReception();
+
+    /// Event handler at the end of a packet at a receiver
+    static void endReception(void* arg);
+
+    /// Event handler at the end of a transmission
+    static void endTransmission(void* arg);
+
+    /// Modem parameters for the time on air
+    RHLoRaModemParams       _modemParams;
+
+    /// Capture margin in dB
+    int8_t                  _captureMargin;
+
+    /// The attached radios
+    std::vector<RH_Sim*>    _radios;
+
+    /// Receptions that can be reused
+    std::vector<Reception*> _freeReceptions;
+
+    /// Which nodes hear each other, and how well
+    RHSimTopology           _topology;
+
+    /// Total time on air of all packets in microseconds
+    uint64_t                _airtime;
+
+    /// Count of packets transmitted
+    uint32_t                _transmissions;
+
+    /// Where to capture packets, if anywhere
+    RHCapture*              _capture;
+
+    /// Passes a frame to the capture
+    void capture(uint8_t direction, uint8_t node, const uint8_t* frame, uint8_t len, int8_t rssi, int8_t snr);
+};
+
+#endif
+#endif
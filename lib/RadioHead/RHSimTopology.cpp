@@ -0,0 +1,217 @@
+// RHSimTopology.cpp
+//
+// Network topology for simulated RadioHead networks.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <RadioHead.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RHSimTopology.h>
+#include <errno.h>
+#include <string>
+
+RHSimTopology::RHSimTopology()
+    : _restricted(false)
+{
+    for (int from = 0; from < 256; from++)
+	for (int to = 0; to < 256; to++)
+	{
+	    _loss[from][to] = 0.0;
+	    _rssi[from][to] = RH_SIM_TOPOLOGY_DEFAULT_RSSI;
+	    _snr[from][to] = RH_SIM_TOPOLOGY_DEFAULT_SNR;
+	}
+    memset(_heard, 0xff, sizeof(_heard));
+}
+
+void RHSimTopology::clear()
+{
+    for (int from = 0; from < 256; from++)
+	for (int to = 0; to < 256; to++)
+	    _loss[from][to] = 1.0;
+    memset(_heard, 0, sizeof(_heard));
+    _restricted = true;
+}
+
+void RHSimTopology::makeRestricted()
+{
+    if (!_restricted)
+	clear();
+}
+
+void RHSimTopology::setLink(uint8_t from, uint8_t to, float loss, int8_t rssi, int8_t snr)
+{
+    _loss[from][to] = loss;
+    _rssi[from][to] = rssi;
+    _snr[from][to] = snr;
+    if (loss < 1.0)
+	_heard[to][from >> 3] |= (1 << (from & 7));
+    else
+	_heard[to][from >> 3] &= ~(1 << (from & 7));
+}
+
+void RHSimTopology::setLinks(uint8_t a, uint8_t b, float loss, int8_t rssi, int8_t snr)
+{
+    setLink(a, b, loss, rssi, snr);
+    setLink(b, a, loss, rssi, snr);
+}
+
+void RHSimTopology::chain(uint8_t first, uint8_t last, float loss, int8_t rssi, int8_t snr)
+{
+    makeRestricted();
+    for (unsigned int a = first; a < last; a++)
+	setLinks(a, a + 1, loss, rssi, snr);
+}
+
+void RHSimTopology::grid(uint8_t first, uint8_t width, uint8_t height, float loss, int8_t rssi, int8_t snr)
+{
+    makeRestricted();
+    for (unsigned int row = 0; row < height; row++)
+	for (unsigned int column = 0; column < width; column++)
+	{
+	    unsigned int a = first + row * width + column;
+	    if (column + 1 < width && a + 1 < 256)
+		setLinks(a, a + 1, loss, rssi, snr);
+	    if (row + 1 < height && a + width < 256)
+		setLinks(a, a + width, loss, rssi, snr);
+	}
+}
+
+bool RHSimTopology::parseLine(const char* line, const char* where, int lineNumber, bool adjustments)
+{
+    unsigned int a, b, c;
+    float f;
+    int rssi = RH_SIM_TOPOLOGY_DEFAULT_RSSI;
+    int snr = RH_SIM_TOPOLOGY_DEFAULT_SNR;
+    float loss = 0.0;
+
+    // Skip leading white space, blank lines and comments
+    while (*line == ' ' || *line == '\t')
+	line++;
+    if (*line == '\0' || *line == '#' || *line == '\r')
+	return true;
+    // Lines that adjust links come after the lines that make them, whatever order they are in
+    bool adjustment =    strncmp(line, "probability:", 12) == 0
+	              || strncmp(line, "rssi:", 5) == 0
+	              || strncmp(line, "snr:", 4) == 0;
+    if (adjustment != adjustments)
+	return true;
+
+    if (sscanf(line, "link:%u:%u:%f:%d:%d", &a, &b, &loss, &rssi, &snr) >= 2 && a < 256 && b < 256)
+    {
+	makeRestricted();
+	setLinks(a, b, loss, rssi, snr);
+    }
+    else if (sscanf(line, "oneway:%u:%u:%f:%d:%d", &a, &b, &loss, &rssi, &snr) >= 2 && a < 256 && b < 256)
+    {
+	makeRestricted();
+	setLink(a, b, loss, rssi, snr);
+    }
+    else if (sscanf(line, "chain:%u:%u:%f:%d:%d", &a, &b, &loss, &rssi, &snr) >= 2 && a <= b && b < 256)
+	chain(a, b, loss, rssi, snr);
+    else if (sscanf(line, "grid:%u:%u:%u:%f:%d:%d", &a, &b, &c, &loss, &rssi, &snr) >= 3 && a < 256 && b < 256 && c < 256)
+	grid(a, b, c, loss, rssi, snr);
+    else if (sscanf(line, "probability:%u:%u:%f", &a, &b, &f) == 3 && a < 256 && b < 256)
+    {
+	// Bidirectional. Keeps the RSSI and SNR
+	setLink(a, b, 1.0 - f, _rssi[a][b], _snr[a][b]);
+	setLink(b, a, 1.0 - f, _rssi[b][a], _snr[b][a]);
+    }
+    else if (sscanf(line, "rssi:%u:%u:%d", &a, &b, &rssi) == 3 && a < 256 && b < 256)
+    {
+	_rssi[a][b] = rssi;
+	_rssi[b][a] = rssi;
+    }
+    else if (sscanf(line, "snr:%u:%u:%d", &a, &b, &snr) == 3 && a < 256 && b < 256)
+    {
+	_snr[a][b] = snr;
+	_snr[b][a] = snr;
+    }
+    else
+    {
+	fprintf(stderr, "RHSimTopology: invalid topology line %d in %s: %s\n", lineNumber, where, line);
+	return false;
+    }
+    return true;
+}
+
+bool RHSimTopology::load(const char* filename)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f)
+    {
+	fprintf(stderr, "RHSimTopology: could not open topology file %s: %s\n", filename, strerror(errno));
+	return false;
+    }
+    bool ret = true;
+    char line[256];
+    for (int pass = 0; pass < 2; pass++)
+    {
+	rewind(f);
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+	    lineNumber++;
+	    line[strcspn(line, "\r\n")] = '\0';
+	    if (!parseLine(line, filename, lineNumber, pass == 1))
+		ret = false;
+	}
+    }
+    fclose(f);
+    return ret;
+}
+
+bool RHSimTopology::parse(const char* spec)
+{
+    bool ret = true;
+    std::string lines(spec);
+    for (int pass = 0; pass < 2; pass++)
+    {
+	size_t start = 0;
+	int lineNumber = 0;
+	while (start <= lines.size())
+	{
+	    size_t end = lines.find_first_of(";\n", start);
+	    if (end == std::string::npos)
+		end = lines.size();
+	    lineNumber++;
+	    if (!parseLine(lines.substr(start, end - start).c_str(), "topology", lineNumber, pass == 1))
+		ret = false;
+	    start = end + 1;
+	}
+    }
+    return ret;
+}
+
+const RHSimTopology* RHSimTopology::fromEnvironment()
+{
+    static RHSimTopology* topology = NULL;
+    static bool           loaded = false;
+
+    if (!loaded)
+    {
+	loaded = true;
+	const char* spec = getenv("RH_SIMULATOR_TOPOLOGY");
+	if (spec && *spec)
+	{
+	    topology = new RHSimTopology;
+	    // A file name, or else the topology lines themselves
+	    FILE* f = fopen(spec, "r");
+	    bool ok;
+	    if (f)
+	    {
+		fclose(f);
+		ok = topology->load(spec);
+	    }
+	    else
+		ok = topology->parse(spec);
+	    if (!ok)
+		exit(1);
+	}
+    }
+    return topology;
+}
+
+#endif
@@ -0,0 +1,181 @@
+// RHSimTopology.h
+//
+// Network topology for simulated RadioHead networks: which nodes can hear each other,
+// and the loss, RSSI and SNR of each link. Loaded at run time from a topology file
+// or the RH_SIMULATOR_TOPOLOGY environment variable.
+// Used by RHSimMedium, RHRouter and tools/etherSimulator.cpp.
+//
+// Copyright (C) 2014 Mike McCauley
+
+#ifndef RHSimTopology_h
+#define RHSimTopology_h
+
+#include <RadioHead.h>
+
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+// RSSI in dBm of links that are not given one
+#define RH_SIM_TOPOLOGY_DEFAULT_RSSI -80
+
+// SNR in dB of links that are not given one
+#define RH_SIM_TOPOLOGY_DEFAULT_SNR 10
+
+// Size in octets of a neighbour bitmap, one bit per node address
+#define RH_SIM_TOPOLOGY_BITMAP_LEN 32
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHSimTopology RHSimTopology.h <RHSimTopology.h>
+/// \brief Link matrix describing which simulated nodes can hear each other
+///
+/// A topology holds, for every pair of node addresses, whether the receiver can hear the transmitter,
+/// the probability that a packet on that link is lost, and the RSSI and SNR of packets on that link.
+/// Whether a node can hear another is kept in a bitmap per receiver, so it can be tested in constant time
+/// however large the network is.
+///
+/// A new topology is a full mesh: every node hears every other, with no loss.
+/// It becomes restricted (see isRestricted()) as soon as any link, chain or grid line is given:
+/// from then on nodes can only hear each other if there is a link between them.
+///
+/// \par Topology files
+///
+/// Topology files have one line per entry. Blank lines and lines starting with # are ignored.
+/// Node addresses are 0 to 255. loss and probability are 0.0 to 1.0, rssi is in dBm and snr in dB.
+/// Optional fields take the default loss of 0.0, RSSI of RH_SIM_TOPOLOGY_DEFAULT_RSSI
+/// and SNR of RH_SIM_TOPOLOGY_DEFAULT_SNR.
+/// \code
+/// link:a:b[:loss[:rssi[:snr]]]                  a and b can hear each other
+/// oneway:a:b[:loss[:rssi[:snr]]]                b can hear a, but not necessarily the other way
+/// chain:first:last[:loss[:rssi[:snr]]]          nodes first to last in a line, each hearing its neighbours
+/// grid:first:width:height[:loss[:rssi[:snr]]]   width x height nodes numbered from first in rows,
+///                                               each hearing the nodes above, below, left and right
+/// probability:a:b:probability                   probability of successful delivery between a and b
+/// rssi:a:b:rssi                                 RSSI between a and b
+/// snr:a:b:snr                                   SNR between a and b
+/// \endcode
+/// The probability and rssi lines are the same as the older tools/chain.conf format for etherSimulator.pl,
+/// and do not restrict the topology. The probability, rssi and snr lines are applied after all the
+/// other lines in the same file or RH_SIMULATOR_TOPOLOGY, wherever they are, so they are not lost
+/// when a link, chain or grid line after them restricts the topology, and they override the loss, 
+/// RSSI and SNR given on those lines. A probability line for nodes that have no link gives them one.
+///
+/// \par Run time topologies
+///
+/// In Linux simulator builds, the environment variable RH_SIMULATOR_TOPOLOGY gives the topology
+/// for all the nodes in the process (see fromEnvironment()). It is either the name of a topology file,
+/// or topology lines separated by ';'. For example, to sweep the length of a chain without rebuilding:
+/// \code
+/// for n in 4 8 16 32 64; do RH_SIMULATOR_TOPOLOGY="chain:1:$n" ./mysketch $n; done
+/// \endcode
+/// RHRouter uses it to drop messages from nodes that this node could not hear (the run time
+/// equivalent of the RH_TEST_NETWORK macros), and RHSimMedium and etherSimulator.cpp use it
+/// to decide which nodes hear each transmission.
+class RHSimTopology
+{
+public:
+    /// Constructor. Makes a full mesh with no loss
+    RHSimTopology();
+
+    /// Removes all links, so no node can hear any other.
+    /// The topology is then restricted.
+    void clear();
+
+    /// Sets a link so that to can hear from
+    /// \param[in] from Node address of the transmitter
+    /// \param[in] to Node address of the receiver
+    /// \param[in] loss Probability that a packet on the link is lost, 0.0 to 1.0. 1.0 removes the link.
+    /// \param[in] rssi RSSI in dBm of packets on the link
+    /// \param[in] snr SNR in dB of packets on the link
+    void setLink(uint8_t from, uint8_t to, float loss = 0.0, int8_t rssi = RH_SIM_TOPOLOGY_DEFAULT_RSSI, int8_t snr = RH_SIM_TOPOLOGY_DEFAULT_SNR);
+
+    /// Makes nodes first to last a line, each hearing only its immediate neighbours.
+    /// Restricts the topology.
+    /// \param[in] first Node address of the first node
+    /// \param[in] last Node address of the last node
+    /// \param[in] loss, rssi, snr As for setLink(), applied in both directions
+    void chain(uint8_t first, uint8_t last, float loss = 0.0, int8_t rssi = RH_SIM_TOPOLOGY_DEFAULT_RSSI, int8_t snr = RH_SIM_TOPOLOGY_DEFAULT_SNR);
+
+    /// Makes a grid of width x height nodes, numbered from first along each row in turn.
+    /// Each node hears the nodes above, below, left and right of it. Restricts the topology.
+    /// \param[in] first Node address of the top left node
+    /// \param[in] width Number of nodes in each row
+    /// \param[in] height Number of rows
+    /// \param[in] loss, rssi, snr As for setLink(), applied in both directions
+    void grid(uint8_t first, uint8_t width, uint8_t height, float loss = 0.0, int8_t rssi = RH_SIM_TOPOLOGY_DEFAULT_RSSI, int8_t snr = RH_SIM_TOPOLOGY_DEFAULT_SNR);
+
+    /// Reads a topology file, adding its entries to this topology
+    /// \param[in] filename Name of the file
+    /// \return true if the file was read without errors. Errors are reported on stderr
+    bool load(const char* filename);
+
+    /// Adds one or more topology lines to this topology
+    /// \param[in] spec Topology lines, separated by ';' or newlines
+    /// \return true if there were no errors. Errors are reported on stderr
+    bool parse(const char* spec);
+
+    /// Tests whether to can hear from. Constant time.
+    /// \param[in] from Node address of the transmitter
+    /// \param[in] to Node address of the receiver
+    /// \return true if there is a link from from to to
+    bool isNeighbour(uint8_t from, uint8_t to) const
+    {
+	return _heard[to][from >> 3] & (1 << (from & 7));
+    }
+
+    /// Bitmap of the nodes that a node can hear.
+    /// Node n can be heard if bit (n & 7) of octet (n >> 3) is set
+    /// \param[in] to Node address of the receiver
+    /// \return Pointer to RH_SIM_TOPOLOGY_BITMAP_LEN octets
+    const uint8_t* neighbours(uint8_t to) const { return _heard[to]; }
+
+    /// \return Probability that a packet from from to to is lost
+    float loss(uint8_t from, uint8_t to) const { return _loss[from][to]; }
+
+    /// \return RSSI in dBm of packets from from to to
+    int8_t rssi(uint8_t from, uint8_t to) const { return _rssi[from][to]; }
+
+    /// \return SNR in dB of packets from from to to
+    int8_t snr(uint8_t from, uint8_t to) const { return _snr[from][to]; }
+
+    /// \return true if nodes can only hear each other through the links that were given,
+    /// false if this is still a full mesh
+    bool isRestricted() const { return _restricted; }
+
+    /// The topology given by the RH_SIMULATOR_TOPOLOGY environment variable, if any.
+    /// It is loaded the first time this is called. If it can not be loaded, the process exits.
+    /// \return The topology, or NULL if RH_SIMULATOR_TOPOLOGY is not set
+    static const RHSimTopology* fromEnvironment();
+
+private:
+    /// Clears the full mesh the first time a link, chain or grid line is given
+    void makeRestricted();
+
+    /// Sets the link in both directions
+    void setLinks(uint8_t a, uint8_t b, float loss, int8_t rssi, int8_t snr);
+
+    /// Adds one topology line, if it is one of the lines for this pass
+    /// \param[in] line The line, without any line terminator
+    /// \param[in] where Description of where the line came from, for error messages
+    /// \param[in] lineNumber Line number for error messages
+    /// \param[in] adjustments false for the first pass, which adds the link, oneway, chain and grid lines,
+    /// true for the second, which adds the probability, rssi and snr lines
+    /// \return true if the line is valid, or is for the other pass
+    bool parseLine(const char* line, const char* where, int lineNumber, bool adjustments);
+
+    /// True once any link, chain or grid has been given
+    bool    _restricted;
+
+    /// Probability of loss on each link, indexed by [from][to]
+    float   _loss[256][256];
+
+    /// RSSI of each link, indexed by [from][to]
+    int8_t  _rssi[256][256];
+
+    /// SNR of each link, indexed by [from][to]
+    int8_t  _snr[256][256];
+
+    /// Bitmap of the nodes each node can hear, indexed by [to][from >> 3]
+    uint8_t _heard[256][RH_SIM_TOPOLOGY_BITMAP_LEN];
+};
+
+#endif
+#endif
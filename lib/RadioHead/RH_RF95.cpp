@@ -330,6 +330,7 @@ bool RH_RF95::recv(uint8_t* buf, uint8_t* len)
 	memcpy(buf, _buf+RH_RF95_HEADER_LEN, *len);
 	ATOMIC_BLOCK_END;
     }
+    capture(RH_CAPTURE_RX, _buf+RH_RF95_HEADER_LEN, _bufLen-RH_RF95_HEADER_LEN, _lastSNR);
     clearRxBuf(); // This message accepted and cleared
     RH_MUTEX_UNLOCK(lock);
     return true;
@@ -360,6 +361,7 @@ bool RH_RF95::send(const uint8_t* data, uint8_t len)
     RH_MUTEX_LOCK(lock); // Multithreading support
     setModeTx(); // Start the transmitter
     RH_MUTEX_UNLOCK(lock);
+    capture(RH_CAPTURE_TX, data, len);
     
     // when Tx is done, interruptHandler will fire and radio mode will return to STANDBY
     return true;
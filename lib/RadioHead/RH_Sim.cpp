@@ -0,0 +1,153 @@
+// RH_Sim.cpp
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <RadioHead.h>
+
+// This can only build in the Linux simulator with the virtual clock
+#if (RH_PLATFORM == RH_PLATFORM_UNIX) && defined(RH_SIMULATOR_VIRTUAL_CLOCK)
+
+#include <RH_Sim.h>
+
+RH_Sim::RH_Sim(RHSimMedium& medium)
+    : _medium(medium),
+      _attached(false),
+      _task(NULL),
+      _transmission(NULL),
+      _bufLen(0),
+      _rxBufValid(false),
+      _lastSNR(0)
+{
+}
+
+RH_Sim::~RH_Sim()
+{
+    // Packets still on the medium must not refer to us any more
+    for (size_t i = 0; i < _receptions.size(); i++)
+	_receptions[i]->radio = NULL;
+    if (_transmission)
+	_transmission->radio = NULL;
+    if (_attached)
+	_medium.detach(this);
+}
+
+bool RH_Sim::init()
+{
+    if (!RHGenericDriver::init())
+	return false;
+    _medium.attach(this);
+    _attached = true;
+    _mode = RHModeIdle;
+    return true;
+}
+
+bool RH_Sim::available()
+{
+    _task = simulatorCurrentTask();
+    if (_mode == RHModeTx)
+	return false;
+    _mode = RHModeRx;
+    return _rxBufValid;
+}
+
+bool RH_Sim::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    if (buf && len)
+    {
+	// Skip the 4 headers that are at the beginning of the rxBuf
+	if (*len > _bufLen - RH_SIM_HEADER_LEN)
+	    *len = _bufLen - RH_SIM_HEADER_LEN;
+	memcpy(buf, _buf + RH_SIM_HEADER_LEN, *len);
+    }
+    capture(RH_CAPTURE_RX, _buf + RH_SIM_HEADER_LEN, _bufLen - RH_SIM_HEADER_LEN, _lastSNR);
+    _rxBufValid = false;
+    return true;
+}
+
+bool RH_Sim::send(const uint8_t* data, uint8_t len)
+{
+    if (len > RH_SIM_MAX_MESSAGE_LEN || !_attached)
+	return false;
+
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    _mode = RHModeIdle;
+
+    if (!waitCAD())
+	return false;  // Check channel activity
+
+    uint8_t frame[RH_SIM_MEDIUM_MAX_FRAME_LEN];
+    frame[0] = _txHeaderTo;
+    frame[1] = _txHeaderFrom;
+    frame[2] = _txHeaderId;
+    frame[3] = _txHeaderFlags;
+    memcpy(frame + RH_SIM_HEADER_LEN, data, len);
+
+    _task = simulatorCurrentTask();
+    _mode = RHModeTx;
+    _medium.transmit(this, frame, len + RH_SIM_HEADER_LEN);
+    capture(RH_CAPTURE_TX, data, len);
+    return true;
+}
+
+uint8_t RH_Sim::maxMessageLength()
+{
+    return RH_SIM_MAX_MESSAGE_LEN;
+}
+
+bool RH_Sim::isChannelActive()
+{
+    for (size_t i = 0; i < _receptions.size(); i++)
+	if (_receptions[i]->end > simulatorMicros())
+	    return true;
+    return false;
+}
+
+bool RH_Sim::sleep()
+{
+    if (_mode == RHModeTx)
+	return false;
+    _mode = RHModeSleep;
+    return true;
+}
+
+int RH_Sim::lastSNR()
+{
+    return _lastSNR;
+}
+
+void RH_Sim::receive(const uint8_t* frame, uint8_t len, int8_t rssi, int8_t snr)
+{
+    if (len < RH_SIM_HEADER_LEN)
+    {
+	_rxBad++;
+	return;
+    }
+    uint8_t to = frame[0];
+    // Same filtering as a real radio driver
+    if (!_promiscuous && to != _thisAddress && to != RH_BROADCAST_ADDRESS)
+	return;
+
+    // Overwrites any previous message not yet collected, as the radio would
+    memcpy(_buf, frame, len);
+    _bufLen = len;
+    _rxHeaderTo    = frame[0];
+    _rxHeaderFrom  = frame[1];
+    _rxHeaderId    = frame[2];
+    _rxHeaderFlags = frame[3];
+    _lastRssi = rssi;
+    _lastSNR = snr;
+    _rxGood++;
+    _rxBufValid = true;
+    simulatorWakeupTask(_task);
+}
+
+void RH_Sim::transmitDone()
+{
+    _txGood++;
+    _mode = RHModeIdle;
+    simulatorWakeupTask(_task);
+}
+
+#endif
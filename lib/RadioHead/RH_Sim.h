@@ -0,0 +1,176 @@
+// RH_Sim.h
+//
+// Copyright (C) 2014 Mike McCauley
+#ifndef RH_Sim_h
+#define RH_Sim_h
+
+#include <RHGenericDriver.h>
+
+#if (RH_PLATFORM != RH_PLATFORM_UNIX) || !defined(RH_SIMULATOR_VIRTUAL_CLOCK)
+ #error "RH_Sim only runs in the Linux simulator, built with -DRH_SIMULATOR_VIRTUAL_CLOCK"
+#endif
+
+#include <RHSimMedium.h>
+
+// The length of the headers we add: to, from, id, flags, as for RH_RF95
+#define RH_SIM_HEADER_LEN 4
+
+// This is the maximum message length that can be supported by this driver, the same as RH_RF95
+#define RH_SIM_MAX_MESSAGE_LEN (RH_SIM_MEDIUM_MAX_FRAME_LEN - RH_SIM_HEADER_LEN)
+
+/////////////////////////////////////////////////////////////////////
+/// \class RH_Sim RH_Sim.h <RH_Sim.h>
+/// \brief Driver to send and receive unaddressed, unreliable datagrams between simulated radios in one process
+///
+/// \par Overview
+///
+/// RH_Sim is a simulated radio that sends and receives through an RHSimMedium shared with other
+/// RH_Sim radios in the same Linux process. It lets a single simulated sketch contain a whole network of
+/// nodes, each with its own driver and manager (eg RHMesh), instead of running one process per node
+/// connected through RH_TCP to the ether simulator. There are no sockets or system calls per packet,
+/// so networks of hundreds of nodes can be simulated on one core, much faster than real time.
+///
+/// The behaviour of the simulated radio follows RH_RF95: send() returns at once and the radio is
+/// in RHModeTx for the LoRa time on air of the packet, then returns to RHModeIdle. available() puts the radio
+/// in RHModeRx. isChannelActive() reports true while the radio is hearing a packet, so waitCAD() works.
+///
+/// \par Running nodes as tasks
+///
+/// RH_Sim needs the simulator virtual clock, so sketches must be built with -DRH_SIMULATOR_VIRTUAL_CLOCK.
+/// Each simulated node runs in its own cooperative task, created with simulatorSpawn()
+/// (see RHutil/simulator.h), so the ordinary blocking RadioHead API (sendtoWait(), recvfromAckTimeout() etc)
+/// can be used in every node. While a node waits, the others run.
+/// A node's driver and manager must only be used by that node's task.
+///
+/// \code
+/// RHSimMedium medium;
+///
+/// void node(void* arg)
+/// {
+///     RHMesh* manager = (RHMesh*)arg;
+///     manager->init();
+///     while (1)
+///     {
+///         uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+///         uint8_t len = sizeof(buf);
+///         manager->recvfromAckTimeout(buf, &len, 10000);
+///     }
+/// }
+///
+/// void setup()
+/// {
+///     for (uint8_t i = 2; i <= 200; i++)
+///         simulatorSpawn(node, new RHMesh(*new RH_Sim(medium), i));
+/// }
+/// \endcode
+///
+/// See examples/simulator/simulator_mesh_inprocess for a complete example.
+///
+/// \par Building
+///
+/// \code
+/// cd whatever/RadioHead
+/// tools/simBuild examples/simulator/simulator_mesh_inprocess/simulator_mesh_inprocess.ino -DRH_SIMULATOR_VIRTUAL_CLOCK
+/// ./simulator_mesh_inprocess
+/// \endcode
+class RH_Sim : public RHGenericDriver
+{
+public:
+    /// Constructor
+    /// \param[in] medium The medium shared by all the simulated radios that can talk to each other
+    RH_Sim(RHSimMedium& medium);
+
+    /// Destructor. Removes the radio from the medium
+    virtual ~RH_Sim();
+
+    /// Initialise the Driver, and attach it to the medium.
+    /// \return true if initialisation succeeded.
+    virtual bool init();
+
+    /// Tests whether a new message is available
+    /// from the Driver.
+    /// Puts the radio into RHModeRx mode unless it is transmitting.
+    /// \return true if a new, complete, error-free uncollected message is available to be retreived by recv()
+    virtual bool available();
+
+    /// If there is a valid message available, copy it to buf and return true
+    /// else return false.
+    /// If a message is copied, *len is set to the length (Caution, 0 length messages are permitted).
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to the number of octets available in buf. The number be reset to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
+    /// Then starts the transmission of the message on the medium. The radio stays in RHModeTx
+    /// for the time on air of the message.
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message length was valid and it was correctly queued for transmit
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// Returns the maximum message length
+    /// available in this Driver.
+    /// \return The maximum legal message length
+    virtual uint8_t maxMessageLength();
+
+    /// Tests whether the radio is currently hearing a packet from another radio.
+    /// Used by waitCAD() when a CAD timeout has been set with setCADTimeout()
+    /// \return true if the channel is in use
+    virtual bool isChannelActive();
+
+    /// Puts the radio to sleep. It hears nothing until available() or send() is called
+    /// \return true
+    virtual bool sleep();
+
+    /// The SNR of the last received message, as given by the link in the medium's RHSimTopology
+    /// \return SNR of the last received message in dB
+    int lastSNR();
+
+protected:
+    friend class RHSimMedium;
+
+    /// Called by the medium at the end of a packet that was heard without collisions.
+    /// Keeps it if it is addressed to this node (or promiscuous), and wakes the task waiting for it
+    /// \param[in] frame Headers and payload
+    /// \param[in] len Length of frame
+    /// \param[in] rssi The RSSI of the packet in dBm
+    /// \param[in] snr The SNR of the packet in dB
+    void receive(const uint8_t* frame, uint8_t len, int8_t rssi, int8_t snr);
+
+    /// Called by the medium at the end of the time on air of the packet being sent
+    void transmitDone();
+
+private:
+    /// The medium we send and receive through
+    RHSimMedium&        _medium;
+
+    /// True when attached to the medium
+    bool                _attached;
+
+    /// The task that last used this radio. It is woken when something happens to the radio
+    SimulatorTask*      _task;
+
+    /// Packets currently being heard by this radio
+    std::vector<RHSimMedium::Reception*> _receptions;
+
+    /// The packet this radio is transmitting, if any
+    RHSimMedium::Reception* _transmission;
+
+    /// The last received packet, including headers
+    uint8_t             _buf[RH_SIM_MEDIUM_MAX_FRAME_LEN];
+
+    /// Length of _buf
+    uint8_t             _bufLen;
+
+    /// True when there is a valid message in _buf
+    bool                _rxBufValid;
+
+    /// SNR of the last received message
+    int8_t              _lastSNR;
+};
+
+/// @example simulator_mesh_inprocess.ino
+/// @example simulator_mesh_benchmark.ino
+
+#endif
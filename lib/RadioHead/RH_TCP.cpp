@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <netdb.h>
+#include <sys/time.h>
 #include <string>
 
 RH_TCP::RH_TCP(const char* server)
@@ -25,6 +26,7 @@ RH_TCP::RH_TCP(const char* server)
       _rxBufValid(false),
       _socket(-1)
 {
+    RHLoRaModemParamsFromRF95Config(0, 8, &_modemParams); // Bw125Cr45Sf128
 }
     
 bool RH_TCP::init()
@@ -180,9 +182,11 @@ bool RH_TCP::checkForEvents()
 		// check for other message types here
 		// Now remove the used message by copying the trailing bytes (maybe start of a new message?)
 		// to the top of the buffer
-		memcpy(socketBuf, socketBuf + messageLen, sizeof(socketBuf) - messageLen);
+		memmove(socketBuf, socketBuf + messageLen, sizeof(socketBuf) - messageLen);
 		socketBufLen -= messageLen;
 	    }
+	    else
+		break; // Wait for the rest of the message
 	}
     }
     return true; // No faults
@@ -204,7 +208,7 @@ bool RH_TCP::available()
 {
     if (_socket < 0)
 	return false;
-    if (checkForEvents())
+    if (!checkForEvents())
 	return false;        // Som sort of IO failre
     if (_rxBufFull)
     {
@@ -231,6 +235,13 @@ bool RH_TCP::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
     FD_SET(_socket, &input);
     max_fd = _socket + 1;
 
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    // Messages from other simulated nodes arrive over a real socket, so time spent
+    // waiting for them is real time. It is carried over to the simulated clock below
+    struct timeval before, after;
+    gettimeofday(&before, NULL);
+#endif
+
     if (timeout)
     {
 	struct timeval timer;
@@ -245,6 +256,11 @@ bool RH_TCP::waitAvailableTimeout(uint16_t timeout, uint16_t polldelay)
     }
     if (result < 0)
 	fprintf(stderr, "RH_TCP::waitAvailableTimeout: select failed %s\n", strerror(errno));
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    gettimeofday(&after, NULL);
+    uint64_t elapsed = (after.tv_sec - before.tv_sec) * 1000000ULL + after.tv_usec - before.tv_usec;
+    simulatorRunUntil(simulatorMicros() + elapsed);
+#endif
     return result > 0;
 }
 
@@ -259,6 +275,7 @@ bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
 	    *len = _rxBufLen;
 	memcpy(buf, _rxBuf, *len);
     }
+    capture(RH_CAPTURE_RX, _rxBuf, _rxBufLen);
     clearRxBuf();
     return true;
 }
@@ -269,7 +286,17 @@ bool RH_TCP::send(const uint8_t* data, uint8_t len)
 	return false;  // Check channel activity (prob not possible for this driver?)
 
     bool ret = sendPacket(data, len);
-    delay(10); // Wait for transmit to succeed. REVISIT: depends on length and speed
+    capture(RH_CAPTURE_TX, data, len);
+    // Wait for the simulated time on air, same as the ether simulator
+    uint32_t airtime = RHLoRaTimeOnAir(&_modemParams, len + RH_TCP_HEADER_LEN);
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+    // The ether simulator runs in real time, so the time on air has to pass in real time too,
+    // else our next packet would overlap this one in the ether
+    usleep(airtime);
+    simulatorRunUntil(simulatorMicros() + airtime);
+#else
+    delay((airtime + 999) / 1000);
+#endif
     return ret;
 }
 
@@ -278,6 +305,11 @@ uint8_t RH_TCP::maxMessageLength()
     return RH_TCP_MAX_MESSAGE_LEN;
 }
 
+void RH_TCP::setModemParams(const RHLoRaModemParams& params)
+{
+    _modemParams = params;
+}
+
 void RH_TCP::setThisAddress(uint8_t address)
 {
     RHGenericDriver::setThisAddress(address);
@@ -7,6 +7,7 @@
 
 #include <RHGenericDriver.h>
 #include <RHTcpProtocol.h>
+#include <RHLoRaAirtime.h>
 
 /////////////////////////////////////////////////////////////////////
 /// \class RH_TCP RH_TCP.h <RH_TCP.h>
@@ -33,6 +34,9 @@
 /// tools/simBuild examples/simulator/simulator_reliable_datagram_server/simulator_reliable_datagram_server.ino
 /// # in one window, run the simulator server:
 /// tools/etherSimulator.pl
+/// # or build and run the native simulator server instead:
+/// g++ -O2 -I . tools/etherSimulator.cpp RHLoRaAirtime.cpp RHSimTopology.cpp RHPcapFile.cpp -o etherSimulator
+/// ./etherSimulator
 /// # in another window, run the server
 /// ./simulator_reliable_datagram_server 
 /// # in another window, run the client:
@@ -48,21 +52,38 @@
 /// \endcode
 ///
 /// You can change the listen port and the simulated baud rate with 
-/// command line arguments passed to etherSimulator.pl
+/// command line arguments passed to etherSimulator.pl or etherSimulator
+///
+/// \par Virtual clock
+///
+/// Sketches built with -DRH_SIMULATOR_VIRTUAL_CLOCK 
+/// (eg tools/simBuild sketch.ino -DRH_SIMULATOR_VIRTUAL_CLOCK) run on a simulated clock:
+/// delay() returns immediately after advancing millis(), so long idle periods in a sketch cost no real time.
+/// Since RH_TCP messages pass through a real socket, time spent in waitAvailableTimeout()
+/// and the time on air in send() are still real time, and are added to the simulated clock. The clocks of separate processes are not
+/// synchronised, so timing between nodes is only approximate in this mode.
 ///
 /// \par Implementation
 ///
 /// etherServer.pl is a conventional server written in Perl.
 /// listens on a TCP socket (defaults to port 4000) for connections from sketch simulators
 /// using RH_TCP as theur driver.
+/// etherSimulator.cpp is a native Linux equivalent using an epoll event loop. It needs no Perl
+/// modules, and handles hundreds of connected sketches with sub-millisecond forwarding latency.
+/// It also models the LoRa time on air of each packet, half duplex operation,
+/// and collisions with capture effect between overlapping packets.
+/// Its topology (which nodes hear each other, and the loss and RSSI of each link) is read from
+/// the -c config file or the RH_SIMULATOR_TOPOLOGY environment variable (see RHSimTopology).
+/// With -P it writes every packet to a pcap file for Wireshark (see RHPcapFile).
+/// Build it with RHLoRaAirtime.cpp, RHSimTopology.cpp and RHPcapFile.cpp:
+/// g++ -O2 -I . tools/etherSimulator.cpp RHLoRaAirtime.cpp RHSimTopology.cpp RHPcapFile.cpp -o etherSimulator
 /// The simulated sketches send messages out to the 'ether' over the TCP connection to the etherServer.
 /// etherServer manages the delivery of each message to any other RH_TCP sketches that are running.
 ///
 /// \par Prerequisites
 ///
 /// g++ compiler installed and in your $PATH
-/// Perl
-/// Perl POE library
+/// Perl and the Perl POE library (only for etherSimulator.pl)
 ///
 class RH_TCP : public RHGenericDriver
 {
@@ -129,6 +150,13 @@ public:
     /// \return The maximum legal message length
     virtual uint8_t maxMessageLength();
 
+    /// Sets the LoRa modem parameters used to simulate the time on air of transmitted messages.
+    /// send() blocks for the time on air of each message, like a real radio does in waitPacketSent().
+    /// They should be the same as the modem configuration given to the ether simulator.
+    /// Defaults to RH_RF95::Bw125Cr45Sf128 with an 8 symbol preamble, which is also the ether simulator default.
+    /// \param[in] params The modem parameters
+    void setModemParams(const RHLoRaModemParams& params);
+
     /// Sets the address of this node. Defaults to 0xFF. Subclasses or the user may want to change this.
     /// This will be used to test the adddress in incoming messages. In non-promiscuous mode,
     /// only messages with a TO header the same as thisAddress or the broadcast addess (0xFF) will be accepted.
@@ -171,6 +199,9 @@ private:
     /// and received using the protocol RHTcpPRotocol
     const char* _server;
 
+    /// Modem parameters used to calculate the time on air of transmitted messages
+    RHLoRaModemParams _modemParams;
+
     /// The TCP socket used to communicate with the message server
     int         _socket;
 
@@ -24,6 +24,65 @@ extern unsigned long millis();
 extern long random(long to);
 extern long random(long from, long to);
 
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+// Discrete-event virtual clock, enabled by building with -DRH_SIMULATOR_VIRTUAL_CLOCK
+// (eg tools/simBuild sketch.ino -DRH_SIMULATOR_VIRTUAL_CLOCK).
+// millis() returns simulated time, and delay() advances the simulated time instantly,
+// running any events that fall due in the meantime. Time is kept in microseconds internally.
+// Drivers that simulate the radio schedule their events (eg end of transmission, delivery
+// of a packet) on the event queue, and call simulatorWakeup() from the event handler
+// to end a wait in simulatorRunUntil() early.
+
+// Time value meaning 'no deadline'
+#define SIMULATOR_FOREVER 0xffffffffffffffffULL
+
+// Handler called when a scheduled event falls due. Handlers must not block or call delay().
+// They run outside any task
+typedef void (*SimulatorEventHandler)(void* arg);
+
+// Microseconds of simulated time since the start of the process
+extern uint64_t simulatorMicros();
+
+// Schedule handler(arg) to be called at the simulated time when (in microseconds).
+// Events with equal times are run in the order they were scheduled
+extern void simulatorSchedule(uint64_t when, SimulatorEventHandler handler, void* arg);
+
+// Run events and other tasks in time order, advancing the clock, until the clock reaches until
+// or an event handler wakes the calling task with simulatorWakeup() or simulatorWakeupTask().
+// If until is SIMULATOR_FOREVER and there is nothing else left to run, returns without advancing the clock.
+// Returns true if woken
+extern bool simulatorRunUntil(uint64_t until);
+
+// Ends the current simulatorRunUntil() of the main task after the current event handler returns
+extern void simulatorWakeup();
+
+// Cooperative tasks, so several simulated nodes (each with its own blocking
+// setup/loop style code) can run in one process on the virtual clock.
+// The sketch itself runs as the main task. Each task runs until it waits in
+// simulatorRunUntil() (eg in delay() or RHGenericDriver::waitAvailableTimeout()),
+// when the next runnable task or the next event is run. Only one task runs at a time,
+// so tasks need no locking.
+// simulatorWakeup() wakes the main task. Drivers shared by several tasks
+// use simulatorWakeupTask() to wake the task that is waiting for them.
+typedef struct SimulatorTask SimulatorTask;
+
+// Entry point of a task. The task ends when it returns
+typedef void (*SimulatorTaskFunction)(void* arg);
+
+// Default stack size for new tasks
+#define SIMULATOR_TASK_STACK_SIZE (64 * 1024)
+
+// Create a new task that will call function(arg). It first runs when the calling task next waits
+extern SimulatorTask* simulatorSpawn(SimulatorTaskFunction function, void* arg, size_t stacksize = SIMULATOR_TASK_STACK_SIZE);
+
+// The currently running task. NULL in an event handler
+extern SimulatorTask* simulatorCurrentTask();
+
+// Ends the wait of task in simulatorRunUntil(), which will return true.
+// Does nothing if task is not waiting
+extern void simulatorWakeupTask(SimulatorTask* task);
+#endif
+
 // Equavalent to HardwareSerial in Arduino
 // but outputs to stdout
 class SerialSimulator
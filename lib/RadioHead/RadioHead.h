@@ -163,6 +163,11 @@ For use with simulated sketches compiled and running on Linux.
 Works with tools/etherSimulator.pl to pass messages between simulated sketches, allowing
 testing of Manager classes on Linux and without need for real radios or other transport hardware.
 
+- RH_Sim
+For use with simulated sketches compiled and running on Linux with the simulator virtual clock.
+Passes messages between many simulated nodes running as tasks in a single process, through
+a shared RHSimMedium that models LoRa time on air and collisions.
+
 - RHEncryptedDriver
 Adds encryption and decryption to any RadioHead transport driver, using any encrpytion cipher
 supported by ArduinoLibs Cryptographic Library http://rweather.github.io/arduinolibs/crypto.html
@@ -0,0 +1,328 @@
+// simulator_mesh_benchmark.ino
+// -*- mode: C++ -*-
+// Benchmark for RHMesh networks, run on the simulator virtual clock with RH_Sim.
+// One or more source nodes send messages to a sink node through RHMesh::sendtoWait(),
+// at a configurable offered load, building them in place in RHMesh::payloadBuffer().
+// The sink receives them with RHMesh::recvfromAckTimeout().
+// When all the messages have been sent, one CSV line of results is printed on stdout:
+// packet delivery ratio, p50/p95/p99 end-to-end latency, retransmissions (the total
+// of RHReliableDatagram::retransmissions() over all nodes), and the time on air of
+// all the packets on the medium per delivered payload octet.
+// Runs are repeatable for a given RH_SIMULATOR_SEED, so MAC and routing variants
+// can be compared run over run.
+//
+// By default the nodes 1 to nodes are a line (1-2-3-4 with 4 nodes), each node hearing
+// only its neighbours. Other topologies can be given with RH_SIMULATOR_TOPOLOGY
+// (see RHSimTopology.h).
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/simBuild examples/simulator/simulator_mesh_benchmark/simulator_mesh_benchmark.ino -DRH_SIMULATOR_VIRTUAL_CLOCK
+// Run with
+// ./simulator_mesh_benchmark [-H] [-L label] [-n nodes] [-d sink] [-a] [-m messages] [-i interval] [-l length]
+//                            [-M metric] [-R ring] [-A] [-S] [-E] [-O] [-F] [-s] [-C] [-P capturefile]
+// where
+// -H prints the CSV header line first
+// -L label is copied to the first column, to identify the variant being measured
+// -n nodes is the number of nodes, with addresses 1 to nodes (default 4)
+// -d sink is the address of the sink node (default nodes). It can only be 1 with -a
+// -a makes all the other nodes sources, instead of just node 1
+// -m messages is the number of messages each source sends (default 100)
+// -i interval is the time in ms between the starts of each source's messages (default 2000).
+//    If sendtoWait() takes longer, the next message is sent as soon as it returns
+// -l length is the payload length in octets (default 20, at least 12)
+// -M metric is how the nodes choose routes: hops (the default), etx or snr (see RHMesh::setRouteMetric())
+// -R ring is the limit of the TTLs of the expanding ring search for routes (see RHMesh::setArpRing()).
+//    0 floods every route discovery through the whole network
+// -A uses asynchronous route discovery (see RHMesh::setAsyncDiscovery())
+// -S gives every node static routes along the line 1 to nodes (see RHRouter::addStaticRoutes()),
+//    so there is no route discovery unless a static next hop fails. Only useful with the default line topology
+// -E makes sendtoWait() wait for end to end acknowledgement of each message (see RHMesh::setEndToEndAck())
+// -O makes the nodes learn routes from the messages they overhear (see RHRouter::setPassiveRouteLearning())
+// -F makes the relays forward messages without blocking (see RHRouter::setAsyncForwarding())
+// -s makes the sources source route their messages (see RHMesh::setSourceRouting()).
+//    With -S, every node is also given the source routes along the line (see RHMesh::setSourceRoute())
+// -C makes the nodes forward along the line 1 to nodes to the furthest neighbour they hear,
+//    without route discovery (see RHRouter::setChainForwarding())
+// -P capturefile writes every packet on the medium to a pcap file (see RHPcapFile.h)
+// For example, to sweep the length of the chain:
+// for n in 2 3 4 6 8; do RH_SIMULATOR_SEED=1 ./simulator_mesh_benchmark -L baseline -n $n; done
+
+#include <RHMesh.h>
+#include <RH_Sim.h>
+#include <RHPcapFile.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+// Length of the sequence number and send time at the start of each payload
+#define HEADER_LEN 12
+
+// Configuration, from the command line
+const char* label = "";
+int nodes = 4;
+int sink = 0;
+bool allSources = false;
+int messages = 100;
+unsigned long interval = 2000;
+int length = 20;
+uint8_t metric = RH_MESH_METRIC_HOPS;
+int ring = RH_MESH_ARP_RING_MAX_TTL;
+bool async = false;
+bool staticRoutes = false;
+bool endToEndAck = false;
+bool overhear = false;
+bool asyncForwarding = false;
+bool sourceRouting = false;
+bool chainForwarding = false;
+
+// The simulated ether shared by all the nodes
+RHSimMedium medium;
+
+// Capture of the packets on the medium, if -P was given
+RHPcapFile capture;
+
+// One mesh manager per node, indexed by address
+RHMesh* managers[256];
+
+// Results
+unsigned long sent = 0;        // Messages given to sendtoWait()
+unsigned long delivered = 0;   // Different messages received by the sink
+int sourcesRunning = 0;
+std::vector<uint32_t> latencies; // End to end latency in microseconds of each delivered message
+std::vector<bool> seen[256];   // Messages received by the sink, indexed by source and sequence number
+
+// The sink runs this in its own task
+void sinkTask(void* arg)
+{
+  RHMesh* mesh = (RHMesh*)arg;
+  while (1)
+  {
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(buf);
+    RHAddress from;
+    if (mesh->recvfromAckTimeout(buf, &len, 10000, &from) && len >= HEADER_LEN)
+    {
+      uint32_t seq;
+      uint64_t sendTime;
+      memcpy(&seq, buf, sizeof(seq));
+      memcpy(&sendTime, buf + sizeof(seq), sizeof(sendTime));
+      if (seq < seen[from].size() && !seen[from][seq])
+      {
+	seen[from][seq] = true;
+	delivered++;
+	latencies.push_back(simulatorMicros() - sendTime);
+      }
+    }
+  }
+}
+
+// Each source runs this in its own task
+void sourceTask(void* arg)
+{
+  RHMesh* mesh = (RHMesh*)arg;
+  uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+  // Let the other nodes start listening, and start at a random point in the interval, 
+  // or sources the same distance from the sink send in lock step on the virtual clock, and always collide
+  delay(10 + random(0, interval));
+  for (uint32_t seq = 0; seq < (uint32_t)messages; seq++)
+  {
+    unsigned long start = millis();
+    uint64_t sendTime = simulatorMicros();
+    uint8_t* payload = mesh->payloadBuffer();
+    memset(payload, 0, length);
+    memcpy(payload, &seq, sizeof(seq));
+    memcpy(payload + sizeof(seq), &sendTime, sizeof(sendTime));
+    sent++;
+    mesh->sendtoWait(payload, length, sink);
+    // Keep forwarding for other nodes until the next message is due
+    long wait;
+    while ((wait = interval - (millis() - start)) > 0)
+    {
+      uint8_t len = sizeof(buf);
+      mesh->recvfromAckTimeout(buf, &len, wait);
+    }
+  }
+  sourcesRunning--;
+  // Carry on forwarding
+  while (1)
+  {
+    uint8_t len = sizeof(buf);
+    mesh->recvfromAckTimeout(buf, &len, 10000);
+  }
+}
+
+// Relays just forward messages for other nodes
+void relayTask(void* arg)
+{
+  RHMesh* mesh = (RHMesh*)arg;
+  while (1)
+  {
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(buf);
+    mesh->recvfromAckTimeout(buf, &len, 10000);
+  }
+}
+
+// The latency in ms at the given percentile of the delivered messages
+float percentile(std::vector<uint32_t>& sorted, int p)
+{
+  if (sorted.empty())
+    return 0.0;
+  size_t i = (sorted.size() * p + 99) / 100;
+  if (i > 0)
+    i--;
+  return sorted[i] / 1000.0;
+}
+
+void setup()
+{
+  Serial.begin(9600);
+  bool header = false;
+  int opt;
+  while ((opt = getopt(_simulator_argc, _simulator_argv, "HL:n:d:am:i:l:M:R:ASEOFsCP:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'H': header = true; break;
+    case 'L': label = optarg; break;
+    case 'n': nodes = atoi(optarg); break;
+    case 'd': sink = atoi(optarg); break;
+    case 'a': allSources = true; break;
+    case 'm': messages = atoi(optarg); break;
+    case 'i': interval = atol(optarg); break;
+    case 'l': length = atoi(optarg); break;
+    case 'M':
+      if (!strcmp(optarg, "hops"))
+	metric = RH_MESH_METRIC_HOPS;
+      else if (!strcmp(optarg, "etx"))
+	metric = RH_MESH_METRIC_ETX;
+      else if (!strcmp(optarg, "snr"))
+	metric = RH_MESH_METRIC_SNR;
+      else
+      {
+	fprintf(stderr, "unknown metric %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'R': ring = atoi(optarg); break;
+    case 'A': async = true; break;
+    case 'S': staticRoutes = true; break;
+    case 'E': endToEndAck = true; break;
+    case 'O': overhear = true; break;
+    case 'F': asyncForwarding = true; break;
+    case 's': sourceRouting = true; break;
+    case 'C': chainForwarding = true; break;
+    case 'P':
+      if (!capture.open(optarg))
+	exit(1);
+      medium.setCapture(&capture);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-H] [-L label] [-n nodes] [-d sink] [-a] [-m messages] [-i interval] [-l length] [-M metric] [-R ring] [-A] [-S] [-E] [-O] [-F] [-s] [-C] [-P capturefile]\n", _simulator_argv[0]);
+      exit(1);
+    }
+  }
+  if (!sink)
+    sink = nodes;
+  // Without -a, node 1 is the only source, so it cannot also be the sink
+  if (   nodes < 2 || nodes > 254 || sink < 1 || sink > nodes || (sink == 1 && !allSources) || messages < 1
+      || length < HEADER_LEN || length > (int)RH_MESH_MAX_MESSAGE_LEN)
+  {
+    fprintf(stderr, "invalid configuration\n");
+    exit(1);
+  }
+  if (header)
+    printf("label,nodes,sources,messages,interval_ms,length,sent,delivered,pdr,latency_p50_ms,latency_p95_ms,latency_p99_ms,retransmissions,transmissions,airtime_ms,airtime_us_per_byte,seed\n");
+
+  // Unless RH_SIMULATOR_TOPOLOGY says otherwise, each node hears only its neighbours
+  if (!medium.topology().isRestricted())
+    medium.topology().chain(1, nodes);
+
+  for (int i = 1; i <= nodes; i++)
+  {
+    managers[i] = new RHMesh(*new RH_Sim(medium), i);
+    if (!managers[i]->init())
+    {
+      fprintf(stderr, "init failed for node %d\n", i);
+      exit(1);
+    }
+    managers[i]->setRouteMetric(metric);
+    managers[i]->setArpRing(ring);
+    managers[i]->setAsyncDiscovery(async);
+    managers[i]->setEndToEndAck(endToEndAck);
+    managers[i]->setPassiveRouteLearning(overhear);
+    managers[i]->setAsyncForwarding(asyncForwarding);
+    managers[i]->setSourceRouting(sourceRouting);
+    managers[i]->setChainForwarding(chainForwarding);
+    if (staticRoutes)
+    {
+      // Everything lower down the line is reached through the previous node, the rest through the next
+      RHAddress routes[2 * 254];
+      uint8_t count = 0;
+      for (int dest = 1; dest <= nodes; dest++)
+      {
+	if (dest == i)
+	  continue;
+	routes[count * 2] = dest;
+	routes[count * 2 + 1] = dest < i ? i - 1 : i + 1;
+	count++;
+      }
+      managers[i]->addStaticRoutes(routes, count);
+      if (sourceRouting)
+      {
+	// The relays along the line to each destination
+	for (int dest = 1; dest <= nodes; dest++)
+	{
+	  RHAddress path[254];
+	  uint8_t len = 0;
+	  int step = dest < i ? -1 : 1;
+	  for (int relay = i + step; relay != dest; relay += step)
+	    path[len++] = relay;
+	  if (dest != i)
+	    managers[i]->setSourceRoute(dest, path, len);
+	}
+      }
+    }
+    seen[i].resize(messages);
+  }
+  for (int i = 1; i <= nodes; i++)
+  {
+    if (i == sink)
+      simulatorSpawn(sinkTask, managers[i]);
+    else if (i == 1 || allSources)
+    {
+      sourcesRunning++;
+      simulatorSpawn(sourceTask, managers[i]);
+    }
+    else
+      simulatorSpawn(relayTask, managers[i]);
+  }
+}
+
+void loop()
+{
+  delay(1000);
+  if (sourcesRunning)
+    return;
+
+  // Let the last messages arrive
+  delay(10000);
+
+  uint32_t retransmissions = 0;
+  for (int i = 1; i <= nodes; i++)
+    retransmissions += managers[i]->retransmissions();
+  std::sort(latencies.begin(), latencies.end());
+  const char* seed = getenv("RH_SIMULATOR_SEED");
+  unsigned long deliveredBytes = delivered * length;
+  printf("%s,%d,%d,%d,%lu,%d,%lu,%lu,%.4f,%.1f,%.1f,%.1f,%lu,%lu,%.1f,%.1f,%s\n",
+	 label, nodes, allSources ? nodes - 1 : 1, messages, interval, length,
+	 sent, delivered, sent ? (float)delivered / sent : 0.0,
+	 percentile(latencies, 50), percentile(latencies, 95), percentile(latencies, 99),
+	 (unsigned long)retransmissions, (unsigned long)medium.transmissions(),
+	 medium.airtime() / 1000.0,
+	 deliveredBytes ? (float)medium.airtime() / deliveredBytes : 0.0,
+	 seed ? seed : "");
+  capture.close();
+  exit(0);
+}
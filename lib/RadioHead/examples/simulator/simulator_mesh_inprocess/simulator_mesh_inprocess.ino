@@ -0,0 +1,112 @@
+// simulator_mesh_inprocess.ino
+// -*- mode: C++ -*-
+// Example sketch showing how to simulate a whole RHMesh network in a single process,
+// using the RH_Sim driver and a shared RHSimMedium.
+// Nodes 1 to NODES are arranged in a line, and each node can only hear its immediate neighbours.
+// Node 1 (the client, running in loop()) sends a message to the last node, which replies.
+// All the other nodes run as tasks that route messages between them.
+// Lines of more than RH_ROUTING_TABLE_SIZE nodes need the direct indexed routing table (the default
+// on Linux, see RH_ROUTING_TABLE_DIRECT in RHRouter.h), since the last node must still have a route
+// back to the client when route discovery reaches it. Lines of more than RH_DEFAULT_MAX_HOPS nodes
+// also need a larger setMaxHops().
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_mesh_inprocess/simulator_mesh_inprocess.ino -DRH_SIMULATOR_VIRTUAL_CLOCK
+// Run with ./simulator_mesh_inprocess [nodes]
+// No ether simulator is needed. Set RH_SIMULATOR_SEED for repeatable runs.
+// Other topologies can be given at run time with RH_SIMULATOR_TOPOLOGY (see RHSimTopology.h),
+// for example to sweep the length of a lossy chain without rebuilding:
+// for n in 4 8 16 32 64; do RH_SIMULATOR_TOPOLOGY="chain:1:$n:0.1" ./simulator_mesh_inprocess $n; done
+
+#include <RHMesh.h>
+#include <RH_Sim.h>
+
+#define CLIENT_ADDRESS 1
+
+// Number of nodes in the line, can be changed on the command line
+int nodes = 10;
+
+// The simulated ether shared by all the nodes
+RHSimMedium medium;
+
+// The client node
+RH_Sim driver(medium);
+RHMesh manager(driver, CLIENT_ADDRESS);
+
+uint8_t data[] = "Hello World!";
+uint8_t reply[] = "And hello back to you";
+// Dont put this on the stack:
+uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+
+unsigned long requests = 0;
+unsigned long replies = 0;
+
+// Each of the other nodes runs this in its own task
+void node(void* arg)
+{
+  RHMesh* mesh = (RHMesh*)arg;
+  if (!mesh->init())
+    Serial.println("node init failed");
+  while (1)
+  {
+    uint8_t nodebuf[RH_MESH_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(nodebuf);
+    RHAddress from;
+    // Messages for other nodes are forwarded within recvfromAckTimeout
+    if (mesh->recvfromAckTimeout(nodebuf, &len, 10000, &from))
+    {
+      // The last node replies to the client
+      if (mesh->sendtoWait(reply, sizeof(reply), from) != RH_ROUTER_ERROR_NONE)
+	Serial.println("reply sendtoWait failed");
+    }
+  }
+}
+
+void setup() 
+{
+  Serial.begin(9600);
+  if (_simulator_argc > 1)
+    nodes = atoi(_simulator_argv[1]);
+  if (nodes < 2 || nodes > 254)
+  {
+    Serial.println("nodes must be 2 to 254");
+    exit(1);
+  }
+  // Unless RH_SIMULATOR_TOPOLOGY says otherwise, each node hears only its neighbours
+  if (!medium.topology().isRestricted())
+    medium.topology().chain(CLIENT_ADDRESS, nodes);
+  if (!manager.init())
+    Serial.println("init failed");
+  for (int i = CLIENT_ADDRESS + 1; i <= nodes; i++)
+    simulatorSpawn(node, new RHMesh(*new RH_Sim(medium), i));
+  delay(10); // Let the other nodes start listening
+}
+
+void loop()
+{
+  unsigned long start = millis();
+  requests++;
+  // A route to the destination will be automatically discovered.
+  if (manager.sendtoWait(data, sizeof(data), nodes) == RH_ROUTER_ERROR_NONE)
+  {
+    // Now wait for a reply from the ultimate server
+    uint8_t len = sizeof(buf);
+    RHAddress from;    
+    if (manager.recvfromAckTimeout(buf, &len, 10000, &from))
+    {
+      replies++;
+      printf("got reply from %d after %lu ms: %s\n", from, millis() - start, (char*)buf);
+    }
+    else
+      Serial.println("No reply");
+  }
+  else
+     Serial.println("sendtoWait failed");
+  if (requests == 20)
+  {
+    printf("%lu replies to %lu requests in %lu simulated seconds\n", replies, requests, millis() / 1000);
+    exit(0);
+  }
+  delay(1000);
+}
@@ -47,11 +47,11 @@ void loop()
   {
     // Now wait for a reply from the server
     uint8_t len = sizeof(buf);
-    uint8_t from;   
+    RHAddress from;   
     if (manager.recvfromAckTimeout(buf, &len, 2000, &from))
     {
       Serial.print("got reply from : 0x");
-      Serial.print(from, HEX);
+      Serial.print((unsigned int)from, HEX);
       Serial.print(": ");
       Serial.println((char*)buf);
     }
@@ -43,11 +43,11 @@ void loop()
 
   // Wait for a message addressed to us from the client
   uint8_t len = sizeof(buf);
-  uint8_t from;
+  RHAddress from;
   if (manager.recvfromAck(buf, &len, &from))
   {
       Serial.print("got request from : 0x");
-      Serial.print(from, HEX);
+      Serial.print((unsigned int)from, HEX);
       Serial.print(": ");
       Serial.println((char*)buf);
       
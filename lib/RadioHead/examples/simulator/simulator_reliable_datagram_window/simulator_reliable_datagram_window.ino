@@ -0,0 +1,177 @@
+// simulator_reliable_datagram_window.ino
+// -*- mode: C++ -*-
+// Compares RHReliableDatagram::sendtoWaitWindow() with sendtoWait() for a bulk transfer,
+// run on the simulator virtual clock with RH_Sim.
+// Node 1 sends messages to node 2, either one at a time with sendtoWait(), or in batches
+// with sendtoWaitWindow(). Node 2 receives them with recvfromAckTimeout().
+// When all the messages have been sent, one CSV line of results is printed on stdout:
+// the messages delivered, the messages the sender gave up after retrying,
+// the time the transfer took and the payload throughput of the delivered messages,
+// retransmissions, and the number and time on air of all the packets on the medium.
+// Runs are repeatable for a given RH_SIMULATOR_SEED.
+//
+// By default the link between the nodes loses nothing. A lossy link can be given with
+// RH_SIMULATOR_TOPOLOGY (see RHSimTopology.h), for example RH_SIMULATOR_TOPOLOGY="link:1:2:0.1"
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead
+// tools/simBuild examples/simulator/simulator_reliable_datagram_window/simulator_reliable_datagram_window.ino -DRH_SIMULATOR_VIRTUAL_CLOCK
+// Run with
+// ./simulator_reliable_datagram_window [-H] [-L label] [-m messages] [-l length] [-w window] [-b batch]
+// where
+// -H prints the CSV header line first
+// -L label is copied to the first column, to identify the variant being measured
+// -m messages is the number of messages to send (default 500)
+// -l length is the payload length in octets (default 50, at least 4)
+// -w window is the number of messages outstanding (see RHReliableDatagram::setWindow()).
+//    0 sends each message with sendtoWait() (default 8)
+// -b batch is the number of messages given to each sendtoWaitWindow() (default 64)
+// For example, to compare window sizes on a lossy link:
+// for w in 0 1 4 8 16 32; do RH_SIMULATOR_SEED=1 RH_SIMULATOR_TOPOLOGY="link:1:2:0.1" ./simulator_reliable_datagram_window -w $w; done
+
+#include <RHReliableDatagram.h>
+#include <RH_Sim.h>
+#include <unistd.h>
+#include <vector>
+
+#define SENDER_ADDRESS 1
+#define RECEIVER_ADDRESS 2
+
+// Configuration, from the command line
+const char* label = "";
+int messages = 500;
+int length = 50;
+int window = 8;
+int batch = 64;
+
+// The simulated ether shared by the nodes
+RHSimMedium medium;
+
+RHReliableDatagram* sender;
+RHReliableDatagram* receiver;
+
+// Results
+unsigned long delivered = 0;   // Different messages received
+unsigned long givenUp = 0;     // Messages the sender gave up
+unsigned long duration = 0;    // Time in ms the sender took
+bool done = false;
+std::vector<bool> seen;        // Messages received, indexed by sequence number
+
+// The receiver runs this in its own task
+void receiverTask(void* arg)
+{
+  (void)arg; // Not used
+  while (1)
+  {
+    uint8_t buf[RH_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(buf);
+    if (receiver->recvfromAckTimeout(buf, &len, 10000) && len >= sizeof(uint32_t))
+    {
+      uint32_t seq;
+      memcpy(&seq, buf, sizeof(seq));
+      if (seq < seen.size() && !seen[seq])
+      {
+	seen[seq] = true;
+	delivered++;
+      }
+    }
+  }
+}
+
+// The sender runs this in its own task
+void senderTask(void* arg)
+{
+  (void)arg; // Not used
+  std::vector<uint8_t> data(messages * length);
+  std::vector<uint8_t*> bufs(messages);
+  std::vector<uint8_t> lens(messages, length);
+  for (uint32_t seq = 0; seq < (uint32_t)messages; seq++)
+  {
+    bufs[seq] = &data[seq * length];
+    memcpy(bufs[seq], &seq, sizeof(seq));
+  }
+
+  // Let the receiver start listening
+  delay(10);
+  unsigned long start = millis();
+  if (window)
+  {
+    for (int first = 0; first < messages; first += batch)
+    {
+      uint8_t count = messages - first > batch ? batch : messages - first;
+      givenUp += count - sender->sendtoWaitWindow(&bufs[first], &lens[first], count, RECEIVER_ADDRESS);
+    }
+  }
+  else
+  {
+    for (int seq = 0; seq < messages; seq++)
+      if (!sender->sendtoWait(bufs[seq], length, RECEIVER_ADDRESS))
+	givenUp++;
+  }
+  duration = millis() - start;
+  done = true;
+  while (1)
+    delay(10000);
+}
+
+void setup()
+{
+  Serial.begin(9600);
+  bool header = false;
+  int opt;
+  while ((opt = getopt(_simulator_argc, _simulator_argv, "HL:m:l:w:b:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'H': header = true; break;
+    case 'L': label = optarg; break;
+    case 'm': messages = atoi(optarg); break;
+    case 'l': length = atoi(optarg); break;
+    case 'w': window = atoi(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-H] [-L label] [-m messages] [-l length] [-w window] [-b batch]\n", _simulator_argv[0]);
+      exit(1);
+    }
+  }
+  if (   messages < 1 || length < (int)sizeof(uint32_t) || length > RH_MAX_MESSAGE_LEN - 1
+      || window < 0 || window > RH_RELIABLE_DATAGRAM_MAX_WINDOW || batch < 1 || batch > 255)
+  {
+    fprintf(stderr, "invalid configuration\n");
+    exit(1);
+  }
+  if (header)
+    printf("label,messages,length,window,delivered,given_up,duration_ms,throughput_bytes_per_s,retransmissions,transmissions,airtime_ms,seed\n");
+
+  sender = new RHReliableDatagram(*new RH_Sim(medium), SENDER_ADDRESS);
+  receiver = new RHReliableDatagram(*new RH_Sim(medium), RECEIVER_ADDRESS);
+  if (!sender->init() || !receiver->init())
+  {
+    fprintf(stderr, "init failed\n");
+    exit(1);
+  }
+  if (window)
+    sender->setWindow(window);
+  seen.resize(messages);
+  simulatorSpawn(receiverTask, NULL);
+  simulatorSpawn(senderTask, NULL);
+}
+
+void loop()
+{
+  delay(1000);
+  if (!done)
+    return;
+
+  // Let the last messages arrive
+  delay(1000);
+
+  const char* seed = getenv("RH_SIMULATOR_SEED");
+  printf("%s,%d,%d,%d,%lu,%lu,%lu,%.1f,%lu,%lu,%.1f,%s\n",
+	 label, messages, length, window, delivered, givenUp, duration,
+	 duration ? delivered * length * 1000.0 / duration : 0.0,
+	 (unsigned long)(sender->retransmissions() + receiver->retransmissions()),
+	 (unsigned long)medium.transmissions(), medium.airtime() / 1000.0,
+	 seed ? seed : "");
+  exit(0);
+}
@@ -0,0 +1,661 @@
+// etherSimulator.cpp
+//
+// Simulates the luminiferous ether for RH_TCP.
+// Native replacement for etherSimulator.pl, without the dependency on Perl POE.
+// Connects multiple instances of RH_TCP clients together and passes
+// simulated messages between them, using the protocol defined in RHTcpProtocol.h
+//
+// Uses a single epoll event loop. All available input from each client is read and
+// processed in one pass, and output to each client is gathered and written once per pass,
+// so it scales to hundreds of simulated nodes.
+// Pending deliveries are kept in a heap, and a timerfd wakes the loop at the exact
+// time the next delivery is due.
+//
+// Reads the same config file format (chain.conf) as etherSimulator.pl, with the
+// addition of the link, oneway, chain, grid, rssi and snr lines of RHSimTopology.h.
+// Without -c, the topology is taken from the RH_SIMULATOR_TOPOLOGY environment variable
+// if it is set, otherwise every node hears every other.
+//
+// Radio model:
+// Each packet occupies the ether for its LoRa time on air, calculated from the spreading factor,
+// bandwidth, coding rate, preamble and length the same way as the RH_RF95 modem configurations
+// (see RHLoRaAirtime.h). The default is RH_RF95::Bw125Cr45Sf128 with an 8 symbol preamble.
+// With -b, the time on air is instead the length at a fixed bit rate, as in etherSimulator.pl.
+// A node that is transmitting cannot receive. When two packets overlap at a receiver, the stronger
+// is received (captured) only if its RSSI exceeds the other by at least the capture margin,
+// otherwise both are corrupted.
+//
+// Linux only.
+// Build with:
+// cd whatever/RadioHead
+// g++ -O2 -I . tools/etherSimulator.cpp RHLoRaAirtime.cpp RHSimTopology.cpp RHPcapFile.cpp -o etherSimulator
+// Run with:
+// ./etherSimulator [-h] [-c configfile] [-p portnumber] [-b bitspersec]
+//                  [-m modemconfig] [-s sf] [-w bandwidth] [-r cr] [-l preamble] [-C capturemargin]
+//                  [-P capturefile]
+// where
+// -m modemconfig is the index of one of RH_RF95::ModemConfigChoice (0 to 4)
+// -s, -w, -r and -l override the spreading factor (6 to 12), bandwidth (Hz),
+//    coding rate denominator (5 to 8) and preamble length (symbols)
+// -C capturemargin is the RSSI margin in dB needed to capture an overlapping packet (default 6)
+// -P capturefile writes every packet put on the air, and every reception of it (including
+//    those lost in collisions), to a pcap ring file (see RHPcapFile.h and tools/radiohead.lua)
+//
+// Copyright (C) 2014 Mike McCauley
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <queue>
+#include <vector>
+#include <RHTcpProtocol.h>
+#include <RHLoRaAirtime.h>
+#include <RHSimTopology.h>
+#include <RHPcapFile.h>
+
+// Maximum number of epoll events handled in one pass
+#define ETHER_MAX_EVENTS 256
+
+// Longest frame we accept from a client, including the length
+#define ETHER_MAX_FRAME_LEN (sizeof(uint32_t) + RH_TCP_MAX_PAYLOAD_LEN + 1)
+
+// epoll data values for the non-client file descriptors
+#define ETHER_LISTEN_TAG ((uint64_t)-1)
+#define ETHER_TIMER_TAG  ((uint64_t)-2)
+
+// Reception client value once the receiving client has disconnected
+#define ETHER_NO_CLIENT ((size_t)-1)
+
+// RSSI in dBm of links without an rssi line in the config file
+#define ETHER_DEFAULT_RSSI -80
+
+/// Data about RH_TCP messages to and from one connected client
+typedef struct
+{
+    int         fd;                   ///< Socket, -1 if the slot is free
+    int         thisAddress;          ///< Node address of the client, -1 until it tells us
+    uint8_t     inBuf[ETHER_MAX_FRAME_LEN * 8]; ///< Partially received input
+    size_t      inLen;
+    std::vector<uint8_t> outBuf;      ///< Output waiting to be written
+    bool        wantOut;              ///< EPOLLOUT is enabled because outBuf could not be written
+    bool        dirty;                ///< outBuf has data added in this pass
+    uint64_t    txEnd;                ///< Monotonic time in nanoseconds when the current transmission ends
+    std::vector<size_t> receptions;   ///< Indexes of the packets this client is currently receiving
+} Client;
+
+/// A packet being received by a client
+typedef struct
+{
+    size_t      client;     ///< Index of the receiving client, ETHER_NO_CLIENT if it has gone
+    uint64_t    end;        ///< Monotonic time in nanoseconds when the transmission ends
+    int         rssi;       ///< Received signal strength in dBm
+    int         snr;        ///< Signal to noise ratio in dB
+    bool        corrupted;  ///< Collided with another packet
+    uint8_t     frame[ETHER_MAX_FRAME_LEN]; ///< Frame to deliver, including length
+    size_t      frameLen;
+} Reception;
+
+/// A reception waiting for its simulated transmission time to elapse
+typedef struct
+{
+    uint64_t    due;        ///< Monotonic time in nanoseconds when it is delivered
+    size_t      reception;  ///< Index of the Reception
+} Delivery;
+
+struct DeliveryLater
+{
+    bool operator()(const Delivery& a, const Delivery& b) const { return a.due > b.due; }
+};
+
+// Configurable variables
+static int      port = 4000;
+static uint32_t bps = 0; // 0 means use the LoRa time on air
+static RHLoRaModemParams modem;
+static int      captureMargin = 6;
+
+// Which nodes hear each other, read from the config file
+static RHSimTopology topology;
+
+// Capture of every packet, if -P was given
+static RHPcapFile capture;
+
+static std::vector<Client*> clients;
+static std::vector<Reception> receptions;
+static std::vector<size_t>  freeReceptions;
+static std::vector<size_t>  dirtyClients;
+static std::priority_queue<Delivery, std::vector<Delivery>, DeliveryLater> deliveries;
+static int      epfd;
+static int      timerfd;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-h] [-c configfile] [-p portnumber] [-b bitspersec]\n"
+	    "\t[-m modemconfig] [-s sf] [-w bandwidth] [-r cr] [-l preamble] [-C capturemargin]\n"
+	    "\t[-P capturefile]\n", prog);
+    exit(1);
+}
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Return true if the message is simulated to have been received successfully
+// taking into account the topology and the loss on the link.
+// Clients that have not told us their address always hear and are heard
+static bool willDeliverFromTo(int from, int to)
+{
+    if (from < 0 || to < 0)
+	return true;
+    if (!topology.isNeighbour(from, to))
+	return false;
+    float loss = topology.loss(from, to);
+    return loss <= 0.0 || drand48() >= loss;
+}
+
+static int rssiFromTo(int from, int to)
+{
+    if (from < 0 || to < 0)
+	return ETHER_DEFAULT_RSSI;
+    return topology.rssi(from, to);
+}
+
+static int snrFromTo(int from, int to)
+{
+    if (from < 0 || to < 0)
+	return RH_SIM_TOPOLOGY_DEFAULT_SNR;
+    return topology.snr(from, to);
+}
+
+// Capture an RH_TCP packet frame, including its length and type, if capturing
+static void captureFrame(uint8_t direction, int node, const uint8_t* frame, size_t frameLen, int rssi, int snr)
+{
+    const RHTcpPacket* packet = (const RHTcpPacket*)frame;
+    size_t headerLen = sizeof(uint32_t) + 5; // length, type, to, from, id, flags
+    if (frameLen < headerLen)
+	return;
+    RHCapture::Record record;
+    record.direction = direction;
+    record.node = node;
+    record.to = packet->to;
+    record.from = packet->from;
+    record.id = packet->id;
+    record.flags = packet->flags;
+    record.rssi = rssi;
+    record.snr = snr;
+    record.len = frameLen - headerLen;
+    record.payload = packet->payload;
+    capture.capture(record);
+}
+
+// Time on air in nanoseconds of a frame with len octets of headers and payload
+static uint64_t timeOnAir(size_t len)
+{
+    if (bps)
+	return (uint64_t)len * 8 * 1000000000ULL / bps;
+    return (uint64_t)RHLoRaTimeOnAir(&modem, len) * 1000;
+}
+
+// Arm the timer for the earliest pending delivery
+static void armTimer()
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (!deliveries.empty())
+    {
+	uint64_t due = deliveries.top().due;
+	its.it_value.tv_sec = due / 1000000000ULL;
+	its.it_value.tv_nsec = due % 1000000000ULL;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+	    its.it_value.tv_nsec = 1; // 0 would disarm the timer
+    }
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void closeClient(size_t index)
+{
+    Client* c = clients[index];
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->outBuf.clear();
+    // Anything it was receiving is lost. The slot may be reused before it is due, 
+    // so it must not be delivered to whoever is in it then
+    for (size_t i = 0; i < c->receptions.size(); i++)
+	receptions[c->receptions[i]].client = ETHER_NO_CLIENT;
+    c->receptions.clear();
+}
+
+// Queue output for a client. It is written at the end of the current pass
+static void queueOutput(size_t index, const uint8_t* data, size_t len)
+{
+    Client* c = clients[index];
+    c->outBuf.insert(c->outBuf.end(), data, data + len);
+    if (!c->dirty)
+    {
+	c->dirty = true;
+	dirtyClients.push_back(index);
+    }
+}
+
+static void flushClient(size_t index)
+{
+    Client* c = clients[index];
+    while (c->fd >= 0 && !c->outBuf.empty())
+    {
+	ssize_t count = write(c->fd, c->outBuf.data(), c->outBuf.size());
+	if (count < 0)
+	{
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    if (errno == EINTR)
+		continue;
+	    closeClient(index);
+	    return;
+	}
+	c->outBuf.erase(c->outBuf.begin(), c->outBuf.begin() + count);
+    }
+    bool wantOut = c->fd >= 0 && !c->outBuf.empty();
+    if (c->fd >= 0 && wantOut != c->wantOut)
+    {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	if (wantOut)
+	    ev.events |= EPOLLOUT;
+	ev.data.u64 = index;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->wantOut = wantOut;
+    }
+}
+
+// Start receiving a packet at client index, resolving collisions with
+// any other packets it is already receiving
+static void startReception(size_t index, uint64_t end, int rssi, int snr, const uint8_t* frame, size_t frameLen)
+{
+    Client* c = clients[index];
+    size_t r;
+    if (freeReceptions.empty())
+    {
+	r = receptions.size();
+	receptions.push_back(Reception());
+    }
+    else
+    {
+	r = freeReceptions.back();
+	freeReceptions.pop_back();
+    }
+    Reception* n = &receptions[r];
+    n->client = index;
+    n->end = end;
+    n->rssi = rssi;
+    n->snr = snr;
+    n->corrupted = false;
+    memcpy(n->frame, frame, frameLen);
+    n->frameLen = frameLen;
+
+    for (size_t i = 0; i < c->receptions.size(); i++)
+    {
+	// Overlaps with this one. The stronger survives only if it exceeds the capture margin
+	Reception* o = &receptions[c->receptions[i]];
+	if (n->rssi < o->rssi + captureMargin)
+	    n->corrupted = true;
+	if (o->rssi < n->rssi + captureMargin)
+	    o->corrupted = true;
+    }
+    c->receptions.push_back(r);
+
+    Delivery d;
+    d.due = end;
+    d.reception = r;
+    deliveries.push(d);
+}
+
+// New packet for transmission from client index.
+// Try to deliver it to all the other clients
+static void transmit(size_t index, const uint8_t* frame, size_t frameLen)
+{
+    Client* sender = clients[index];
+    uint64_t t = now();
+    uint64_t end = t + timeOnAir(frameLen - sizeof(uint32_t) - 1);
+
+    // Cant receive while transmitting: anything the sender was receiving is lost
+    sender->txEnd = end;
+    captureFrame(RH_CAPTURE_AIR, sender->thisAddress, frame, frameLen, 0, 0);
+    for (size_t i = 0; i < sender->receptions.size(); i++)
+	receptions[sender->receptions[i]].corrupted = true;
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+	Client* c = clients[i];
+	if (i == index || c->fd < 0)
+	    continue; // Dont deliver back to the same client
+
+	// Check the network config and see if delivery to this node is possible
+	if (!willDeliverFromTo(sender->thisAddress, c->thisAddress))
+	    continue;
+
+	// Half duplex: cant hear anything while transmitting
+	if (c->txEnd > t)
+	    continue;
+
+	// The packet reached this destination, deliver it to the client after the
+	// time on air is complete, unless it collides with another packet
+	startReception(i, end, rssiFromTo(sender->thisAddress, c->thisAddress),
+		       snrFromTo(sender->thisAddress, c->thisAddress), frame, frameLen);
+    }
+}
+
+// Deliver all the packets whose transmission time has elapsed
+static void deliverMessages()
+{
+    uint64_t t = now();
+    while (!deliveries.empty() && deliveries.top().due <= t)
+    {
+	size_t r = deliveries.top().reception;
+	deliveries.pop();
+	Reception* n = &receptions[r];
+	if (n->client == ETHER_NO_CLIENT)
+	{
+	    freeReceptions.push_back(r);
+	    continue;
+	}
+	Client* c = clients[n->client];
+	for (size_t i = 0; i < c->receptions.size(); i++)
+	{
+	    if (c->receptions[i] == r)
+	    {
+		c->receptions.erase(c->receptions.begin() + i);
+		break;
+	    }
+	}
+	if (c->fd >= 0)
+	{
+	    captureFrame(n->corrupted ? RH_CAPTURE_COLLIDED : RH_CAPTURE_RX, c->thisAddress,
+			 n->frame, n->frameLen, n->rssi, n->snr);
+	    if (!n->corrupted)
+		queueOutput(n->client, n->frame, n->frameLen);
+	}
+	freeReceptions.push_back(r);
+    }
+}
+
+// Process all complete frames in the clients input buffer
+static void processInput(size_t index)
+{
+    Client* c = clients[index];
+    size_t offset = 0;
+    while (c->fd >= 0 && c->inLen - offset >= sizeof(uint32_t) + 1)
+    {
+	RHTcpTypeMessage* message = (RHTcpTypeMessage*)(c->inBuf + offset);
+	uint32_t len = ntohl(message->length);
+	size_t frameLen = len + sizeof(uint32_t);
+	if (len < 1 || frameLen > ETHER_MAX_FRAME_LEN)
+	{
+	    fprintf(stderr, "etherSimulator: client sent ridiculous length: %u. Disconnecting\n", len);
+	    closeClient(index);
+	    return;
+	}
+	if (c->inLen - offset < frameLen)
+	    break; // Wait for the rest
+
+	if (message->type == RH_TCP_MESSAGE_TYPE_THISADDRESS && len >= 2)
+	{
+	    // Client notifies us of its node ID
+	    c->thisAddress = ((RHTcpThisAddress*)message)->thisAddress;
+	}
+	else if (message->type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
+	{
+	    // Other clients receive exactly the same frame
+	    transmit(index, c->inBuf + offset, frameLen);
+	}
+	offset += frameLen;
+    }
+    // Remove the used messages, keeping the start of the next
+    if (offset)
+    {
+	memmove(c->inBuf, c->inBuf + offset, c->inLen - offset);
+	c->inLen -= offset;
+    }
+}
+
+static void readClient(size_t index)
+{
+    Client* c = clients[index];
+    while (c->fd >= 0)
+    {
+	ssize_t count = read(c->fd, c->inBuf + c->inLen, sizeof(c->inBuf) - c->inLen);
+	if (count < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		closeClient(index);
+	    return;
+	}
+	if (count == 0)
+	{
+	    // Client disconnected
+	    closeClient(index);
+	    return;
+	}
+	c->inLen += count;
+	processInput(index);
+    }
+}
+
+static void acceptClients(int listenfd)
+{
+    while (1)
+    {
+	int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+	    return; // EAGAIN: no more pending connections
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	// Reuse a free slot if possible
+	size_t index;
+	for (index = 0; index < clients.size(); index++)
+	    if (clients[index]->fd < 0)
+		break;
+	if (index == clients.size())
+	    clients.push_back(new Client);
+	Client* c = clients[index];
+	c->fd = fd;
+	c->thisAddress = -1;
+	c->inLen = 0;
+	c->outBuf.clear();
+	c->wantOut = false;
+	c->dirty = false;
+	c->txEnd = 0;
+	c->receptions.clear();
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = index;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Set by SIGINT and SIGTERM. The main loop then finishes the capture file and exits
+static volatile sig_atomic_t terminating = 0;
+
+static void terminate(int sig)
+{
+    (void)sig; // Not used
+    terminating = 1;
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+    bool configured = false;
+    RHLoRaModemParamsFromRF95Config(0, 8, &modem); // Bw125Cr45Sf128, the RH_RF95 default
+    // Options that modify the modem config are applied after -m
+    int sf = 0, bw = 0, cr = 0, preamble = -1;
+    while ((opt = getopt(argc, argv, "hc:b:p:m:s:w:r:l:C:P:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'c':
+	    if (!topology.load(optarg))
+		exit(1);
+	    configured = true;
+	    break;
+	case 'b':
+	    bps = atoi(optarg);
+	    if (!bps)
+		usage(argv[0]);
+	    break;
+	case 'p':
+	    port = atoi(optarg);
+	    break;
+	case 'm':
+	    if (!RHLoRaModemParamsFromRF95Config(atoi(optarg), modem.preamble, &modem))
+		usage(argv[0]);
+	    break;
+	case 's':
+	    sf = atoi(optarg);
+	    break;
+	case 'w':
+	    bw = atoi(optarg);
+	    break;
+	case 'r':
+	    cr = atoi(optarg);
+	    break;
+	case 'l':
+	    preamble = atoi(optarg);
+	    break;
+	case 'C':
+	    captureMargin = atoi(optarg);
+	    break;
+	case 'P':
+	    if (!capture.open(optarg))
+		exit(1);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (!configured && RHSimTopology::fromEnvironment())
+	topology = *RHSimTopology::fromEnvironment();
+    if (sf)
+    {
+	if (sf < 6 || sf > 12)
+	    usage(argv[0]);
+	modem.sf = sf;
+    }
+    if (bw)
+	modem.bw = bw;
+    if (cr)
+    {
+	if (cr < 5 || cr > 8)
+	    usage(argv[0]);
+	modem.cr = cr;
+    }
+    if (preamble >= 0)
+	modem.preamble = preamble;
+    if (sf || bw)
+    {
+	// Same rule as RH_RF95::setLowDatarate(): on if the symbol time exceeds 16ms
+	modem.lowDataRateOptimize = (1000.0 * (1UL << modem.sf) / modem.bw) > 16.0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, terminate);
+    signal(SIGTERM, terminate);
+    // SIGINT and SIGTERM are only let in during epoll_pwait(), so they are never missed between 
+    // testing terminating and waiting
+    sigset_t blocked, waiting;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+    srand48(getpid() ^ time(NULL));
+
+    int listenfd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    int off = 0;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // Accept IPV4 too
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (   bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+	|| listen(listenfd, SOMAXCONN) < 0)
+    {
+	fprintf(stderr, "etherSimulator: could not listen on port %d: %s\n", port, strerror(errno));
+	return 1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = ETHER_LISTEN_TAG;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.u64 = ETHER_TIMER_TAG;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+
+    struct epoll_event events[ETHER_MAX_EVENTS];
+    while (!terminating)
+    {
+	int n = epoll_pwait(epfd, events, ETHER_MAX_EVENTS, -1, &waiting);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "etherSimulator: epoll_pwait failed: %s\n", strerror(errno));
+	    return 1;
+	}
+	for (int i = 0; i < n; i++)
+	{
+	    uint64_t tag = events[i].data.u64;
+	    if (tag == ETHER_LISTEN_TAG)
+		acceptClients(listenfd);
+	    else if (tag == ETHER_TIMER_TAG)
+	    {
+		uint64_t expirations;
+		// EAGAIN is a spurious wakeup, and deliverMessages() will sort it out
+		if (   read(timerfd, &expirations, sizeof(expirations)) < 0
+		    && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		    fprintf(stderr, "etherSimulator: timer read failed: %s\n", strerror(errno));
+	    }
+	    else
+	    {
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		    readClient(tag);
+		if (events[i].events & EPOLLOUT)
+		    flushClient(tag);
+	    }
+	}
+	deliverMessages();
+	// Write everything queued in this pass
+	for (size_t i = 0; i < dirtyClients.size(); i++)
+	{
+	    clients[dirtyClients[i]]->dirty = false;
+	    flushClient(dirtyClients[i]);
+	}
+	dirtyClients.clear();
+	armTimer();
+    }
+    // Finish the capture file on the way out
+    capture.close();
+    return 0;
+}
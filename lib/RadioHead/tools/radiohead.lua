@@ -0,0 +1,80 @@
+-- radiohead.lua
+--
+-- Wireshark dissector for RadioHead packets captured by RHPcapFile
+-- (pcap link type LINKTYPE_USER0, 147).
+-- Install by copying to your Wireshark personal plugins directory
+-- (see Help->About Wireshark->Folders), or run with
+-- wireshark -X lua_script:tools/radiohead.lua capture.pcap
+-- tshark -X lua_script:tools/radiohead.lua -r capture.pcap
+--
+-- Copyright (C) 2014 Mike McCauley
+
+local radiohead = Proto("radiohead", "RadioHead")
+
+local directions = {
+    [0] = "Received",
+    [1] = "Sent",
+    [2] = "On air",
+    [3] = "Collided",
+}
+
+local f = radiohead.fields
+f.version   = ProtoField.uint8("radiohead.version", "Record version")
+f.direction = ProtoField.uint8("radiohead.direction", "Direction", base.DEC, directions)
+f.node      = ProtoField.uint8("radiohead.node", "Capturing node")
+f.snr       = ProtoField.int8("radiohead.snr", "SNR (dB)")
+f.rssi      = ProtoField.int16("radiohead.rssi", "RSSI (dBm)")
+f.to        = ProtoField.uint8("radiohead.to", "To")
+f.from      = ProtoField.uint8("radiohead.from", "From")
+f.id        = ProtoField.uint8("radiohead.id", "Id")
+f.flags     = ProtoField.uint8("radiohead.flags", "Flags", base.HEX)
+f.ack       = ProtoField.bool("radiohead.flags.ack", "Ack", 8, nil, 0x80)
+f.length    = ProtoField.uint8("radiohead.length", "Payload length")
+f.payload   = ProtoField.bytes("radiohead.payload", "Payload")
+
+function radiohead.dissector(buffer, pinfo, tree)
+    if buffer:len() < 11 then
+        return 0
+    end
+    local version = buffer(0, 1):uint()
+    pinfo.cols.protocol = "RadioHead"
+    local subtree = tree:add(radiohead, buffer(), "RadioHead")
+    subtree:add(f.version, buffer(0, 1))
+    if version == 0 then
+        pinfo.cols.info = "Unused record"
+        return buffer:len()
+    end
+    local direction = buffer(1, 1):uint()
+    local to = buffer(6, 1):uint()
+    local from = buffer(7, 1):uint()
+    local id = buffer(8, 1):uint()
+    local flags = buffer(9, 1):uint()
+    local length = buffer(10, 1):uint()
+    if length > buffer:len() - 11 then
+        length = buffer:len() - 11
+    end
+
+    subtree:add(f.direction, buffer(1, 1))
+    subtree:add(f.node, buffer(2, 1))
+    subtree:add(f.snr, buffer(3, 1))
+    subtree:add(f.rssi, buffer(4, 2))
+    subtree:add(f.to, buffer(6, 1))
+    subtree:add(f.from, buffer(7, 1))
+    subtree:add(f.id, buffer(8, 1))
+    local flagtree = subtree:add(f.flags, buffer(9, 1))
+    flagtree:add(f.ack, buffer(9, 1))
+    subtree:add(f.length, buffer(10, 1))
+    if length > 0 then
+        subtree:add(f.payload, buffer(11, length))
+    end
+
+    pinfo.cols.src = tostring(from)
+    pinfo.cols.dst = tostring(to)
+    pinfo.cols.info = string.format("%s at node %d: %d -> %d id %d flags 0x%02x%s len %d",
+                                    directions[direction] or "?", buffer(2, 1):uint(),
+                                    from, to, id, flags,
+                                    (flags >= 0x80) and " ACK" or "", length)
+    return buffer:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, radiohead)
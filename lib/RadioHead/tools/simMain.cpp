@@ -1,5 +1,8 @@
 // main.cpp
 // Lets Arduino RadioHead sketches run within a simulator on Linux as a single process
+// If built with -DRH_SIMULATOR_VIRTUAL_CLOCK, time is simulated by a discrete-event
+// virtual clock instead of the real time of day, and the sketch can run other
+// simulated nodes as cooperative tasks, see RHutil/simulator.h
 // Copyright (C) 2014 Mike McCauley
 // $Id: simMain.cpp,v 1.3 2020/08/05 04:32:19 mikem Exp mikem $
 
@@ -11,6 +14,12 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <time.h>
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+#include <queue>
+#include <vector>
+#include <deque>
+#include <ucontext.h>
+#endif
 
 SerialSimulator Serial;
 
@@ -18,12 +27,260 @@ SerialSimulator Serial;
 extern void setup();
 extern void loop();
 
-// Millis at the start of the process
-unsigned long start_millis;
-
 int    _simulator_argc;
 char** _simulator_argv;
 
+#ifdef RH_SIMULATOR_VIRTUAL_CLOCK
+
+// Simulated microseconds since the start of the process
+static uint64_t virtual_micros = 0;
+
+// A cooperative task. Tasks switch only when they wait in simulatorRunUntil()
+struct SimulatorTask
+{
+    ucontext_t            context;
+    SimulatorTaskFunction function;
+    void*                 arg;
+    void*                 stack;    // NULL for the main task, which runs on the process stack
+    bool                  waiting;  // Blocked in simulatorRunUntil()
+    bool                  woken;    // Woken by simulatorWakeupTask() rather than by the timeout
+    bool                  finished; // function has returned
+    uint32_t              waitSeq;  // Identifies the current wait, so stale timeouts can be ignored
+    uint32_t              timeouts; // Number of timeout events in the queue for this task
+};
+
+typedef struct
+{
+    uint64_t              when;    // Simulated time the event falls due
+    uint32_t              seq;     // Tie breaker, keeps events with equal times in FIFO order
+    SimulatorEventHandler handler; // NULL for the timeout of a wait by task
+    void*                 arg;
+    SimulatorTask*        task;
+    uint32_t              waitSeq;
+} SimulatorEvent;
+
+// Orders the priority queue so the earliest event is on top
+struct SimulatorEventLater
+{
+    bool operator()(const SimulatorEvent& a, const SimulatorEvent& b) const
+    {
+	return a.when > b.when || (a.when == b.when && a.seq > b.seq);
+    }
+};
+
+static std::priority_queue<SimulatorEvent, std::vector<SimulatorEvent>, SimulatorEventLater> events;
+static uint32_t event_seq = 0;
+
+// The sketch runs as the main task
+static SimulatorTask  main_task;
+static SimulatorTask* current_task = &main_task;
+static std::vector<SimulatorTask*> tasks(1, &main_task);
+static std::deque<SimulatorTask*>  runnable;
+
+// The scheduler runs in its own context, started by the first wait
+#define SIMULATOR_SCHEDULER_STACK_SIZE (256 * 1024)
+static ucontext_t     scheduler_context;
+static bool           scheduler_started = false;
+
+uint64_t simulatorMicros()
+{
+    return virtual_micros;
+}
+
+static void pushEvent(uint64_t when, SimulatorEventHandler handler, void* arg, SimulatorTask* task)
+{
+    SimulatorEvent e;
+    e.when = when < virtual_micros ? virtual_micros : when; // Never schedule in the past
+    e.seq = event_seq++;
+    e.handler = handler;
+    e.arg = arg;
+    e.task = task;
+    e.waitSeq = task ? task->waitSeq : 0;
+    events.push(e);
+}
+
+void simulatorSchedule(uint64_t when, SimulatorEventHandler handler, void* arg)
+{
+    pushEvent(when, handler, arg, NULL);
+}
+
+// Make a waiting task runnable again
+static void resumeTask(SimulatorTask* task, bool woken)
+{
+    task->waiting = false;
+    task->woken = woken;
+    runnable.push_back(task);
+}
+
+static void deleteTask(SimulatorTask* task)
+{
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+	if (tasks[i] == task)
+	{
+	    tasks.erase(tasks.begin() + i);
+	    break;
+	}
+    }
+    free(task->stack);
+    delete task;
+}
+
+// Runs the tasks and events in simulated time order. Never returns
+static void scheduler()
+{
+    while (1)
+    {
+	if (!runnable.empty())
+	{
+	    // Tasks made runnable at the current time run before any later event
+	    SimulatorTask* task = runnable.front();
+	    runnable.pop_front();
+	    current_task = task;
+	    swapcontext(&scheduler_context, &task->context);
+	    current_task = NULL;
+	    if (task->finished && !task->timeouts)
+		deleteTask(task);
+	}
+	else if (!events.empty())
+	{
+	    SimulatorEvent e = events.top();
+	    events.pop();
+	    virtual_micros = e.when;
+	    if (e.handler)
+		e.handler(e.arg);
+	    else
+	    {
+		SimulatorTask* task = e.task;
+		task->timeouts--;
+		if (task->waiting && task->waitSeq == e.waitSeq)
+		    resumeTask(task, false);
+		else if (task->finished && !task->timeouts)
+		    deleteTask(task);
+	    }
+	}
+	else
+	{
+	    // Nothing left that could wake anyone. Tasks waiting forever return without
+	    // advancing the clock, and decide for themselves what to do next
+	    bool any = false;
+	    for (size_t i = 0; i < tasks.size(); i++)
+	    {
+		if (tasks[i]->waiting)
+		{
+		    resumeTask(tasks[i], false);
+		    any = true;
+		}
+	    }
+	    if (!any)
+		exit(0); // All tasks have finished
+	}
+    }
+}
+
+bool simulatorRunUntil(uint64_t until)
+{
+    SimulatorTask* task = current_task;
+    if (!task)
+	return false; // Called from an event handler, which must not wait
+    if (!scheduler_started)
+    {
+	getcontext(&scheduler_context);
+	scheduler_context.uc_stack.ss_sp = malloc(SIMULATOR_SCHEDULER_STACK_SIZE);
+	scheduler_context.uc_stack.ss_size = SIMULATOR_SCHEDULER_STACK_SIZE;
+	scheduler_context.uc_link = NULL;
+	makecontext(&scheduler_context, scheduler, 0);
+	scheduler_started = true;
+    }
+    task->waiting = true;
+    task->woken = false;
+    task->waitSeq++;
+    if (until != SIMULATOR_FOREVER)
+    {
+	pushEvent(until, NULL, NULL, task);
+	task->timeouts++;
+    }
+    swapcontext(&task->context, &scheduler_context);
+    return task->woken;
+}
+
+void simulatorWakeupTask(SimulatorTask* task)
+{
+    if (task && task->waiting)
+	resumeTask(task, true);
+}
+
+void simulatorWakeup()
+{
+    simulatorWakeupTask(&main_task);
+}
+
+SimulatorTask* simulatorCurrentTask()
+{
+    return current_task;
+}
+
+// First function run by a new task
+static void taskStart()
+{
+    SimulatorTask* task = current_task;
+    task->function(task->arg);
+    task->finished = true;
+    // Returning resumes the scheduler through uc_link
+}
+
+SimulatorTask* simulatorSpawn(SimulatorTaskFunction function, void* arg, size_t stacksize)
+{
+    SimulatorTask* task = new SimulatorTask;
+    memset(task, 0, sizeof(*task));
+    task->function = function;
+    task->arg = arg;
+    task->stack = malloc(stacksize);
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = stacksize;
+    task->context.uc_link = &scheduler_context;
+    makecontext(&task->context, taskStart, 0);
+    tasks.push_back(task);
+    runnable.push_back(task);
+    return task;
+}
+
+// Run the Arduino standard functions in the main loop
+int main(int argc, char** argv)
+{
+    // Let simulated program have access to argc and argv
+    _simulator_argc = argc;
+    _simulator_argv = argv;
+    // Seed the random number generator. Runs are repeatable if RH_SIMULATOR_SEED is set
+    const char* seed = getenv("RH_SIMULATOR_SEED");
+    if (seed)
+	srand(atoi(seed));
+    else
+	srand(getpid() ^ (unsigned) time(NULL)/2);
+    setup();
+    while (1)
+	loop();
+}
+
+void delay(unsigned long ms)
+{
+    uint64_t until = virtual_micros + (uint64_t)ms * 1000;
+    while (simulatorRunUntil(until))
+	; // Wakeups do not end a delay
+}
+
+// Arduino equivalent, milliseconds since process start
+unsigned long millis()
+{
+    return virtual_micros / 1000;
+}
+
+#else
+
+// Millis at the start of the process
+unsigned long start_millis;
+
 // Returns milliseconds since beginning of day
 unsigned long time_in_millis()
 {    
@@ -58,6 +315,8 @@ unsigned long millis()
     return time_in_millis() - start_millis;
 }
 
+#endif // RH_SIMULATOR_VIRTUAL_CLOCK
+
 long random(long from, long to)
 {
     return from + (random() % (to - from));
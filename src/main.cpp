@@ -1,4 +1,5 @@
 #include <EEPROM.h>
+#include <Preferences.h>
 #include <RHRouter.h>
 #include <RHMesh.h>
 #include <RH_RF95.h>
@@ -6,7 +7,10 @@
 #define LED 13
 #define N_NODES 4 // Total number of nodes: N1, N2, N3, N4
 #define EEPROM_ADDRESS 0 // EEPROM address to store node ID
+#define EEPROM_ROUTES_ADDRESS 1 // EEPROM address of the static route count, followed by (dest, next hop) pairs
+#define EEPROM_SIZE (EEPROM_ROUTES_ADDRESS + 1 + (N_NODES - 1) * 2)
 #define CSMA_WAIT_TIME 100 // Maximum wait time before retrying (in milliseconds)
+#define SNAPSHOT_KEY "rhstate" // NVS key of the routing table and sequence numbers, kept across reboots
 
 /*// Pin definitions for TTGO LoRa V1
 #define RFM95_CS 18    // Chip Select
@@ -32,9 +36,20 @@ uint8_t sentCounter1 = 0;
 uint8_t sentCounter2 = 0;
 uint8_t sentCounter4 = 0;
 
+// Static routes of the chain N1-N2-N3-N4, as (dest, next hop) pairs, used if none are stored in EEPROM.
+// With them the nodes send straight away after power up, without route discovery
+const uint8_t chainRoutes[N_NODES][(N_NODES - 1) * 2] = {
+    { 2, 2,   3, 2,   4, 2 }, // N1
+    { 1, 1,   3, 3,   4, 3 }, // N2
+    { 1, 2,   2, 2,   4, 4 }, // N3
+    { 1, 3,   2, 3,   3, 3 }, // N4
+};
+
 RH_RF95 rf95(RFM95_CS, RFM95_INT); // RF95 driver with specified pins
 RHMesh *manager; // Mesh manager
 char buf[RH_MESH_MAX_MESSAGE_LEN]; // Buffer for messages
+Preferences preferences; // NVS namespace for the mesh state
+uint8_t snapshotImage[RH_ROUTER_SNAPSHOT_MAX_LEN]; // Image of the mesh state written to NVS
 
 void setup() {
     randomSeed(analogRead(0));
@@ -42,6 +57,8 @@ void setup() {
     Serial.begin(115200);
     while (!Serial); // Wait for Serial Monitor
 
+    EEPROM.begin(EEPROM_SIZE);
+
     // Read node ID from EEPROM
     nodeId = EEPROM.read(EEPROM_ADDRESS);
 
@@ -62,6 +79,28 @@ void setup() {
         Serial.println(F("Initialization failed"));
         return;
     }
+
+    // Warm start: put back the routes and sequence numbers saved before the last reboot,
+    // so forwarding carries on without route discovery. The static routes are added after it
+    preferences.begin("mesh", false);
+    size_t snapshotLen = preferences.getBytes(SNAPSHOT_KEY, snapshotImage, sizeof(snapshotImage));
+    if (snapshotLen && manager->restore(snapshotImage, snapshotLen))
+        Serial.println(F("Mesh state restored"));
+
+    // Load the static routes from EEPROM, or the compiled in chain if there are none.
+    // Route discovery is then only needed for destinations outside the chain
+    uint8_t routes[(N_NODES - 1) * 2];
+    uint8_t routeCount = EEPROM.read(EEPROM_ROUTES_ADDRESS);
+    if (routeCount >= 1 && routeCount <= N_NODES - 1) {
+        for (uint8_t i = 0; i < routeCount * 2; i++)
+            routes[i] = EEPROM.read(EEPROM_ROUTES_ADDRESS + 1 + i);
+    } else {
+        routeCount = N_NODES - 1;
+        memcpy(routes, chainRoutes[nodeId - 1], sizeof(routes));
+    }
+    manager->addStaticRoutes(routes, routeCount);
+    Serial.print(F("Static routes: "));
+    Serial.println(routeCount);
     
     // Configure RF95
     rf95.setFrequency(915.0);
@@ -143,5 +182,10 @@ void loop() {
         }
     }
 
+    // Save the mesh state if it has changed, at most once every RH_SNAPSHOT_INTERVAL ms to spare the flash
+    uint16_t imageLen = manager->snapshotIfDue(snapshotImage, sizeof(snapshotImage));
+    if (imageLen)
+        preferences.putBytes(SNAPSHOT_KEY, snapshotImage, imageLen);
+
     delay(2000); // Delay before next transmission
 }